@@ -6,7 +6,7 @@ _laminarc() {
 	_init_completion || return
 	if [ "$cword" -gt 1 ]; then
 		case "${words[1]}" in
-			queue|start|run)
+			queue|start|run|show)
 				if [ "$cword" -eq 2 ]; then
 					COMPREPLY+=($(compgen -W "$(laminarc show-jobs)" -- ${cur}))
 				fi
@@ -20,7 +20,7 @@ _laminarc() {
 				;;
 		esac
 	else
-		local cmds="queue start run set show-jobs show-queued show-running abort"
+		local cmds="queue start run set show-jobs show-queued show-running abort log show"
 		COMPREPLY+=($(compgen -W "${cmds}" -- ${cur}))
 	fi
 }
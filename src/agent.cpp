@@ -0,0 +1,394 @@
+///
+/// Copyright 2022 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#include "agent.h"
+#include "artifacts.h"
+#include "run.h"
+#include "server.h"
+#include "log.h"
+#include "trash.h"
+
+#include <capnp/rpc-twoparty.h>
+#include <kj/async-io.h>
+#include <kj/filesystem.h>
+
+#include <algorithm>
+#include <map>
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+// the largest piece of log output or of an archived file sent in one call
+#define AGENT_CHUNK_SIZE 65536
+
+namespace {
+
+LaminarCi::JobResult fromRunState(RunState state) {
+    switch(state) {
+    case RunState::SUCCESS: return LaminarCi::JobResult::SUCCESS;
+    case RunState::FAILED:  return LaminarCi::JobResult::FAILED;
+    case RunState::ABORTED: return LaminarCi::JobResult::ABORTED;
+    default:
+        return LaminarCi::JobResult::UNKNOWN;
+    }
+}
+
+// Where the output of a run on an agent is delivered on the server. Shared
+// with the RunOutput capability, which the agent could hold on to for
+// longer than the run
+struct RemoteOutput {
+    // the write end of the pipe read like a leader's output
+    kj::Own<kj::AsyncOutputStream> log;
+    kj::Own<const kj::Directory> archive;
+    // the archived file currently being received
+    std::string currentName;
+    kj::Own<const kj::File> current;
+
+    void close() {
+        log = nullptr;
+        current = nullptr;
+    }
+};
+
+class RunOutputImpl final : public LaminarCi::RunOutput::Server {
+public:
+    RunOutputImpl(std::shared_ptr<RemoteOutput> output) : output(kj::mv(output)) {}
+
+protected:
+    kj::Promise<void> log(LogContext context) override {
+        if(output->log == nullptr)
+            return KJ_EXCEPTION(FAILED, "run has finished");
+        auto chunk = context.getParams().getChunk();
+        return output->log->write(chunk.begin(), chunk.size());
+    }
+
+    kj::Promise<void> artifact(ArtifactContext context) override {
+        if(output->log == nullptr)
+            return KJ_EXCEPTION(FAILED, "run has finished");
+        auto params = context.getParams();
+        std::string filename = params.getFilename();
+        if(output->current == nullptr || filename != output->currentName) {
+            // Closing the previous file lets the archive watch see it. The
+            // name is parsed as a relative path, which cannot leave the archive
+            output->current = nullptr;
+            output->current = output->archive->openFile(kj::Path::parse(filename),
+                    kj::WriteMode::CREATE|kj::WriteMode::MODIFY|kj::WriteMode::CREATE_PARENT);
+            output->currentName = filename;
+        }
+        output->current->write(params.getOffset(), params.getData());
+        return kj::READY_NOW;
+    }
+
+    kj::Promise<void> done(DoneContext context) override {
+        output->close();
+        return kj::READY_NOW;
+    }
+
+private:
+    std::shared_ptr<RemoteOutput> output;
+};
+
+// Sends the output of a leader on the agent to the server, one streaming
+// call per read, until the leader closes it
+kj::Promise<void> forwardLog(kj::AsyncInputStream& in, kj::ArrayPtr<kj::byte> buffer, LaminarCi::RunOutput::Client output) {
+    return in.tryRead(buffer.begin(), 1, buffer.size()).then([&in, buffer, output](size_t n) mutable -> kj::Promise<void> {
+        if(n == 0)
+            return kj::READY_NOW;
+        auto req = output.logRequest();
+        req.setChunk(buffer.slice(0, n));
+        return req.send().then([&in, buffer, output]() mutable {
+            return forwardLog(in, buffer, output);
+        });
+    });
+}
+
+kj::Promise<void> uploadFile(const kj::ReadableFile& file, std::string filename, uint64_t size, uint64_t offset, LaminarCi::RunOutput::Client output) {
+    // read first, so that only what was read is sent if the file shrank
+    auto buffer = kj::heapArray<kj::byte>(std::min<uint64_t>(AGENT_CHUNK_SIZE, size - offset));
+    size_t n = file.read(offset, buffer);
+    if(n == 0)
+        return kj::READY_NOW;
+    auto req = output.artifactRequest();
+    req.setFilename(filename);
+    req.setOffset(offset);
+    req.setData(buffer.slice(0, n));
+    offset += n;
+    return req.send().then([&file, filename, size, offset, output]() mutable {
+        if(offset >= size)
+            return kj::Promise<void>(kj::READY_NOW);
+        return uploadFile(file, filename, size, offset, output);
+    });
+}
+
+// Sends the files of a run's archive on the agent to the server. Listing and
+// reading block the agent's event loop, which is acceptable since it does
+// little else
+kj::Promise<void> uploadArchive(const kj::Path& archive, LaminarCi::RunOutput::Client output) {
+    auto root = kj::newDiskFilesystem();
+    KJ_IF_MAYBE(dir, root->getRoot().tryOpenSubdir(archive)) {
+        kj::Promise<void> p = kj::READY_NOW;
+        for(Artifact& artifact : indexArtifacts(archive.toString(true).cStr())) {
+            p = p.then([d=dir->get(), artifact, output]() mutable {
+                auto file = d->openFile(kj::Path::parse(artifact.filename));
+                auto& f = *file;
+                return uploadFile(f, artifact.filename, artifact.size, 0, output).attach(kj::mv(file));
+            });
+        }
+        return p.attach(kj::mv(*dir), kj::mv(root));
+    }
+    return kj::READY_NOW;
+}
+
+// Executes runs on behalf of the server, on the agent
+class LocalExecutor final : public LaminarCi::Executor::Server {
+public:
+    LocalExecutor(kj::LowLevelAsyncIoProvider& provider, Spawner& spawner, std::string home, std::map<std::string, pid_t>& leaders, Trash& trash, uint numKeepRunDirs) :
+        provider(provider),
+        spawner(spawner),
+        home(home),
+        leaders(leaders),
+        trash(trash),
+        numKeepRunDirs(numKeepRunDirs)
+    {}
+
+protected:
+    kj::Promise<void> execute(ExecuteContext context) override {
+        auto params = context.getParams();
+        std::string job = params.getRun().getJob();
+        uint build = params.getRun().getBuildNum();
+        LLOG(INFO, "Executing run", job, build);
+        StringMap vars;
+        for(auto p : params.getEnv())
+            vars[p.getName().cStr()] = p.getValue().cStr();
+        ParamMap runParams;
+        for(auto p : params.getParams())
+            runParams[p.getName().cStr()] = p.getValue().cStr();
+        LaminarCi::RunOutput::Client output = params.getOutput();
+        std::string key = job + ":" + std::to_string(build);
+
+        return spawner.spawn(leaderRequest(vars, runParams, home, job, build)).then([this, output, key](Spawner::Child leader) mutable {
+            leaders[key] = leader.pid;
+            // steps of runs on agents are not recorded
+            if(leader.steps_fd >= 0)
+                close(leader.steps_fd);
+            auto in = provider.wrapInputFd(leader.output_fd, kj::LowLevelAsyncIoProvider::TAKE_OWNERSHIP);
+            auto buffer = kj::heapArray<kj::byte>(AGENT_CHUNK_SIZE);
+            auto forwarded = forwardLog(*in, buffer, output);
+            return forwarded.attach(kj::mv(in)).attach(kj::mv(buffer)).then([exited = kj::mv(leader.exited)]() mutable {
+                return kj::mv(exited);
+            });
+        }).then([this, context, output, key, job, build](int status) mutable {
+            leaders.erase(key);
+            RunState result = WIFEXITED(status) ? RunState(WEXITSTATUS(status)) : RunState::ABORTED;
+            kj::Path archive = kj::Path::parse(home.substr(1)).append(kj::Path{"archive", job, std::to_string(build)});
+            return uploadArchive(archive, output).then([output]() mutable {
+                return output.doneRequest().send().ignoreResult();
+            }).then([this, context, result, archive=kj::mv(archive), job]() mutable {
+                // the server has the archive now, so this copy is not needed
+                try {
+                    kj::newDiskFilesystem()->getRoot().tryRemove(archive);
+                } catch(kj::Exception& e) {
+                    LLOG(ERROR, "Could not remove archive", e.getDescription());
+                }
+                discardRunDirs(job);
+                context.getResults().setResult(fromRunState(result));
+            });
+        });
+    }
+
+    kj::Promise<void> abort(AbortContext context) override {
+        std::string key = std::string(context.getParams().getRun().getJob()) + ":" + std::to_string(context.getParams().getRun().getBuildNum());
+        auto it = leaders.find(key);
+        if(it != leaders.end() && kill(-it->second, SIGTERM) == 0)
+            context.getResults().setResult(LaminarCi::MethodResult::SUCCESS);
+        else
+            context.getResults().setResult(LaminarCi::MethodResult::FAILED);
+        return kj::READY_NOW;
+    }
+
+private:
+    // Like the server does for its own runs, keeps the LAMINAR_KEEP_RUNDIRS
+    // most recent run directories of the job. The runs of a job on an agent
+    // need not be consecutive, so the directory is listed
+    void discardRunDirs(const std::string& job) {
+        std::string dir = home + "/run/" + job;
+        std::vector<uint> builds;
+        if(DIR* d = opendir(dir.c_str())) {
+            while(struct dirent* de = readdir(d)) {
+                uint build = strtoul(de->d_name, nullptr, 10);
+                if(build > 0 && leaders.find(job + ":" + de->d_name) == leaders.end())
+                    builds.push_back(build);
+            }
+            closedir(d);
+        }
+        std::sort(builds.begin(), builds.end(), std::greater<uint>());
+        for(size_t i = numKeepRunDirs; i < builds.size(); ++i) {
+            std::string path = dir + "/" + std::to_string(builds[i]);
+            if(!trash.discard(path)) {
+                try {
+                    kj::newDiskFilesystem()->getRoot().tryRemove(kj::Path::parse(path.substr(1)));
+                } catch(kj::Exception& e) {
+                    LLOG(ERROR, "Could not remove run directory", path, e.getDescription());
+                }
+            }
+        }
+    }
+
+    kj::LowLevelAsyncIoProvider& provider;
+    Spawner& spawner;
+    std::string home;
+    // leader pids of the runs in progress, by JOB:NUMBER
+    std::map<std::string, pid_t>& leaders;
+    Trash& trash;
+    uint numKeepRunDirs;
+};
+
+}
+
+RemoteAgent::RemoteAgent(std::string name, std::vector<std::pair<std::string, int>> contexts, LaminarCi::Executor::Client executor) :
+    name(name),
+    contexts(kj::mv(contexts)),
+    executor(kj::mv(executor))
+{}
+
+kj::Promise<Spawner::Child> RemoteAgent::execute(Server& srv, const Run& run, const StringMap& env, std::string archive) {
+    int fds[2];
+    LSYSCALL(pipe2(fds, O_CLOEXEC));
+    auto output = std::make_shared<RemoteOutput>();
+    output->log = srv.writeDescriptor(fds[1]);
+    output->archive = kj::newDiskFilesystem()->getRoot().openSubdir(kj::Path::parse(archive.substr(1)),
+            kj::WriteMode::CREATE|kj::WriteMode::MODIFY|kj::WriteMode::CREATE_PARENT);
+
+    auto req = executor.executeRequest();
+    req.getRun().setJob(run.name);
+    req.getRun().setBuildNum(run.build);
+    auto vars = req.initEnv(env.size());
+    int i = 0;
+    for(auto& it : env) {
+        vars[i].setName(it.first);
+        vars[i++].setValue(it.second);
+    }
+    auto params = req.initParams(run.params.size());
+    i = 0;
+    for(auto& it : run.params) {
+        params[i].setName(it.first);
+        params[i++].setValue(it.second);
+    }
+    req.setOutput(kj::heap<RunOutputImpl>(output));
+
+    Spawner::Child child;
+    child.pid = 0;
+    child.output_fd = fds[0];
+    child.steps_fd = -1;
+    child.exited = req.send().then([](capnp::Response<LaminarCi::Executor::ExecuteResults> resp){
+        switch(resp.getResult()) {
+        case LaminarCi::JobResult::SUCCESS: return RunState::SUCCESS;
+        case LaminarCi::JobResult::FAILED:  return RunState::FAILED;
+        default:
+            return RunState::ABORTED;
+        }
+    }, [agent=name, job=run.name, build=run.build](kj::Exception&& e){
+        // typically, the agent disconnected
+        LLOG(ERROR, "Run on agent failed", agent, job, build, e.getDescription());
+        return RunState::ABORTED;
+    }).then([output](RunState state){
+        // in case the agent did not call done. Closing the pipe lets the
+        // reader of the log finish
+        output->close();
+        return W_EXITCODE(int(state), 0);
+    });
+    return kj::mv(child);
+}
+
+bool RemoteAgent::abort(const Run& run) {
+    auto req = executor.abortRequest();
+    req.getRun().setJob(run.name);
+    req.getRun().setBuildNum(run.build);
+    req.send().ignoreResult().detach([](kj::Exception&& e){
+        LLOG(ERROR, "Could not abort run on agent", e.getDescription());
+    });
+    return true;
+}
+
+int agent_main(int spawnerFd) {
+    const char* address = getenv("LAMINAR_HOST") ?: getenv("LAMINAR_BIND_RPC") ?: "unix-abstract:laminar";
+    std::string home = getenv("LAMINAR_HOME") ?: "/var/lib/laminar";
+    char hostname[HOST_NAME_MAX + 1] = "";
+    gethostname(hostname, sizeof(hostname));
+    std::string name = getenv("LAMINAR_AGENT_NAME") ?: hostname;
+
+    // LAMINAR_AGENT_CONTEXTS is a comma-separated list of NAME[:EXECUTORS]
+    std::vector<std::pair<std::string, int>> contexts;
+    std::string spec = getenv("LAMINAR_AGENT_CONTEXTS") ?: "default";
+    for(size_t start = 0; start < spec.size();) {
+        size_t end = spec.find(',', start);
+        if(end == std::string::npos)
+            end = spec.size();
+        std::string item = spec.substr(start, end - start);
+        size_t colon = item.find(':');
+        if(!item.empty())
+            contexts.emplace_back(item.substr(0, colon), colon == std::string::npos ? 6 : atoi(item.c_str() + colon + 1));
+        start = end + 1;
+    }
+
+    uint numKeepRunDirs = 0;
+    if(const char* ndirs = getenv("LAMINAR_KEEP_RUNDIRS"))
+        numKeepRunDirs = static_cast<uint>(atoi(ndirs));
+
+    std::map<std::string, pid_t> leaders;
+    try {
+        // deletes old run directories in the background, as on the server
+        Trash trash(home);
+        auto io = kj::setupAsyncIo();
+        Spawner spawner(*io.lowLevelProvider, spawnerFd);
+
+        auto stream = io.provider->getNetwork().parseAddress(address).wait(io.waitScope)->connect().wait(io.waitScope);
+        capnp::TwoPartyVatNetwork network(*stream, capnp::rpc::twoparty::Side::CLIENT);
+        auto rpcSystem = capnp::makeRpcClient(network);
+        capnp::MallocMessageBuilder hostIdMessage;
+        auto hostId = hostIdMessage.getRoot<capnp::rpc::twoparty::VatId>();
+        hostId.setSide(capnp::rpc::twoparty::Side::SERVER);
+        LaminarCi::Client laminar = rpcSystem.bootstrap(hostId).castAs<LaminarCi>();
+
+        auto req = laminar.registerAgentRequest();
+        req.setName(name);
+        auto ctxs = req.initContexts(contexts.size());
+        for(uint i = 0; i < contexts.size(); ++i) {
+            ctxs[i].setName(contexts[i].first);
+            ctxs[i].setExecutors(contexts[i].second);
+        }
+        req.setExecutor(kj::heap<LocalExecutor>(*io.lowLevelProvider, spawner, home, leaders, trash, numKeepRunDirs));
+        // the contexts are offered for as long as this is held
+        auto registration = req.send().wait(io.waitScope).getRegistration();
+        printf("laminard agent %s connected to %s\n", name.c_str(), address);
+
+        network.onDisconnect().wait(io.waitScope);
+        fprintf(stderr, "Disconnected from %s\n", address);
+    } catch(kj::Exception& e) {
+        fprintf(stderr, "%s\n", e.getDescription().cStr());
+    }
+
+    // without a server, the runs in progress cannot be reported
+    for(auto& it : leaders)
+        kill(-it.second, SIGTERM);
+    return EXIT_FAILURE;
+}
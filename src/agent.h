@@ -0,0 +1,67 @@
+///
+/// Copyright 2022 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#ifndef LAMINAR_AGENT_H_
+#define LAMINAR_AGENT_H_
+
+#include "laminar.capnp.h"
+#include "spawner.h"
+#include "conf.h"
+
+#include <string>
+#include <utility>
+#include <vector>
+
+class Run;
+class Server;
+
+// An agent is laminard started with --agent on another machine (or with
+// another $LAMINAR_HOME on the same one). It connects to the server's RPC
+// socket, registers the contexts it offers and how many executors each has,
+// and then executes the runs the server assigns to those contexts with its
+// own spawner and leader, in its own $LAMINAR_HOME, which must contain the
+// same cfg as the server's. The run's log is streamed back as it is produced
+// and, when the run finishes, its archive is uploaded into the server's.
+
+// The server's side of a connected agent. To the rest of laminard, a run
+// executed by an agent looks like a locally spawned leader
+class RemoteAgent {
+public:
+    RemoteAgent(std::string name, std::vector<std::pair<std::string, int>> contexts, LaminarCi::Executor::Client executor);
+
+    // Asks the agent to execute the run. The output_fd of the returned child
+    // receives the log, and its exit status carries the RunState like that
+    // of a leader. The pid is 0. Files of the run's archive are written below
+    // the archive directory
+    kj::Promise<Spawner::Child> execute(Server& srv, const Run& run, const StringMap& env, std::string archive);
+
+    bool abort(const Run& run);
+
+    const std::string name;
+    // names of the offered contexts and their numbers of executors
+    const std::vector<std::pair<std::string, int>> contexts;
+
+private:
+    LaminarCi::Executor::Client executor;
+};
+
+// Main function of laminard in agent mode. spawnerFd is that of the
+// spawner helper, which must have been started first
+int agent_main(int spawnerFd);
+
+#endif // LAMINAR_AGENT_H_
@@ -0,0 +1,189 @@
+///
+/// Copyright 2022 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#include "artifacts.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <zlib.h>
+
+// Size of the buffer for directory entries, enough for about a thousand
+#define GETDENTS_BUFSIZE 32768
+
+// Files smaller than this are not worth compressing
+#define COMPRESS_MIN_SIZE 1024
+// Compressed files are kept only if they are at most this percentage of
+// the original size, which excludes formats which are already compressed
+#define COMPRESS_MAX_RATIO 90
+
+namespace {
+
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+bool fileSize(int dirfd, const char* name, bool& isDir, uint64_t& size) {
+#ifdef STATX_SIZE
+    struct statx stx;
+    if(statx(dirfd, name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC, STATX_TYPE | STATX_SIZE, &stx) == 0) {
+        isDir = S_ISDIR(stx.stx_mode);
+        size = stx.stx_size;
+        return S_ISREG(stx.stx_mode) || isDir;
+    }
+    if(errno != ENOSYS)
+        return false;
+#endif
+    struct stat st;
+    if(fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+        return false;
+    isDir = S_ISDIR(st.st_mode);
+    size = st.st_size;
+    return S_ISREG(st.st_mode) || isDir;
+}
+
+void indexDir(int fd, const std::string& prefix, std::vector<Artifact>& out, char* buf) {
+    // buf is reused by recursive calls, so collect subdirectories first
+    std::vector<std::string> subdirs;
+    long n;
+    while((n = syscall(SYS_getdents64, fd, buf, GETDENTS_BUFSIZE)) > 0) {
+        for(long pos = 0; pos < n;) {
+            const linux_dirent64* de = reinterpret_cast<const linux_dirent64*>(buf + pos);
+            pos += de->d_reclen;
+            const char* name = de->d_name;
+            if(strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+                continue;
+            if(de->d_type == DT_DIR) {
+                subdirs.push_back(name);
+                continue;
+            }
+            if(de->d_type != DT_REG && de->d_type != DT_UNKNOWN)
+                continue;
+            bool isDir;
+            uint64_t size;
+            if(!fileSize(fd, name, isDir, size))
+                continue;
+            if(isDir)
+                subdirs.push_back(name);
+            else
+                out.push_back(Artifact{prefix + name, size});
+        }
+    }
+    for(const std::string& sub : subdirs) {
+        int subfd = openat(fd, sub.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if(subfd < 0)
+            continue;
+        indexDir(subfd, prefix + sub + "/", out, buf);
+        close(subfd);
+    }
+}
+
+}
+
+std::vector<Artifact> indexArtifacts(const std::string& dir) {
+    std::vector<Artifact> result;
+    int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(fd < 0)
+        return result;
+    std::vector<char> buf(GETDENTS_BUFSIZE);
+    indexDir(fd, std::string(), result, buf.data());
+    close(fd);
+    return result;
+}
+
+bool compressArtifact(const std::string& path, uint64_t& compressedSize) {
+    std::string gzPath = path + ".gz";
+    struct stat st, gzst;
+    if(lstat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode) || st.st_size < COMPRESS_MIN_SIZE)
+        return false;
+    // don't replace a different artifact of that name
+    if(lstat(gzPath.c_str(), &gzst) == 0)
+        return false;
+    int in = open(path.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if(in < 0)
+        return false;
+    std::string tmp = path + ".gz.tmp";
+    gzFile out = gzopen(tmp.c_str(), "wbe");
+    if(!out) {
+        close(in);
+        return false;
+    }
+    bool ok = true;
+    char buf[65536];
+    ssize_t n;
+    while(ok && (n = read(in, buf, sizeof(buf))) > 0)
+        ok = gzwrite(out, buf, n) == n;
+    ok = gzclose(out) == Z_OK && ok && n == 0;
+    close(in);
+
+    if(ok && stat(tmp.c_str(), &gzst) == 0 && uint64_t(gzst.st_size) * 100 <= uint64_t(st.st_size) * COMPRESS_MAX_RATIO) {
+        chmod(tmp.c_str(), st.st_mode & 07777);
+        struct timespec times[2] = { st.st_atim, st.st_mtim };
+        utimensat(AT_FDCWD, tmp.c_str(), times, 0);
+        if(rename(tmp.c_str(), gzPath.c_str()) == 0) {
+            compressedSize = gzst.st_size;
+            return true;
+        }
+    }
+    unlink(tmp.c_str());
+    return false;
+}
+
+bool linkArtifacts(const std::string& from, const std::string& to, std::vector<StoredArtifact>& files) {
+    auto linkFile = [&](const std::string& file) {
+        std::string dst = to + "/" + file;
+        for(size_t slash = to.size() + 1; (slash = dst.find('/', slash)) != std::string::npos; ++slash) {
+            dst[slash] = '\0';
+            mkdir(dst.c_str(), 0755);
+            dst[slash] = '/';
+        }
+        return link((from + "/" + file).c_str(), dst.c_str()) == 0 || errno == EEXIST;
+    };
+    bool ok = true;
+    for(auto it = files.begin(); it != files.end();) {
+        bool compressed = it->compressedSize.has_value();
+        if(linkFile(compressed ? it->filename + ".gz" : it->filename)) {
+            ++it;
+            continue;
+        }
+        // The source run's ARCHIVE_COMPRESS pass may have replaced the file
+        // since its record was read. The hash describes the other form
+        struct stat st;
+        if(errno == ENOENT && linkFile(compressed ? it->filename : it->filename + ".gz")
+                && (compressed || stat((to + "/" + it->filename + ".gz").c_str(), &st) == 0)) {
+            if(compressed)
+                it->compressedSize.reset();
+            else
+                it->compressedSize = st.st_size;
+            it->hash.reset();
+            ++it;
+        } else {
+            it = files.erase(it);
+            ok = false;
+        }
+    }
+    return ok;
+}
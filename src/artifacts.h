@@ -0,0 +1,62 @@
+///
+/// Copyright 2022 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#ifndef LAMINAR_ARTIFACTS_H_
+#define LAMINAR_ARTIFACTS_H_
+
+#include <stdint.h>
+#include <optional>
+#include <string>
+#include <vector>
+
+struct Artifact {
+    // path relative to the run's archive directory
+    std::string filename;
+    uint64_t size;
+};
+
+// An archived file as recorded in the artifacts table. If compressedSize
+// is set, the file is stored on disk as $filename.gz
+struct StoredArtifact {
+    std::string filename;
+    uint64_t size;
+    std::optional<uint64_t> compressedSize;
+    std::optional<std::string> hash;
+};
+
+// Lists the regular files below dir, recursively. Directory entries are
+// read in large batches with getdents64 and only the size of each file
+// is requested, since an archive may contain very many files. Does
+// blocking IO, so should be called off the event loop.
+std::vector<Artifact> indexArtifacts(const std::string& dir);
+
+// Writes a gzip-compressed copy of the file at path to path.gz, if that
+// saves enough space to be worthwhile, and sets compressedSize. Returns
+// false if no copy was made. The original is left in place, so that it
+// can be served until the caller has recorded the compression.
+bool compressArtifact(const std::string& path, uint64_t& compressedSize);
+
+// Hardlinks the given files, relative to from, to the same paths below
+// to, creating directories as needed. A file which is compressed in the
+// meantime, or not yet, is linked in the form found and its record
+// updated to match. Files which could not be linked are removed from the
+// list, and false is returned. Does blocking IO, so should be called off
+// the event loop.
+bool linkArtifacts(const std::string& from, const std::string& to, std::vector<StoredArtifact>& files);
+
+#endif // LAMINAR_ARTIFACTS_H_
@@ -0,0 +1,112 @@
+///
+/// Copyright 2022 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#include "cas.h"
+#include "sha256.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+bool ContentStore::init() {
+    return mkdir(dir.c_str(), 0755) == 0 || errno == EEXIST;
+}
+
+std::string ContentStore::hashFile(int fd) {
+    Sha256 sha;
+    char buf[65536];
+    ssize_t n;
+    while((n = read(fd, buf, sizeof(buf))) > 0)
+        sha.update(buf, n);
+    if(n < 0)
+        return std::string();
+    return sha.hexDigest();
+}
+
+std::string ContentStore::store(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if(fd < 0)
+        return std::string();
+    struct stat st;
+    std::string hash = fstat(fd, &st) == 0 ? hashFile(fd) : std::string();
+    close(fd);
+    if(hash.empty())
+        return hash;
+
+    std::string subdir = dir + "/" + hash.substr(0, 2);
+    std::string blob = subdir + "/" + hash.substr(2);
+    if(mkdir(subdir.c_str(), 0755) != 0 && errno != EEXIST)
+        return std::string();
+
+    // Archived files are shared from now on, so they must not be modified
+    chmod(path.c_str(), st.st_mode & 0555);
+    if(link(path.c_str(), blob.c_str()) == 0)
+        return hash;
+    if(errno != EEXIST)
+        return std::string();
+
+    struct stat bst;
+    if(stat(blob.c_str(), &bst) != 0 || bst.st_size != st.st_size)
+        return std::string();
+    if(bst.st_ino == st.st_ino)
+        return hash;
+    // replace the file by a link to the existing blob without a moment
+    // where it is missing, in case it is being downloaded
+    std::string tmp = path + ".cas";
+    unlink(tmp.c_str());
+    if(link(blob.c_str(), tmp.c_str()) != 0)
+        return std::string();
+    if(rename(tmp.c_str(), path.c_str()) != 0) {
+        unlink(tmp.c_str());
+        return std::string();
+    }
+    return hash;
+}
+
+uint64_t ContentStore::prune() {
+    uint64_t freed = 0;
+    DIR* d = opendir(dir.c_str());
+    if(!d)
+        return 0;
+    while(struct dirent* de = readdir(d)) {
+        if(de->d_name[0] == '.')
+            continue;
+        int subfd = openat(dirfd(d), de->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if(subfd < 0)
+            continue;
+        DIR* sub = fdopendir(subfd);
+        if(!sub) {
+            close(subfd);
+            continue;
+        }
+        while(struct dirent* be = readdir(sub)) {
+            struct stat st;
+            if(be->d_name[0] == '.' || fstatat(subfd, be->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+                continue;
+            if(S_ISREG(st.st_mode) && st.st_nlink == 1 && unlinkat(subfd, be->d_name, 0) == 0)
+                freed += st.st_size;
+        }
+        closedir(sub);
+    }
+    closedir(d);
+    return freed;
+}
@@ -0,0 +1,55 @@
+///
+/// Copyright 2022 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#ifndef LAMINAR_CAS_H_
+#define LAMINAR_CAS_H_
+
+#include <stdint.h>
+#include <string>
+
+// Content-addressed store of archived files in $LAMINAR_HOME/cas. Each
+// distinct file content is kept once, as cas/ab/cdef... named after its
+// SHA-256, and archived files with that content are replaced by hardlinks
+// to it. The store must be on the same filesystem as the archive. A blob
+// is no longer referenced by any archive when its link count drops to 1.
+//
+// The methods do blocking IO and are meant to be called off the event loop.
+class ContentStore {
+public:
+    explicit ContentStore(const std::string& dir) : dir(dir) {}
+
+    // Creates the store directory. Returns false if that isn't possible
+    bool init();
+
+    // Returns the SHA-256 of the file at path as hex, or an empty string if
+    // it could not be read or linked with the store. If the content is
+    // already in the store, path is atomically replaced with a link to it,
+    // otherwise path becomes the blob.
+    std::string store(const std::string& path);
+
+    // Removes blobs which are no longer linked from any archive and
+    // returns the number of bytes freed
+    uint64_t prune();
+
+    static std::string hashFile(int fd);
+
+private:
+    std::string dir;
+};
+
+#endif // LAMINAR_CAS_H_
@@ -0,0 +1,212 @@
+///
+/// Copyright 2022 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#include "cgroup.h"
+#include "log.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sstream>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/magic.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+
+#define CGROUP2_MOUNT "/sys/fs/cgroup"
+
+namespace {
+
+bool readFile(const std::string& path, std::string& content) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+        return false;
+    content.clear();
+    char buf[1024];
+    ssize_t n;
+    while((n = read(fd, buf, sizeof(buf))) > 0)
+        content.append(buf, n);
+    close(fd);
+    return n == 0;
+}
+
+// Control files must be written with a single write call
+bool writeFile(const std::string& path, const std::string& content) {
+    int fd = open(path.c_str(), O_WRONLY | O_CLOEXEC);
+    if(fd < 0)
+        return false;
+    bool ok = write(fd, content.data(), content.size()) == ssize_t(content.size());
+    close(fd);
+    return ok;
+}
+
+uint64_t readNumber(const std::string& path) {
+    std::string content;
+    if(!readFile(path, content))
+        return 0;
+    return strtoull(content.c_str(), nullptr, 10);
+}
+
+// Makes the available controllers of interest usable by the children of dir
+void enableControllers(const std::string& dir) {
+    std::string available;
+    if(!readFile(dir + "/cgroup.controllers", available))
+        return;
+    std::istringstream iss(available);
+    std::string controller;
+    while(iss >> controller) {
+        if(controller == "cpu" || controller == "memory" || controller == "io" || controller == "pids") {
+            if(!writeFile(dir + "/cgroup.subtree_control", "+" + controller))
+                LLOG(WARNING, "Could not enable cgroup controller", controller, strerror(errno));
+        }
+    }
+}
+
+bool makeDir(const std::string& path) {
+    return mkdir(path.c_str(), 0755) == 0 || errno == EEXIST;
+}
+
+}
+
+bool Cgroups::init(const char* cgroup) {
+    std::string rel = cgroup;
+    if(rel == "auto") {
+        // The unified hierarchy is listed as "0::/path"
+        std::string self;
+        size_t pos;
+        if(!readFile("/proc/self/cgroup", self) || (pos = self.find("0::")) == std::string::npos) {
+            LLOG(ERROR, "Could not determine own cgroup, cgroup v2 may not be in use");
+            return false;
+        }
+        rel = self.substr(pos + 3, self.find('\n', pos) - pos - 3);
+    }
+    std::string dir = CGROUP2_MOUNT + rel;
+    while(dir.size() > 1 && dir.back() == '/')
+        dir.pop_back();
+
+    struct statfs sfs;
+    if(statfs(dir.c_str(), &sfs) != 0 || sfs.f_type != CGROUP2_SUPER_MAGIC) {
+        LLOG(ERROR, "Not a cgroup v2 directory", dir);
+        return false;
+    }
+
+    // Evacuate the root of the subtree. This includes laminard and the
+    // spawner helper if the subtree is the cgroup they were started in
+    if(!makeDir(dir + "/laminard") || !makeDir(dir + "/runs")) {
+        LLOG(ERROR, "Could not create cgroups, is the subtree delegated?", dir, strerror(errno));
+        return false;
+    }
+    std::string procs;
+    if(readFile(dir + "/cgroup.procs", procs)) {
+        std::istringstream iss(procs);
+        std::string pid;
+        while(iss >> pid) {
+            // processes may exit in the meantime, so ignore ESRCH
+            if(!writeFile(dir + "/laminard/cgroup.procs", pid) && errno != ESRCH) {
+                LLOG(ERROR, "Could not move process out of cgroup", pid, strerror(errno));
+                return false;
+            }
+        }
+    }
+    enableControllers(dir);
+    enableControllers(dir + "/runs");
+
+    root = dir;
+    LLOG(INFO, "Runs will be placed in cgroups below", root);
+    return true;
+}
+
+std::string Cgroups::create(const std::string& name, const std::string& cpuMax, const std::string& memoryMax) {
+    std::string path = root + "/runs/" + name;
+    // A leftover cgroup of a previous daemon with the same run number
+    // would be removed here if it is empty
+    rmdir(path.c_str());
+    if(mkdir(path.c_str(), 0755) != 0) {
+        LLOG(ERROR, "Could not create cgroup", path, strerror(errno));
+        return std::string();
+    }
+    if(!cpuMax.empty()) {
+        // cpu.max is a quota of microseconds per period
+        const int period = 100000;
+        double cpus = atof(cpuMax.c_str());
+        if(cpus <= 0 || !writeFile(path + "/cpu.max", std::to_string(int(cpus * period)) + " " + std::to_string(period)))
+            LLOG(WARNING, "Could not apply CPU_MAX", name, cpuMax);
+    }
+    if(!memoryMax.empty() && !writeFile(path + "/memory.max", memoryMax))
+        LLOG(WARNING, "Could not apply MEMORY_MAX", name, memoryMax);
+    return path;
+}
+
+RunResources Cgroups::release(const std::string& path) {
+    RunResources res = readResources(path);
+    // normally already removed by the leader
+    rmdir((path + "/scripts").c_str());
+    if(rmdir(path.c_str()) != 0)
+        LLOG(WARNING, "Could not remove cgroup", path, strerror(errno));
+    return res;
+}
+
+RunResources Cgroups::readResources(const std::string& path) {
+    RunResources res;
+    std::string content;
+    if(readFile(path + "/cpu.stat", content)) {
+        std::istringstream iss(content);
+        std::string key;
+        uint64_t value;
+        while(iss >> key >> value) {
+            if(key == "usage_usec")
+                res.cpuTime = value / 1000;
+        }
+    }
+    // memory.peak and pids.peak are not available on older kernels
+    res.peakMemory = readNumber(path + "/memory.peak");
+    res.peakPids = readNumber(path + "/pids.peak");
+    // one line per device of the form "MAJ:MIN rbytes=N wbytes=N rios=N ..."
+    if(readFile(path + "/io.stat", content)) {
+        std::istringstream iss(content);
+        std::string field;
+        while(iss >> field) {
+            if(field.compare(0, 7, "rbytes=") == 0 || field.compare(0, 7, "wbytes=") == 0)
+                res.ioBytes += strtoull(field.c_str() + 7, nullptr, 10);
+        }
+    }
+    return res;
+}
+
+void Cgroups::readUsage(const std::string& path, uint64_t& cpuTime, uint64_t& memory) {
+    std::string content;
+    // usage_usec is the first line of cpu.stat
+    cpuTime = readFile(path + "/cpu.stat", content) && content.compare(0, 11, "usage_usec ") == 0
+        ? strtoull(content.c_str() + 11, nullptr, 10) / 1000 : 0;
+    memory = readNumber(path + "/memory.current");
+}
+
+bool Cgroups::join(const std::string& path) {
+    // writing 0 moves the writing process
+    return writeFile(path + "/cgroup.procs", "0");
+}
+
+std::string Cgroups::createScripts(const std::string& path) {
+    std::string scripts = path + "/scripts";
+    return makeDir(scripts) ? scripts : std::string();
+}
+
+bool Cgroups::kill(const std::string& path) {
+    return writeFile(path + "/cgroup.kill", "1");
+}
@@ -0,0 +1,88 @@
+///
+/// Copyright 2022 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#ifndef LAMINAR_CGROUP_H_
+#define LAMINAR_CGROUP_H_
+
+#include <string>
+#include <stdint.h>
+
+// Resources consumed by all the processes of a run, as accounted by its cgroup
+struct RunResources {
+    // user and system CPU time in milliseconds
+    uint64_t cpuTime = 0;
+    // high-water mark of memory usage in bytes
+    uint64_t peakMemory = 0;
+    // bytes read from and written to block devices
+    uint64_t ioBytes = 0;
+    // high-water mark of the number of processes
+    uint64_t peakPids = 0;
+};
+
+// Places each run in its own cgroup (v2) below a subtree delegated to
+// laminard, which makes resource accounting and per-context limits
+// possible. The layout below the delegated root is:
+//   laminard/       laminard itself and the spawner helper
+//   runs/JOB.NUM/   one cgroup per run, joined by the leader process
+// Processes are moved out of the root because cgroup v2 does not allow
+// a cgroup to contain processes and delegate controllers to its children.
+class Cgroups {
+public:
+    // Prepares the delegated subtree. The argument is a path relative to
+    // the cgroup2 mount, or "auto" for the cgroup laminard was started in
+    // (such as the one systemd creates for a service with Delegate=yes).
+    // Returns false if cgroups cannot be used, in which case runs are only
+    // contained by their process group.
+    bool init(const char* cgroup);
+    bool enabled() const { return !root.empty(); }
+
+    // Creates the cgroup for a run and applies the limits, which are the
+    // number of CPUs (may be fractional) and the maximum memory in the
+    // format of memory.max. Empty limits are not applied. Returns the path
+    // of the new cgroup, or an empty string on failure.
+    std::string create(const std::string& name, const std::string& cpuMax, const std::string& memoryMax);
+
+    // Reads the resource usage of a finished run and removes its cgroup
+    RunResources release(const std::string& path);
+
+    // Reads the resource usage accounted in the given cgroup directory.
+    // Values which the kernel does not provide are left at zero
+    static RunResources readResources(const std::string& path);
+
+    // Reads the CPU time used so far in milliseconds and the current memory
+    // usage in bytes. Reads only two small files, so that every run can be
+    // sampled frequently on the event loop
+    static void readUsage(const std::string& path, uint64_t& cpuTime, uint64_t& memory);
+
+    // Moves the calling process into the given cgroup. Used by the leader
+    static bool join(const std::string& path);
+
+    // The leader lives in the run's cgroup and executes the scripts in a
+    // child cgroup, so that they can be killed without killing the leader.
+    // Returns the path of the child, or an empty string on failure
+    static std::string createScripts(const std::string& path);
+
+    // Kills all processes in the cgroup and its children. Returns false
+    // if cgroup.kill is not supported (before Linux 5.14)
+    static bool kill(const std::string& path);
+
+private:
+    std::string root;
+};
+
+#endif // LAMINAR_CGROUP_H_
@@ -18,14 +18,23 @@
 ///
 #include "laminar.capnp.h"
 #include "log.h"
+#include "setparams.h"
 
 #include <capnp/ez-rpc.h>
 #include <kj/vector.h>
 
 #include <iostream>
+#include <iterator>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/file.h>
 
 #define EXIT_BAD_ARGUMENT     1
 #define EXIT_OPERATION_FAILED 2
@@ -73,6 +82,31 @@ static int setParams(int argc, char** argv, T& request) {
     return argsConsumed;
 }
 
+// The job names among the arguments from first on, the others being the
+// parameters of the job before them
+static kj::Vector<int> jobArguments(int argc, char** argv, int first) {
+    kj::Vector<int> jobIndices;
+    for(int i = first; i < argc; ++i) {
+        if(strchr(argv[i], '=') == NULL)
+            jobIndices.add(i);
+    }
+    return jobIndices;
+}
+
+// Queues all the given jobs with a single request
+static capnp::Request<LaminarCi::QueueBatchParams, LaminarCi::QueueBatchResults> queueBatchRequest(LaminarCi::Client& laminar,
+        int argc, char** argv, const kj::Vector<int>& jobIndices, bool frontOfQueue) {
+    auto req = laminar.queueBatchRequest();
+    req.setFrontOfQueue(frontOfQueue);
+    auto jobs = req.initJobs(jobIndices.size());
+    for(uint i = 0; i < jobIndices.size(); ++i) {
+        auto job = jobs[i];
+        job.setJobName(argv[jobIndices[i]]);
+        setParams(argc - jobIndices[i] - 1, &argv[jobIndices[i] + 1], job);
+    }
+    return req;
+}
+
 static void printTriggerLink(const char* job, uint run) {
     if(getenv("__LAMINAR_SETENV_PIPE")) {
         // use a private ANSI CSI sequence to mark the JOB:NUM so the
@@ -85,6 +119,59 @@ static void printTriggerLink(const char* job, uint run) {
     }
 }
 
+static const char* resultName(LaminarCi::RunInfo::Reader info) {
+    if(!info.getStartedAt())
+        return "queued";
+    if(!info.getCompletedAt())
+        return "running";
+    switch(info.getResult()) {
+    case LaminarCi::JobResult::SUCCESS: return "success";
+    case LaminarCi::JobResult::FAILED:  return "failed";
+    case LaminarCi::JobResult::ABORTED: return "aborted";
+    default:
+        return "unknown";
+    }
+}
+
+static void printTime(const char* label, int64_t t) {
+    char buf[32] = "-";
+    time_t tt = t;
+    if(t)
+        strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", localtime(&tt));
+    printf("%-10s %s\n", label, buf);
+}
+
+// Receives the output of laminarc log
+class LogPrinter : public LaminarCi::LogSink::Server {
+protected:
+    kj::Promise<void> write(WriteContext context) override {
+        auto chunk = context.getParams().getChunk();
+        fwrite(chunk.begin(), 1, chunk.size(), stdout);
+        fflush(stdout);
+        return kj::READY_NOW;
+    }
+    kj::Promise<void> done(DoneContext context) override {
+        return kj::READY_NOW;
+    }
+};
+
+// Receives the results of the runs started by laminarc run
+class RunPrinter : public LaminarCi::RunListener::Server {
+public:
+    RunPrinter(int& ret) : ret(ret) {}
+protected:
+    kj::Promise<void> finished(FinishedContext context) override {
+        auto run = context.getParams().getRun();
+        printTriggerLink(run.getJob().cStr(), run.getBuildNum());
+        fflush(stdout);
+        if(context.getParams().getResult() != LaminarCi::JobResult::SUCCESS)
+            ret = EXIT_RUN_FAILED;
+        return kj::READY_NOW;
+    }
+private:
+    int& ret;
+};
+
 static void usage(std::ostream& out) {
     out << "laminarc version " << laminar_version() << "\n";
     out << "Usage: laminarc [-h|--help] COMMAND\n";
@@ -93,11 +180,16 @@ static void usage(std::ostream& out) {
     out << "  queue JOB_LIST...     queues one or more jobs for execution and returns immediately.\n";
     out << "  start JOB_LIST...     queues one or more jobs for execution and blocks until it starts.\n";
     out << "  run JOB_LIST...       queues one or more jobs for execution and blocks until it finishes.\n";
+    out << "                        Each run is printed as soon as it finishes.\n";
     out << "                        JOB_LIST may be prepended with --next, in this case the job will\n";
     out << "                        be pushed to the front of the queue instead of the end.\n";
     out << "  set PARAMETER_LIST... sets the given parameters as environment variables in the currently\n";
     out << "                        running job. Fails if run outside of a job context.\n";
     out << "  abort NAME NUMBER     aborts the run identified by NAME and NUMBER.\n";
+    out << "  log [-f] NAME NUMBER  prints the log output of the run identified by NAME and NUMBER.\n";
+    out << "                        With -f, output is printed as it is produced until the run finishes.\n";
+    out << "  show NAME [NUMBER]    shows the run identified by NAME and NUMBER, or lists the\n";
+    out << "                        most recent runs of the job NAME.\n";
     out << "  show-jobs             lists all known jobs.\n";
     out << "  show-queued           lists currently queued jobs.\n";
     out << "  show-running          lists currently running jobs.\n";
@@ -149,7 +241,21 @@ int main(int argc, char** argv) {
     }
 
     if(strcmp(argv[1], "queue") == 0) {
-        do {
+        // several jobs are queued with a single request
+        kj::Vector<int> jobIndices = jobArguments(argc, argv, jobNameIndex);
+        if(jobIndices.size() > 1) {
+            auto req = queueBatchRequest(laminar, argc, argv, jobIndices, frontOfQueue);
+            ts.add(req.send().then([&ret,argv,jobIndices=kj::mv(jobIndices)](capnp::Response<LaminarCi::QueueBatchResults> resp){
+                auto buildNums = resp.getBuildNums();
+                for(uint i = 0; i < jobIndices.size(); ++i) {
+                    if(buildNums[i] == 0) {
+                        fprintf(stderr, "Failed to queue job '%s'\n", argv[jobIndices[i]]);
+                        ret = EXIT_OPERATION_FAILED;
+                    } else
+                        printTriggerLink(argv[jobIndices[i]], buildNums[i]);
+                }
+            }));
+        } else do {
             auto req = laminar.queueRequest();
             req.setJobName(argv[jobNameIndex]);
             req.setFrontOfQueue(frontOfQueue);
@@ -179,7 +285,34 @@ int main(int argc, char** argv) {
             jobNameIndex += n + 1;
         } while(jobNameIndex < argc);
     } else if(strcmp(argv[1], "run") == 0) {
-        do {
+        // Several jobs are queued with a single request, and their results
+        // are received as each of them finishes with another
+        kj::Vector<int> jobIndices = jobArguments(argc, argv, jobNameIndex);
+        if(jobIndices.size() > 1) {
+            auto req = queueBatchRequest(laminar, argc, argv, jobIndices, frontOfQueue);
+            ts.add(req.send().then([&ret,argv,laminar,jobIndices=kj::mv(jobIndices)](capnp::Response<LaminarCi::QueueBatchResults> resp) mutable {
+                auto buildNums = resp.getBuildNums();
+                uint n = 0;
+                for(uint i = 0; i < jobIndices.size(); ++i) {
+                    if(buildNums[i] == 0) {
+                        fprintf(stderr, "Failed to start job '%s'\n", argv[jobIndices[i]]);
+                        ret = EXIT_RUN_FAILED;
+                    } else
+                        n++;
+                }
+                auto wait = laminar.waitAllRequest();
+                auto runs = wait.initRuns(n);
+                n = 0;
+                for(uint i = 0; i < jobIndices.size(); ++i) {
+                    if(buildNums[i] != 0) {
+                        runs[n].setJob(argv[jobIndices[i]]);
+                        runs[n++].setBuildNum(buildNums[i]);
+                    }
+                }
+                wait.setListener(kj::heap<RunPrinter>(ret));
+                return wait.send().ignoreResult();
+            }));
+        } else do {
             auto req = laminar.runRequest();
             req.setJobName(argv[jobNameIndex]);
             req.setFrontOfQueue(frontOfQueue);
@@ -196,15 +329,49 @@ int main(int argc, char** argv) {
         } while(jobNameIndex < argc);
     } else if(strcmp(argv[1], "set") == 0) {
         if(argc < 3) {
-            fprintf(stderr, "Usage %s set param=value\n", argv[0]);
+            fprintf(stderr, "Usage %s set param=value|param [param=value|param...]\n", argv[0]);
             return EXIT_BAD_ARGUMENT;
         }
-        if(char* pipeNum = getenv("__LAMINAR_SETENV_PIPE")) {
-            LSYSCALL(write(atoi(pipeNum), argv[2], strlen(argv[2])));
-        } else {
+        char* pipeNum = getenv("__LAMINAR_SETENV_PIPE");
+        if(!pipeNum) {
             fprintf(stderr, "Must be run from within a laminar job\n");
             return EXIT_BAD_ARGUMENT;
         }
+        ParamList params;
+        for(int i = 2; i < argc; ++i) {
+            if(char* eq = strchr(argv[i], '=')) {
+                params.emplace_back(std::string(argv[i], eq), eq + 1);
+            } else {
+                // a value too large for the command line is read from stdin
+                params.emplace_back(argv[i], std::string(std::istreambuf_iterator<char>(std::cin), std::istreambuf_iterator<char>()));
+            }
+            if(params.back().first.empty()) {
+                fprintf(stderr, "Parameter name must not be empty\n");
+                return EXIT_BAD_ARGUMENT;
+            }
+        }
+        // All the variables go in one frame, written whole while the lock
+        // keeps other writers out, see setparams.h. Every script inherits
+        // the same open file description of the pipe, and an flock belongs
+        // to the description, so the pipe is reopened to get one of our own
+        std::string frame = encodeParamFrame(params);
+        std::string path = std::string("/proc/self/fd/") + pipeNum;
+        int fd = open(path.c_str(), O_WRONLY | O_CLOEXEC);
+        if(fd < 0 || flock(fd, LOCK_EX) != 0) {
+            fprintf(stderr, "Cannot open the laminar job's pipe: %s\n", strerror(errno));
+            return EXIT_OPERATION_FAILED;
+        }
+        // the leader closes the pipe if it can no longer decode it
+        signal(SIGPIPE, SIG_IGN);
+        for(size_t done = 0; done < frame.size();) {
+            ssize_t n = write(fd, frame.data() + done, frame.size() - done);
+            if(n < 0) {
+                fprintf(stderr, "Failed to pass the parameters to the laminar job: %s\n", strerror(errno));
+                return EXIT_OPERATION_FAILED;
+            }
+            done += n;
+        }
+        close(fd);
     } else if(strcmp(argv[1], "abort") == 0) {
         if(argc != 4) {
             fprintf(stderr, "Usage %s abort <jobName> <jobNumber>\n", argv[0]);
@@ -217,6 +384,60 @@ int main(int argc, char** argv) {
             if(resp.getResult() != LaminarCi::MethodResult::SUCCESS)
                 ret = EXIT_OPERATION_FAILED;
         }));
+    } else if(strcmp(argv[1], "log") == 0) {
+        bool follow = argc > 2 && strcmp(argv[2], "-f") == 0;
+        if(argc != 4 + follow) {
+            fprintf(stderr, "Usage %s log [-f] <jobName> <jobNumber>\n", argv[0]);
+            return EXIT_BAD_ARGUMENT;
+        }
+        auto req = laminar.followRequest();
+        req.getRun().setJob(argv[2 + follow]);
+        req.getRun().setBuildNum(atoi(argv[3 + follow]));
+        req.setUntilComplete(follow);
+        req.setSink(kj::heap<LogPrinter>());
+        ts.add(req.send().then([&ret,argv,follow](capnp::Response<LaminarCi::FollowResults> resp){
+            if(resp.getResult() != LaminarCi::MethodResult::SUCCESS) {
+                fprintf(stderr, "No log for run '%s:%s'\n", argv[2 + follow], argv[3 + follow]);
+                ret = EXIT_OPERATION_FAILED;
+            }
+        }));
+    } else if(strcmp(argv[1], "show") == 0) {
+        if(argc != 3 && argc != 4) {
+            fprintf(stderr, "Usage: %s show <jobName> [<jobNumber>]\n", argv[0]);
+            return EXIT_BAD_ARGUMENT;
+        }
+        if(argc == 4) {
+            auto req = laminar.getRunRequest();
+            req.getRun().setJob(argv[2]);
+            req.getRun().setBuildNum(atoi(argv[3]));
+            auto resp = req.send().wait(waitScope);
+            if(resp.getResult() != LaminarCi::MethodResult::SUCCESS) {
+                fprintf(stderr, "Unknown run '%s:%s'\n", argv[2], argv[3]);
+                return EXIT_OPERATION_FAILED;
+            }
+            auto info = resp.getInfo();
+            printf("%s:%d\n", info.getRun().getJob().cStr(), info.getRun().getBuildNum());
+            printf("%-10s %s\n", "result", resultName(info));
+            printTime("queued", info.getQueuedAt());
+            printTime("started", info.getStartedAt());
+            printTime("completed", info.getCompletedAt());
+            if(info.getContext().size())
+                printf("%-10s %s\n", "context", info.getContext().cStr());
+            if(info.getReason().size())
+                printf("%-10s %s\n", "reason", info.getReason().cStr());
+            if(info.getUpstream().getJob().size())
+                printf("%-10s %s:%d\n", "upstream", info.getUpstream().getJob().cStr(), info.getUpstream().getBuildNum());
+        } else {
+            auto req = laminar.listRunsRequest();
+            req.setJob(argv[2]);
+            req.setLimit(20);
+            auto resp = req.send().wait(waitScope);
+            for(auto info : resp.getRuns()) {
+                int64_t end = info.getCompletedAt() ?: time(nullptr);
+                printf("%s:%d\t%s\t%" PRId64 "s\n", info.getRun().getJob().cStr(), info.getRun().getBuildNum(),
+                       resultName(info), info.getStartedAt() ? end - info.getStartedAt() : 0);
+            }
+        }
     } else if(strcmp(argv[1], "show-jobs") == 0) {
         if(argc != 2) {
             fprintf(stderr, "Usage: %s show-jobs\n", argv[0]);
@@ -21,7 +21,7 @@
 #include <fstream>
 
 template <>
-int StringMap::convert(std::string e) { return atoi(e.c_str()); }
+int StringMap::convert(std::string e) const { return atoi(e.c_str()); }
 
 StringMap parseConfFile(const char* path) {
     StringMap result;
@@ -37,3 +37,19 @@ StringMap parseConfFile(const char* path) {
     }
     return result;
 }
+
+const StringMap& ConfCache::get(const std::string& path) {
+    Entry& e = entries[path];
+    struct stat st;
+    if(stat(path.c_str(), &st) != 0) {
+        e = Entry{};
+        return e.vars;
+    }
+    if(st.st_ino != e.ino || st.st_size != e.size || st.st_mtim.tv_sec != e.mtime.tv_sec || st.st_mtim.tv_nsec != e.mtime.tv_nsec) {
+        e.vars = parseConfFile(path.c_str());
+        e.mtime = st.st_mtim;
+        e.ino = st.st_ino;
+        e.size = st.st_size;
+    }
+    return e.vars;
+}
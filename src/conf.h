@@ -21,25 +21,42 @@
 
 #include <string>
 #include <unordered_map>
+#include <sys/stat.h>
 
 class StringMap : public std::unordered_map<std::string, std::string> {
 public:
     template<typename T>
-    T get(std::string key, T fallback = T()) {
+    T get(std::string key, T fallback = T()) const {
         auto it = find(key);
         return it != end() ? convert<T>(it->second) : fallback;
     }
 private:
     template<typename T>
-    T convert(std::string e) { return e; }
+    T convert(std::string e) const { return e; }
 };
 template <>
-int StringMap::convert(std::string e);
+int StringMap::convert(std::string e) const;
 
 // Reads a file by line into a list of key/value pairs
 // separated by the first '=' character. Discards lines
 // beginning with '#'
 StringMap parseConfFile(const char* path);
 
+// Keeps the parsed contents of configuration files, re-reading a file
+// only when it has been modified since it was last parsed. A file which
+// does not exist yields an empty map.
+class ConfCache {
+public:
+    const StringMap& get(const std::string& path);
+private:
+    struct Entry {
+        struct timespec mtime;
+        ino_t ino;
+        off_t size;
+        StringMap vars;
+    };
+    std::unordered_map<std::string, Entry> entries;
+};
+
 
 #endif // LAMINAR_CONF_H_
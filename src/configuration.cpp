@@ -0,0 +1,177 @@
+///
+/// Copyright 2022 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#include "configuration.h"
+
+#include <dirent.h>
+#include <sstream>
+#include <string.h>
+#include <unistd.h>
+
+namespace {
+
+std::set<std::string> splitPatterns(const std::string& list) {
+    std::set<std::string> result;
+    if(!list.empty()) {
+        std::istringstream iss(list);
+        std::string item;
+        while(std::getline(iss, item, ','))
+            result.insert(item);
+    }
+    return result;
+}
+
+bool endsWith(const std::string& s, const char* suffix) {
+    size_t n = strlen(suffix);
+    return s.size() >= n && s.compare(s.size() - n, n, suffix) == 0;
+}
+
+// Lists the names (without suffix) of entries in dir ending in .conf or .env
+std::set<std::string> listConfigNames(const std::string& dir) {
+    std::set<std::string> names;
+    if(DIR* d = opendir(dir.c_str())) {
+        while(struct dirent* de = readdir(d)) {
+            std::string name = de->d_name;
+            if(endsWith(name, ".conf"))
+                names.insert(name.substr(0, name.size() - 5));
+            else if(endsWith(name, ".env"))
+                names.insert(name.substr(0, name.size() - 4));
+        }
+        closedir(d);
+    }
+    return names;
+}
+
+bool fileExists(const std::string& path) {
+    return access(path.c_str(), F_OK) == 0;
+}
+
+}
+
+std::shared_ptr<const Configuration> Configuration::load(const std::string& cfgDir, ConfCache& cache, uint64_t version) {
+    auto config = std::make_shared<Configuration>();
+    config->version = version;
+    config->cfgDir = cfgDir;
+    config->env = cache.get(cfgDir + "/env");
+    config->loadGroups(cache);
+    for(const std::string& name : listConfigNames(cfgDir + "/contexts"))
+        config->loadContext(name, cache);
+    for(const std::string& name : listConfigNames(cfgDir + "/jobs"))
+        config->loadJob(name, cache);
+    return config;
+}
+
+std::shared_ptr<const Configuration> Configuration::update(const std::set<std::string>& changedPaths, ConfCache& cache) const {
+    const std::string contextsDir = cfgDir + "/contexts";
+    const std::string jobsDir = cfgDir + "/jobs";
+
+    auto config = std::make_shared<Configuration>(*this);
+    config->version = version + 1;
+
+    for(const std::string& path : changedPaths) {
+        if(path == cfgDir || path == contextsDir || path == jobsDir)
+            return load(cfgDir, cache, version + 1);
+
+        size_t slash = path.rfind('/');
+        if(slash == std::string::npos)
+            continue;
+        std::string dir = path.substr(0, slash);
+        std::string file = path.substr(slash + 1);
+
+        if(dir == cfgDir) {
+            if(file == "env")
+                config->env = cache.get(path);
+            else if(file == "groups.conf")
+                config->loadGroups(cache);
+        } else if(dir == contextsDir || dir == jobsDir) {
+            std::string name;
+            if(endsWith(file, ".conf"))
+                name = file.substr(0, file.size() - 5);
+            else if(endsWith(file, ".env"))
+                name = file.substr(0, file.size() - 4);
+            else
+                continue;
+            if(dir == contextsDir)
+                config->loadContext(name, cache);
+            else
+                config->loadJob(name, cache);
+        }
+    }
+    return config;
+}
+
+const JobConfig& Configuration::job(const std::string& name) const {
+    static const JobConfig defaultJob = []{
+        JobConfig j;
+        j.contextPatterns.insert("default");
+        return j;
+    }();
+    auto it = jobs.find(name);
+    return it == jobs.end() ? defaultJob : *it->second;
+}
+
+void Configuration::loadGroups(ConfCache& cache) {
+    groups = cache.get(cfgDir + "/groups.conf");
+    if(groups.empty())
+        groups["All Jobs"] = ".*";
+}
+
+void Configuration::loadContext(const std::string& name, ConfCache& cache) {
+    std::string base = cfgDir + "/contexts/" + name;
+    bool hasConf = fileExists(base + ".conf");
+    bool hasEnv = fileExists(base + ".env");
+    if(!hasConf && !hasEnv) {
+        contexts.erase(name);
+        return;
+    }
+    auto context = std::make_shared<ContextConfig>();
+    context->defined = hasConf;
+    context->conf = cache.get(base + ".conf");
+    context->env = cache.get(base + ".env");
+    context->numExecutors = context->conf.get<int>("EXECUTORS", 6);
+    context->jobPatterns = splitPatterns(context->conf.get<std::string>("JOBS"));
+    context->cpuMax = context->conf.get<std::string>("CPU_MAX");
+    context->memoryMax = context->conf.get<std::string>("MEMORY_MAX");
+    contexts[name] = context;
+}
+
+void Configuration::loadJob(const std::string& name, ConfCache& cache) {
+    std::string base = cfgDir + "/jobs/" + name;
+    bool hasConf = fileExists(base + ".conf");
+    bool hasEnv = fileExists(base + ".env");
+    if(!hasConf && !hasEnv) {
+        jobs.erase(name);
+        return;
+    }
+    auto job = std::make_shared<JobConfig>();
+    job->conf = cache.get(base + ".conf");
+    job->env = cache.get(base + ".env");
+    job->contextPatterns = splitPatterns(job->conf.get<std::string>("CONTEXTS"));
+    if(job->contextPatterns.empty())
+        job->contextPatterns.insert("default");
+    job->description = job->conf.get<std::string>("DESCRIPTION");
+    job->timeout = job->conf.get<int>("TIMEOUT", 0);
+    job->snapshotWorkspace = job->conf.get<std::string>("WORKSPACE_MODE") == "snapshot";
+    job->mergeWorkspace = job->snapshotWorkspace && job->conf.get<int>("WORKSPACE_MERGE", 0) != 0;
+    job->keepArchives = job->conf.get<int>("KEEP_ARCHIVES", 0);
+    job->keepArchiveDays = job->conf.get<int>("KEEP_ARCHIVE_DAYS", 0);
+    job->compressArchive = job->conf.get<int>("ARCHIVE_COMPRESS", 0) != 0;
+    job->parallelSteps = job->conf.get<int>("PARALLEL_STEPS", 0);
+    job->cacheParams = splitPatterns(job->conf.get<std::string>("CACHE_KEY"));
+    jobs[name] = job;
+}
@@ -0,0 +1,107 @@
+///
+/// Copyright 2022 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#ifndef LAMINAR_CONFIGURATION_H_
+#define LAMINAR_CONFIGURATION_H_
+
+#include "conf.h"
+
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <stdint.h>
+
+// Parsed contents of cfg/jobs/$JOB.conf and cfg/jobs/$JOB.env
+struct JobConfig {
+    StringMap conf;
+    StringMap env;
+    // patterns of contexts this job may run in
+    std::set<std::string> contextPatterns;
+    std::string description;
+    int timeout = 0;
+    // give each run a private snapshot of the workspace, see workspace.h
+    bool snapshotWorkspace = false;
+    // replace the shared workspace with the snapshot of a successful run
+    bool mergeWorkspace = false;
+    // archive retention, 0 meaning forever. See Laminar::collectArchives
+    int keepArchives = 0;
+    int keepArchiveDays = 0;
+    // gzip archived files after the run, see compressArtifact
+    bool compressArchive = false;
+    // how many of the steps in cfg/jobs/$JOB.d run at once, 0 meaning
+    // as many as there are CPUs
+    int parallelSteps = 0;
+    // names of the parameters which determine the result of a run. If not
+    // empty, a successful earlier run with the same values is reused
+    std::set<std::string> cacheParams;
+};
+
+// Parsed contents of cfg/contexts/$CONTEXT.conf and cfg/contexts/$CONTEXT.env
+struct ContextConfig {
+    // Whether the .conf file exists. Only then is the context defined,
+    // but the implicit default context may still have an .env file
+    bool defined = false;
+    StringMap conf;
+    StringMap env;
+    int numExecutors = 6;
+    // patterns of jobs which may run in this context
+    std::set<std::string> jobPatterns;
+    // resource limits of each run in this context, see Cgroups::create
+    std::string cpuMax;
+    std::string memoryMax;
+};
+
+// An immutable snapshot of the parsed contents of $LAMINAR_HOME/cfg. A
+// new snapshot is derived from the previous one whenever files change,
+// re-parsing only the affected files and sharing everything else, and
+// then swapped in. Anything holding a reference to an older snapshot
+// (such as a run which is being started) continues to see a consistent
+// view of the configuration.
+class Configuration {
+public:
+    // Parses the whole configuration directory
+    static std::shared_ptr<const Configuration> load(const std::string& cfgDir, ConfCache& cache, uint64_t version = 1);
+
+    // Returns the next version of this snapshot, in which only the given
+    // (absolute) paths have been re-read. Changes which cannot be applied
+    // incrementally, such as to one of the directories themselves, cause
+    // a full reload. Paths which do not affect the parsed configuration
+    // (such as job scripts) are ignored.
+    std::shared_ptr<const Configuration> update(const std::set<std::string>& changedPaths, ConfCache& cache) const;
+
+    // Returns the configuration of the named job, which is empty (apart
+    // from the default context) if the job has no .conf or .env file
+    const JobConfig& job(const std::string& name) const;
+
+    uint64_t version;
+    std::string cfgDir;
+    // cfg/env
+    StringMap env;
+    // cfg/groups.conf
+    StringMap groups;
+    std::map<std::string, std::shared_ptr<const ContextConfig>> contexts;
+    std::map<std::string, std::shared_ptr<const JobConfig>> jobs;
+
+private:
+    void loadGroups(ConfCache& cache);
+    void loadContext(const std::string& name, ConfCache& cache);
+    void loadJob(const std::string& name, ConfCache& cache);
+};
+
+#endif // LAMINAR_CONFIGURATION_H_
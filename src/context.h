@@ -21,7 +21,9 @@
 
 #include <string>
 #include <set>
+#include <memory>
 class Run;
+class RemoteAgent;
 
 // Represents a context within which a Run will be executed. Allows applying
 // a certain environment to a set of Jobs, or setting a limit on the number
@@ -34,6 +36,8 @@ public:
     int numExecutors;
     int busyExecutors = 0;
     std::set<std::string> jobPatterns;
+    // if set, runs in this context are executed by a connected agent
+    std::shared_ptr<RemoteAgent> agent;
 };
 
 
@@ -23,6 +23,9 @@
 
 #include "laminar.h"
 
+#include <string.h>
+#include <zlib.h>
+
 // Helper class which wraps another class with calls to
 // adding and removing a pointer to itself from a passed
 // std::set reference. Used to keep track of currently
@@ -180,6 +183,68 @@ kj::Promise<void> writeLogChunk(LogWatcher* client, kj::AsyncOutputStream* strea
     });
 }
 
+// For artifacts compressed by ARCHIVE_COMPRESS. Not a full parser of
+// Accept-Encoding, but recognises when gzip is refused with q=0
+static bool acceptsGzip(kj::StringPtr encodings) {
+    const char* gzip = strstr(encodings.cStr(), "gzip");
+    if(!gzip)
+        return false;
+    const char* q = strstr(gzip, "q=");
+    const char* next = strchr(gzip, ',');
+    return !q || (next && q > next) || atof(q + 2) > 0;
+}
+
+// Whether an If-None-Match header is "*" or lists etag. Weak tags match
+// too, since If-None-Match uses the weak comparison
+static bool matchesEtag(kj::StringPtr header, const std::string& etag) {
+    for(const char* p = header.cStr(); *p;) {
+        p += strspn(p, " \t,");
+        size_t len = strcspn(p, ",");
+        std::string tag(p, len);
+        p += len;
+        tag.erase(tag.find_last_not_of(" \t") + 1);
+        if(tag == "*")
+            return true;
+        if(tag.compare(0, 2, "W/") == 0)
+            tag.erase(0, 2);
+        if(tag == etag)
+            return true;
+    }
+    return false;
+}
+
+struct Inflater {
+    Inflater(kj::ArrayPtr<const kj::byte> data) : buffer(kj::heapArray<kj::byte>(65536)) {
+        memset(&zs, 0, sizeof(zs));
+        // accept the gzip format
+        inflateInit2(&zs, 15 + 16);
+        zs.next_in = const_cast<Bytef*>(data.begin());
+        zs.avail_in = data.size();
+    }
+    ~Inflater() {
+        inflateEnd(&zs);
+    }
+    z_stream zs;
+    kj::Array<kj::byte> buffer;
+};
+
+static kj::Promise<void> writeInflatedChunk(Inflater* inflater, kj::AsyncOutputStream* stream) {
+    z_stream& zs = inflater->zs;
+    zs.next_out = inflater->buffer.begin();
+    zs.avail_out = inflater->buffer.size();
+    int r = inflate(&zs, Z_NO_FLUSH);
+    if(r != Z_OK && r != Z_STREAM_END)
+        return KJ_EXCEPTION(FAILED, "Corrupt compressed artifact");
+    return stream->write(inflater->buffer.begin(), inflater->buffer.size() - zs.avail_out).then([=]{
+        return r == Z_STREAM_END ? kj::Promise<void>(kj::READY_NOW) : writeInflatedChunk(inflater, stream);
+    });
+}
+
+static kj::Promise<void> writeInflated(kj::AsyncOutputStream* stream, kj::ArrayPtr<const kj::byte> data) {
+    auto inflater = kj::heap<Inflater>(data);
+    return writeInflatedChunk(inflater.get(), stream).attach(kj::mv(inflater));
+}
+
 kj::Promise<void> Http::request(kj::HttpMethod method, kj::StringPtr url, const kj::HttpHeaders &headers, kj::AsyncInputStream &requestBody, HttpService::Response &response)
 {
     const char* start, *end, *content_type;
@@ -221,9 +286,39 @@ kj::Promise<void> Http::request(kj::HttpMethod method, kj::StringPtr url, const
             }).attach(kj::mv(stream)).attach(kj::mv(peer));
         }
     } else if(url.startsWith("/archive/")) {
-        KJ_IF_MAYBE(file, laminar.getArtefact(url.slice(strlen("/archive/")))) {
+        std::string hash;
+        bool compressed;
+        KJ_IF_MAYBE(file, laminar.getArtefact(url.slice(strlen("/archive/")), hash, compressed)) {
+            // A compressed artifact is sent as it is to clients which
+            // accept gzip, and decompressed while sending for others
+            bool inflate = false;
+            if(compressed) {
+                inflate = true;
+                KJ_IF_MAYBE(encodings, headers.get(ACCEPT_ENCODING)) {
+                    inflate = !acceptsGzip(*encodings);
+                }
+                responseHeaders.add("Vary", "Accept-Encoding");
+            }
+            // the content of a deduplicated artifact is identified by its hash
+            std::string etag = "\"" + hash + (inflate ? "-gunzip" : "") + "\"";
+            if(!hash.empty()) {
+                responseHeaders.add("ETag", etag.c_str());
+                KJ_IF_MAYBE(match, headers.get(IF_NONE_MATCH)) {
+                    if(matchesEtag(*match, etag)) {
+                        auto stream = response.send(304, "Not Modified", responseHeaders, uint64_t(0));
+                        return kj::Promise<void>(kj::READY_NOW).attach(kj::mv(stream));
+                    }
+                }
+            }
             auto array = (*file)->mmap(0, (*file)->stat().size);
             responseHeaders.add("Content-Transfer-Encoding", "binary");
+            if(inflate) {
+                auto stream = response.send(200, "OK", responseHeaders, nullptr);
+                auto s = stream.get();
+                return writeInflated(s, array.asPtr()).attach(kj::mv(array)).attach(kj::mv(file)).attach(kj::mv(stream));
+            }
+            if(compressed)
+                responseHeaders.add("Content-Encoding", "gzip");
             auto stream = response.send(200, "OK", responseHeaders, array.size());
             return stream->write(array.begin(), array.size()).attach(kj::mv(array)).attach(kj::mv(file)).attach(kj::mv(stream));
         }
@@ -268,6 +363,8 @@ Http::Http(Laminar &li) :
 {
     kj::HttpHeaderTable::Builder builder;
     ACCEPT = builder.add("Accept");
+    IF_NONE_MATCH = builder.add("If-None-Match");
+    ACCEPT_ENCODING = builder.add("Accept-Encoding");
     headerTable = builder.build();
 }
 
@@ -293,6 +390,16 @@ void Http::notifyEvent(const char *data, std::string job)
     }
 }
 
+void Http::notifyRunEvent(const char *data, std::string job, uint run)
+{
+    for(EventPeer* c : eventPeers) {
+        if(c->scope.wantsRun(job, run)) {
+            c->pendingOutput.push_back("data: " + std::string(data) + "\n\n");
+            c->fulfiller->fulfill();
+        }
+    }
+}
+
 void Http::notifyLog(std::string job, uint run, std::string log_chunk, bool eot)
 {
     for(LogWatcher* lw : logWatchers) {
@@ -41,6 +41,7 @@ public:
     kj::Promise<void> startServer(kj::Timer &timer, kj::Own<kj::ConnectionReceiver> &&listener);
 
     void notifyEvent(const char* data, std::string job = nullptr);
+    void notifyRunEvent(const char* data, std::string job, uint run);
     void notifyLog(std::string job, uint run, std::string log_chunk, bool eot);
 
     // Allows supplying a custom HTML template. Pass an empty string to use the default.
@@ -64,6 +65,8 @@ private:
     std::set<LogWatcher*> logWatchers;
 
     kj::HttpHeaderId ACCEPT;
+    kj::HttpHeaderId IF_NONE_MATCH;
+    kj::HttpHeaderId ACCEPT_ENCODING;
 };
 
 #endif //LAMINAR_HTTP_H_
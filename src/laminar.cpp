@@ -22,24 +22,23 @@
 #include "log.h"
 #include "http.h"
 #include "rpc.h"
+#include "agent.h"
+#include "pattern.h"
+#include "setparams.h"
 
 #include <sys/wait.h>
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
-#include <fnmatch.h>
+#include <unistd.h>
 #include <fstream>
 #include <optional>
 
+#include <kj/vector.h>
 #include <rapidjson/stringbuffer.h>
 #include <rapidjson/writer.h>
 
-// FNM_EXTMATCH isn't supported under musl
-#if !defined(FNM_EXTMATCH)
-#define FNM_EXTMATCH 0
-#endif
-
 // rapidjson::Writer with a StringBuffer is used a lot in Laminar for
 // preparing JSON messages to send to HTTP clients. A small wrapper
 // class here reduces verbosity later for this common use case.
@@ -70,6 +69,12 @@ inline kj::Path operator/(const std::string& p, const T& ext) {
 
 typedef std::string str;
 
+// how often expired archives are looked for, in seconds
+#define ARCHIVE_GC_INTERVAL 3600
+// the maximum number of archives removed at once, so that the event
+// loop and the database are not held up for long
+#define ARCHIVE_GC_BATCH 100
+
 class temp_transaction {
 private:
     pqxx::connection conn;
@@ -110,6 +115,22 @@ Laminar::Laminar(Server &server, Settings settings) :
         archiveUrl.append("/");
 
     numKeepRunDirs = 0;
+    sampleInterval = 5;
+    if(const char* interval = getenv("LAMINAR_SAMPLE_INTERVAL"))
+        sampleInterval = atoi(interval);
+    archivesRemoved = 0;
+    archiveBytesReclaimed = 0;
+
+    // deletes old run directories in the background
+    trash = kj::heap<Trash>(settings.home);
+
+    if(const char* dedup = getenv("LAMINAR_DEDUPLICATE_ARCHIVE"); dedup && atoi(dedup)) {
+        cas = kj::heap<ContentStore>((homePath/"cas").toString(true).cStr());
+        if(!cas->init()) {
+            LLOG(ERROR, "Could not create content store, archive will not be deduplicated");
+            cas = nullptr;
+        }
+    }
 
     temp_transaction tx(settings.connection_string);
 
@@ -134,6 +155,21 @@ Laminar::Laminar(Server &server, Settings settings) :
           )
     )sql");
 
+    // resource usage, if runs are placed in cgroups
+    tx->exec(R"sql(
+        ALTER TABLE builds
+            ADD COLUMN IF NOT EXISTS cpuTime    BIGINT
+          , ADD COLUMN IF NOT EXISTS peakMemory BIGINT
+          , ADD COLUMN IF NOT EXISTS ioBytes    BIGINT
+          , ADD COLUMN IF NOT EXISTS peakPids   BIGINT
+    )sql");
+
+    // set when the archive has been removed by KEEP_ARCHIVES or KEEP_ARCHIVE_DAYS
+    tx->exec(R"sql(
+        ALTER TABLE builds
+            ADD COLUMN IF NOT EXISTS archiveRemoved BOOLEAN
+    )sql");
+
     tx->exec(R"sql(
         CREATE TABLE IF NOT EXISTS artifacts
           ( guid        UUID   DEFAULT uuid_generate_v4() PRIMARY KEY
@@ -145,11 +181,67 @@ Laminar::Laminar(Server &server, Settings settings) :
           )
     )sql");
 
+    // SHA-256 of the content, if the archive is deduplicated, and the size
+    // of the file on disk if it was compressed with ARCHIVE_COMPRESS
+    tx->exec(R"sql(
+        ALTER TABLE artifacts
+            ADD COLUMN IF NOT EXISTS hash TEXT
+          , ADD COLUMN IF NOT EXISTS compressedSize BIGINT
+    )sql");
+
     tx->exec(R"sql(
         CREATE UNIQUE INDEX IF NOT EXISTS idx_name_number ON builds
           (name, number DESC)
     )sql");
 
+    // the key of a job with CACHE_KEY, and the run whose result was reused
+    tx->exec(R"sql(
+        ALTER TABLE builds
+            ADD COLUMN IF NOT EXISTS cacheKey    TEXT
+          , ADD COLUMN IF NOT EXISTS reusedBuild BIGINT
+    )sql");
+
+    tx->exec(R"sql(
+        CREATE INDEX IF NOT EXISTS idx_cache_key ON builds
+          (name, cacheKey)
+        WHERE cacheKey IS NOT NULL
+    )sql");
+
+    // the scripts executed by each run, see LEADER_STEPS_FD
+    tx->exec(R"sql(
+        CREATE TABLE IF NOT EXISTS build_steps
+          ( guid        UUID   DEFAULT uuid_generate_v4() PRIMARY KEY
+          , name        TEXT   NOT NULL
+          , number      BIGINT NOT NULL
+          , position    INT    NOT NULL
+          , step        TEXT   NOT NULL
+          , startedAt   BIGINT NOT NULL
+          , completedAt BIGINT
+          , result      INT
+          , CONSTRAINT fk_name_number FOREIGN KEY (name, number) REFERENCES builds(name, number)
+          )
+    )sql");
+
+    tx->exec(R"sql(
+        CREATE INDEX IF NOT EXISTS idx_build_steps ON build_steps
+          (name, number)
+    )sql");
+
+    // the resource usage of each run over time, see SampleSeries
+    tx->exec("ALTER TABLE builds ADD COLUMN IF NOT EXISTS resourceSamples BYTEA");
+
+    // the parameters of each run, including those set by laminarc set
+    tx->exec(R"sql(
+        CREATE TABLE IF NOT EXISTS build_params
+          ( name        TEXT   NOT NULL
+          , number      BIGINT NOT NULL
+          , param       TEXT   NOT NULL
+          , value       TEXT   NOT NULL
+          , PRIMARY KEY (name, number, param)
+          , CONSTRAINT fk_name_number FOREIGN KEY (name, number) REFERENCES builds(name, number)
+          )
+    )sql");
+
     tx->exec(R"sql(
         CREATE INDEX IF NOT EXISTS idx_completion_time ON builds
           (completedAt DESC)
@@ -240,15 +332,18 @@ Laminar::Laminar(Server &server, Settings settings) :
         LIMIT 5
     )sql");
 
+    if(const char* cg = getenv("LAMINAR_CGROUP"))
+        cgroups.init(cg);
+
     // retrieve the last build numbers
     tx->exec("SELECT name, MAX(number) FROM builds GROUP BY name")
     .for_each([this](str name, uint build){
         buildNums[name] = build;
     });
 
-    srv.watchPaths([this]{
-        LLOG(INFO, "Reloading configuration");
-        loadConfiguration();
+    srv.watchPaths([this](const std::set<std::string>& changedPaths){
+        LLOG(INFO, "Reloading configuration", changedPaths.size());
+        loadConfiguration(changedPaths);
         // config change may allow stuck jobs to dequeue
         assignNewJobs();
     }).addPath((homePath/"cfg"/"contexts").toString(true).cStr())
@@ -256,7 +351,7 @@ Laminar::Laminar(Server &server, Settings settings) :
       .addPath((homePath/"cfg").toString(true).cStr()); // for groups.conf
 
     loadCustomizations();
-    srv.watchPaths([this]{
+    srv.watchPaths([this](const std::set<std::string>&){
         LLOG(INFO, "Reloading customizations");
         loadCustomizations();
     }).addPath((homePath/"custom").toString(true).cStr());
@@ -267,6 +362,13 @@ Laminar::Laminar(Server &server, Settings settings) :
     // Load configuration, may be called again in response to an inotify event
     // that the configuration files have been modified
     loadConfiguration();
+
+    // don't compete with startup for the database
+    scheduleArchiveCollection(60);
+
+    // usage is read from the runs' cgroups
+    if(sampleInterval > 0 && cgroups.enabled())
+        scheduleSampling();
 }
 
 void Laminar::loadCustomizations() {
@@ -320,6 +422,86 @@ const RunSet& Laminar::listRunningJobs() {
     return activeJobs;
 }
 
+// Runs known to laminard are described without a database query
+static RunInfo runInfo(const Run& run, RunState state) {
+    RunInfo info;
+    info.job = run.name;
+    info.number = run.build;
+    info.state = state;
+    info.queuedAt = run.queuedAt;
+    info.startedAt = state == RunState::QUEUED ? 0 : run.startedAt;
+    info.completedAt = 0;
+    info.reason = run.reason();
+    info.parentJob = run.parentName;
+    info.parentBuild = run.parentBuild;
+    if(run.context)
+        info.context = run.context->name;
+    return info;
+}
+
+bool Laminar::getRun(std::string job, uint num, RunInfo& info) {
+    // A run stays active after its leader is reaped, until its artifacts
+    // are indexed. By then, its result is only recorded in the database
+    Run* active = activeRun(job, num);
+    if(active && active->pid != nullptr) {
+        info = runInfo(*active, RunState::RUNNING);
+        return true;
+    }
+    for(const std::shared_ptr<Run>& run : queuedJobs) {
+        if(run->name == job && run->build == num) {
+            info = runInfo(*run, RunState::QUEUED);
+            return true;
+        }
+    }
+    std::vector<RunInfo> runs = listRuns(job, num + 1, 1);
+    if(runs.empty() || runs.front().number != num)
+        return false;
+    info = runs.front();
+    return true;
+}
+
+std::vector<RunInfo> Laminar::listRuns(std::string job, uint before, uint limit, kj::Maybe<RunState> state) {
+    std::vector<RunInfo> runs;
+    // ORDER BY param cannot be bound, nor can a condition be left out
+    std::string query = "SELECT number,queuedAt,startedAt,completedAt,result,reason,parentJob,parentBuild,node FROM builds "
+                        "WHERE name = $1 AND number < $2";
+    int result = -1;
+    KJ_IF_MAYBE(s, state) {
+        query += " AND result = $4";
+        result = int(*s);
+    }
+    query += " ORDER BY number DESC LIMIT $3";
+    temp_transaction tx(settings.connection_string);
+    auto callback = [&](uint number,
+                        time_t queued,
+                        std::optional<time_t> started,
+                        std::optional<time_t> completed,
+                        std::optional<int> result,
+                        std::optional<std::string> reason,
+                        std::optional<std::string> parentJob,
+                        std::optional<uint> parentBuild,
+                        std::optional<std::string> node) {
+        RunInfo info;
+        info.job = job;
+        info.number = number;
+        info.state = completed ? RunState(result.value_or(0)) : started ? RunState::RUNNING : RunState::QUEUED;
+        info.queuedAt = queued;
+        info.startedAt = started.value_or(0);
+        info.completedAt = completed.value_or(0);
+        info.reason = reason.value_or("");
+        info.parentJob = parentJob.value_or("");
+        info.parentBuild = parentBuild.value_or(0);
+        info.context = node.value_or("");
+        runs.push_back(kj::mv(info));
+    };
+    int64_t upper = before ? int64_t(before) : INT64_MAX;
+    if(result < 0)
+        tx->exec_params(query, job, upper, limit).for_each(callback);
+    else
+        tx->exec_params(query, job, upper, limit, result).for_each(callback);
+    return runs;
+}
+
 std::list<std::string> Laminar::listKnownJobs() {
     std::list<std::string> res;
     KJ_IF_MAYBE(dir, fsHome->tryOpenSubdir(kj::Path{"cfg","jobs"})) {
@@ -332,27 +514,117 @@ std::list<std::string> Laminar::listKnownJobs() {
     return res;
 }
 
-void Laminar::populateArtifacts(Json &j, std::string job, uint num, pqxx::stream_to *stream, kj::Path subdir) const {
+void Laminar::writeArtifacts(Json &j, std::string job, uint num, const std::vector<Artifact>& artifacts) const {
     kj::Path runArchive{job,std::to_string(num)};
-    runArchive = runArchive.append(subdir);
-    KJ_IF_MAYBE(dir, fsHome->tryOpenSubdir("archive"/runArchive)) {
-        for(kj::StringPtr file : (*dir)->listNames()) {
-            kj::FsNode::Metadata meta = (*dir)->lstat(kj::Path{file});
-            if(meta.type == kj::FsNode::Type::FILE) {
-                j.StartObject();
-                j.set("url", archiveUrl + (runArchive/file).toString().cStr());
-                j.set("filename", (subdir/file).toString().cStr());
-                j.set("size", meta.size);
-                j.EndObject();
-                if (stream != nullptr) {
-                    std::tuple<str, uint, str, uint> row{job, num, (subdir/file).toString().cStr(), meta.size};
-                    *stream << row;
-                }
-            } else if(meta.type == kj::FsNode::Type::DIRECTORY) {
-                populateArtifacts(j, job, num, stream, subdir/file);
+    for(const Artifact& artifact : artifacts) {
+        j.StartObject();
+        j.set("url", archiveUrl + runArchive.append(kj::Path::parse(artifact.filename)).toString().cStr());
+        j.set("filename", artifact.filename);
+        j.set("size", artifact.size);
+        j.EndObject();
+    }
+}
+
+std::vector<Artifact> Laminar::artifactList(const Run& run) {
+    std::vector<Artifact> result;
+    result.reserve(run.artifacts.size());
+    for(const auto& it : run.artifacts)
+        result.push_back(Artifact{it.first, it.second});
+    return result;
+}
+
+void Laminar::handleArtifactChange(Run* r, const std::string& file, bool removed) {
+    if(file.empty()) {
+        // events were lost, so the archive will have to be listed
+        r->artifactsComplete = false;
+        return;
+    }
+    if(removed) {
+        r->artifacts.erase(file);
+        return;
+    }
+    struct stat st;
+    if(lstat((homePath/"archive"/r->name/std::to_string(r->build)).append(kj::Path::parse(file)).toString(true).cStr(), &st) != 0 || !S_ISREG(st.st_mode))
+        return;
+    r->artifacts[file] = st.st_size;
+
+    Json j;
+    j.set("type", "artifact_added")
+     .startObject("data")
+     .set("name", r->name)
+     .set("number", r->build)
+     .set("url", archiveUrl + kj::Path{r->name, std::to_string(r->build)}.append(kj::Path::parse(file)).toString().cStr())
+     .set("filename", file)
+     .set("size", uint64_t(st.st_size))
+     .EndObject();
+    http->notifyRunEvent(j.str(), r->name, r->build);
+}
+
+void Laminar::handleLeaderRecord(Run* r, const std::string& record) {
+    // "param NAME VALUE", see setparams.h
+    if(record.compare(0, 6, "param ") == 0) {
+        size_t v = record.find(' ', 6);
+        if(v != std::string::npos)
+            setParam(r->name, r->build, record.substr(6, v - 6), unescapeParamValue(record.substr(v + 1)));
+        return;
+    }
+    // "started TIME NAME" or "completed TIME RESULT NAME", see LEADER_STEPS_FD
+    size_t t = record.find(' ');
+    size_t n = record.find(' ', t + 1);
+    if(t == std::string::npos || n == std::string::npos)
+        return;
+    std::string event = record.substr(0, t);
+    time_t time = atoll(record.c_str() + t + 1);
+    RunStep* step = nullptr;
+    if(event == "started") {
+        r->steps.push_back(RunStep{record.substr(n + 1), time, 0, RunState::RUNNING});
+        step = &r->steps.back();
+    } else if(event == "completed") {
+        size_t s = record.find(' ', n + 1);
+        if(s == std::string::npos)
+            return;
+        std::string result = record.substr(n + 1, s - n - 1);
+        std::string name = record.substr(s + 1);
+        for(auto it = r->steps.rbegin(); it != r->steps.rend(); ++it) {
+            if(it->name == name && it->result == RunState::RUNNING) {
+                it->completedAt = time;
+                it->result = result == "success" ? RunState::SUCCESS : result == "aborted" ? RunState::ABORTED : RunState::FAILED;
+                step = &*it;
+                break;
             }
         }
     }
+    if(!step)
+        return;
+
+    Json j;
+    j.set("type", "step_changed")
+     .startObject("data")
+     .set("name", r->name)
+     .set("number", r->build)
+     .startObject("step");
+    j.set("name", step->name)
+     .set("started", step->startedAt)
+     .set("result", to_string(step->result));
+    if(step->completedAt)
+        j.set("completed", step->completedAt);
+    j.EndObject();
+    j.EndObject();
+    http->notifyRunEvent(j.str(), r->name, r->build);
+}
+
+void Laminar::writeStep(Json& j, const RunStep& step) {
+    j.StartObject();
+    j.set("name", step.name)
+     .set("started", step.startedAt)
+     .set("result", to_string(step.result));
+    if(step.completedAt)
+        j.set("completed", step.completedAt);
+    j.EndObject();
+}
+
+void Laminar::populateArtifacts(Json &j, std::string job, uint num) const {
+    writeArtifacts(j, job, num, indexArtifacts((homePath/"archive"/job/std::to_string(num)).toString(true).cStr()));
 }
 
 void Laminar::populateArtifactsFromDB(Json &j, std::string job, uint num) const {
@@ -379,7 +651,7 @@ std::string Laminar::getStatus(MonitorScope scope) {
     j.startObject("data");
     if(scope.type == MonitorScope::RUN) {
         bool isCompleted = false;
-        tx->exec_params("SELECT queuedAt,startedAt,completedAt,result,reason,parentJob,parentBuild,q.lr FROM builds "
+        tx->exec_params("SELECT queuedAt,startedAt,completedAt,result,reason,parentJob,parentBuild,q.lr,cpuTime,peakMemory,ioBytes,peakPids,reusedBuild FROM builds "
                         "LEFT JOIN (SELECT DISTINCT ON (name) name n, completedAt-startedAt lr FROM builds WHERE result IS NOT NULL ORDER BY name, number DESC) q ON q.n = name "
                         "WHERE name = $1 AND number = $2",
                         scope.job, scope.num)
@@ -390,7 +662,12 @@ std::string Laminar::getStatus(MonitorScope scope) {
                       std::optional<std::string> reason,
                       std::optional<std::string> parentJob,
                       uint parentBuild,
-                      std::optional<uint> lastRuntime) {
+                      std::optional<uint> lastRuntime,
+                      std::optional<int64_t> cpuTime,
+                      std::optional<int64_t> peakMemory,
+                      std::optional<int64_t> ioBytes,
+                      std::optional<int64_t> peakPids,
+                      std::optional<uint> reusedBuild) {
             j.set("queued", queued);
             j.set("started", started.value_or(0));
             if(completed) {
@@ -402,13 +679,67 @@ std::string Laminar::getStatus(MonitorScope scope) {
             j.startObject("upstream").set("name", parentJob.value_or("")).set("num", parentBuild).EndObject(2);
             if(lastRuntime)
               j.set("etc", started.value_or(0) + *lastRuntime);
+            if(reusedBuild)
+              j.set("reused", *reusedBuild);
+            if(cpuTime) {
+              j.startObject("resources")
+               .set("cpuTime", *cpuTime)
+               .set("peakMemory", peakMemory.value_or(0))
+               .set("ioBytes", ioBytes.value_or(0))
+               .set("peakPids", peakPids.value_or(0))
+               .EndObject();
+            }
         });
         if(auto it = buildNums.find(scope.job); it != buildNums.end())
             j.set("latestNum", int(it->second));
 
+        // steps are recorded in the database when the run completes
+        Run* active = activeRun(scope.job, scope.num);
+        j.startArray("steps");
+        if(active) {
+            for(const RunStep& step : active->steps)
+                writeStep(j, step);
+        } else {
+            tx->exec_params("SELECT step,startedAt,completedAt,result FROM build_steps WHERE name = $1 AND number = $2 ORDER BY position",
+                            scope.job, scope.num)
+            .for_each([&](std::string name, time_t started, std::optional<time_t> completed, std::optional<int> result){
+                writeStep(j, RunStep{name, started, completed.value_or(0), result ? RunState(*result) : RunState::UNKNOWN});
+            });
+        }
+        j.EndArray();
+
+        // as are the samples of its resource usage
+        j.startArray("samples");
+        if(active) {
+            writeSamples(j, SampleSeries::decode(active->samples.data()));
+        } else {
+            tx->exec_params("SELECT resourceSamples FROM builds WHERE name = $1 AND number = $2 AND resourceSamples IS NOT NULL",
+                            scope.job, scope.num)
+            .for_each([&](std::basic_string<std::byte> samples){
+                writeSamples(j, SampleSeries::decode(std::string(reinterpret_cast<const char*>(samples.data()), samples.size())));
+            });
+        }
+        j.EndArray();
+
+        // so are the parameters, which may be set while it runs
+        j.startObject("params");
+        if(active) {
+            for(const auto& param : std::map<std::string, std::string>(active->params.begin(), active->params.end()))
+                j.set(param.first.c_str(), param.second);
+        } else {
+            tx->exec_params("SELECT param, value FROM build_params WHERE name = $1 AND number = $2 ORDER BY param",
+                            scope.job, scope.num)
+            .for_each([&](std::string param, std::string value){
+                j.set(param.c_str(), value);
+            });
+        }
+        j.EndObject();
+
         j.startArray("artifacts");
         if (isCompleted)
             populateArtifactsFromDB(j, scope.job, scope.num);
+        else if(active && active->artifactsComplete)
+            writeArtifacts(j, scope.job, scope.num, artifactList(*active));
         else
             populateArtifacts(j, scope.job, scope.num);
         j.EndArray();
@@ -494,8 +825,7 @@ std::string Laminar::getStatus(MonitorScope scope) {
             j.set("number", build).set("started", started);
             j.EndObject();
         });
-        auto desc = jobDescriptions.find(scope.job);
-        j.set("description", desc == jobDescriptions.end() ? "" : desc->second);
+        j.set("description", config->job(scope.job).description);
     } else if(scope.type == MonitorScope::ALL) {
         j.startArray("jobs");
         tx->exec("SELECT DISTINCT ON (name) name, number, startedAt, completedAt, result, reason "
@@ -522,7 +852,7 @@ std::string Laminar::getStatus(MonitorScope scope) {
         }
         j.EndArray();
         j.startObject("groups");
-        for(const auto& group : jobGroups)
+        for(const auto& group : config->groups)
             j.set(group.first.c_str(), group.second);
         j.EndObject();
     } else { // Home page
@@ -576,6 +906,16 @@ std::string Laminar::getStatus(MonitorScope scope) {
         }
         j.set("executorsTotal", execTotal);
         j.set("executorsBusy", execBusy);
+        Trash::Stats trashStats = trash->stats();
+        j.startObject("trash")
+         .set("pending", trashStats.pending)
+         .set("removedEntries", trashStats.removedEntries)
+         .set("removedFiles", trashStats.removedFiles)
+         .EndObject();
+        j.startObject("archiveGc")
+         .set("removedArchives", archivesRemoved)
+         .set("reclaimedBytes", archiveBytesReclaimed)
+         .EndObject();
         j.startArray("buildsPerDay");
         for(int i = 6; i >= 0; --i) {
             j.StartObject();
@@ -643,50 +983,55 @@ std::string Laminar::getStatus(MonitorScope scope) {
 
 Laminar::~Laminar() noexcept { }
 
-bool Laminar::loadConfiguration() {
+// the job patterns of the named context in the configuration, if any
+static std::set<std::string> contextJobPatterns(const Configuration& config, const std::string& name) {
+    auto it = config.contexts.find(name);
+    return it == config.contexts.end() ? std::set<std::string>() : it->second->jobPatterns;
+}
+
+bool Laminar::loadConfiguration(const std::set<std::string>& changedPaths) {
     if(const char* ndirs = getenv("LAMINAR_KEEP_RUNDIRS"))
         numKeepRunDirs = static_cast<uint>(atoi(ndirs));
 
-    std::set<std::string> knownContexts;
-
-    KJ_IF_MAYBE(contextsDir, fsHome->tryOpenSubdir(kj::Path{"cfg","contexts"})) {
-        for(kj::Directory::Entry& entry : (*contextsDir)->listEntries()) {
-            if(!entry.name.endsWith(".conf"))
-                continue;
-
-            StringMap conf = parseConfFile((homePath/"cfg"/"contexts"/entry.name).toString(true).cStr());
-
-            std::string name(entry.name.cStr(), entry.name.findLast('.').orDefault(0));
-            auto existing = contexts.find(name);
-            std::shared_ptr<Context> context = existing == contexts.end() ? contexts.emplace(name, std::shared_ptr<Context>(new Context)).first->second : existing->second;
-            context->name = name;
-            context->numExecutors = conf.get<int>("EXECUTORS", 6);
-
-            std::string jobPtns = conf.get<std::string>("JOBS");
-            std::set<std::string> jobPtnsList;
-            if(!jobPtns.empty()) {
-                std::istringstream iss(jobPtns);
-                std::string job;
-                while(std::getline(iss, job, ','))
-                    jobPtnsList.insert(job);
-            }
-            context->jobPatterns.swap(jobPtnsList);
+    // Build a new snapshot of the configuration and swap it in. Runs which
+    // were already started keep a reference to the snapshot they used
+    if(!config || changedPaths.empty())
+        config = Configuration::load((homePath/"cfg").toString(true).cStr(), confCache, config ? config->version + 1 : 1);
+    else
+        config = config->update(changedPaths, confCache);
+    LLOG(INFO, "Loaded configuration", config->version);
 
-            knownContexts.insert(name);
-        }
+    // Synchronise the contexts, which additionally track their busy
+    // executors, with the new snapshot
+    std::set<std::string> knownContexts;
+    for(const auto& it : config->contexts) {
+        if(!it.second->defined)
+            continue;
+        const std::string& name = it.first;
+        knownContexts.insert(name);
+        auto existing = contexts.find(name);
+        std::shared_ptr<Context> context = existing == contexts.end() ? contexts.emplace(name, std::shared_ptr<Context>(new Context)).first->second : existing->second;
+        context->name = name;
+        context->numExecutors = it.second->numExecutors;
+        context->jobPatterns = it.second->jobPatterns;
     }
 
     // remove any contexts whose config files disappeared.
     // if there are no known contexts, take care not to remove and re-add the default context.
+    // Contexts of agents last as long as their connection, but take the job
+    // patterns of any context of the same name in the configuration
     for(auto it = contexts.begin(); it != contexts.end();) {
-        if((it->first == "default" && knownContexts.size() == 0) || knownContexts.find(it->first) != knownContexts.end())
+        if(it->second->agent) {
+            it->second->jobPatterns = contextJobPatterns(*config, it->second->name);
+            it++;
+        } else if((it->first == "default" && knownContexts.size() == 0) || knownContexts.find(it->first) != knownContexts.end())
             it++;
         else
             it = contexts.erase(it);
     }
 
     // add a default context
-    if(contexts.empty()) {
+    if(knownContexts.empty() && contexts.find("default") == contexts.end()) {
         LLOG(INFO, "Creating a default context with 6 executors");
         std::shared_ptr<Context> context(new Context);
         context->name = "default";
@@ -694,80 +1039,99 @@ bool Laminar::loadConfiguration() {
         contexts.emplace("default", context);
     }
 
-    KJ_IF_MAYBE(jobsDir, fsHome->tryOpenSubdir(kj::Path{"cfg","jobs"})) {
-        for(kj::Directory::Entry& entry : (*jobsDir)->listEntries()) {
-            if(!entry.name.endsWith(".conf"))
-                continue;
-            StringMap conf = parseConfFile((homePath/"cfg"/"jobs"/entry.name).toString(true).cStr());
-
-            std::string jobName(entry.name.cStr(), entry.name.findLast('.').orDefault(0));
-
-            std::string ctxPtns = conf.get<std::string>("CONTEXTS");
-
-            std::set<std::string> ctxPtnList;
-            if(!ctxPtns.empty()) {
-                std::istringstream iss(ctxPtns);
-                std::string ctx;
-                while(std::getline(iss, ctx, ','))
-                    ctxPtnList.insert(ctx);
-            }
-            // Must be present both here and in queueJob because otherwise if a context
-            // were created while a job is already queued, the default context would be
-            // dropped when the set of contexts is updated here.
-            if(ctxPtnList.empty())
-                ctxPtnList.insert("default");
-            jobContexts[jobName].swap(ctxPtnList);
-
-            std::string desc = conf.get<std::string>("DESCRIPTION");
-            if(!desc.empty()) {
-                jobDescriptions[jobName] = desc;
-            }
-        }
-    }
-
-    jobGroups.clear();
-    KJ_IF_MAYBE(groupsConf, fsHome->tryOpenFile(kj::Path{"cfg","groups.conf"}))
-        jobGroups = parseConfFile((homePath/"cfg"/"groups.conf").toString(true).cStr());
-    if(jobGroups.empty())
-        jobGroups["All Jobs"] = ".*";
-
     return true;
 }
 
 std::shared_ptr<Run> Laminar::queueJob(std::string name, ParamMap params, bool frontOfQueue) {
-    if(!fsHome->exists(kj::Path{"cfg","jobs",name+".run"})) {
-        LLOG(ERROR, "Non-existent job", name);
-        return nullptr;
-    }
-
-    // jobContexts[name] can be empty if there is no .conf file at all
-    if(jobContexts[name].empty())
-        jobContexts.at(name).insert("default");
+    std::vector<std::pair<std::string, ParamMap>> jobs;
+    jobs.emplace_back(kj::mv(name), kj::mv(params));
+    return queueJobs(kj::mv(jobs), frontOfQueue).front();
+}
 
-    std::shared_ptr<Run> run = std::make_shared<Run>(name, ++buildNums[name], kj::mv(params), homePath.clone());
-    if(frontOfQueue)
-        queuedJobs.push_front(run);
-    else
-        queuedJobs.push_back(run);
+std::vector<std::shared_ptr<Run>> Laminar::queueJobs(std::vector<std::pair<std::string, ParamMap>> jobs, bool frontOfQueue) {
+    std::vector<std::shared_ptr<Run>> runs;
+    runs.reserve(jobs.size());
+    // runs queued at the front keep their relative order, ahead of what
+    // was previously at the front
+    auto insertAt = frontOfQueue ? queuedJobs.begin() : queuedJobs.end();
+    uint queueIndex = frontOfQueue ? 0 : queuedJobs.size();
+    std::vector<uint> queueIndices;
+    for(auto& job : jobs) {
+        const std::string& name = job.first;
+        if(!fsHome->exists(kj::Path{"cfg","jobs",name+".run"})) {
+            LLOG(ERROR, "Non-existent job", name);
+            runs.push_back(nullptr);
+            continue;
+        }
+        std::shared_ptr<Run> run = std::make_shared<Run>(name, ++buildNums[name], kj::mv(job.second), homePath.clone());
+        queuedJobs.insert(insertAt, run);
+        queueIndices.push_back(queueIndex++);
+        runs.push_back(run);
+    }
+    if(queueIndices.empty())
+        return runs;
 
+    // a single COPY, so the whole batch is one write and one commit. The
+    // column names are quoted, so must be given as the folded lower case
     temp_transaction tx(settings.connection_string);
-    tx->exec_params("INSERT INTO builds(name,number,queuedAt,parentJob,parentBuild,reason) VALUES($1,$2,$3,$4,$5,$6)",
-                    run->name, run->build, run->queuedAt, run->parentName, run->parentBuild, run->reason());
+    auto stream = pqxx::stream_to::table(tx.ref(), {"builds"}, {"name", "number", "queuedat", "parentjob", "parentbuild", "reason"});
+    for(const std::shared_ptr<Run>& run : runs) {
+        if(run)
+            stream << std::tuple<str, uint, time_t, str, int, str>{run->name, run->build, run->queuedAt, run->parentName, run->parentBuild, run->reason()};
+    }
+    stream.complete();
 
     // notify clients
-    Json j;
-    j.set("type", "job_queued")
-        .startObject("data")
-        .set("name", name)
-        .set("number", run->build)
-        .set("result", to_string(RunState::QUEUED))
-        .set("queueIndex", frontOfQueue ? 0 : (queuedJobs.size() - 1))
-        .set("reason", run->reason())
-        .EndObject();
-    http->notifyEvent(j.str(), name.c_str());
+    auto index = queueIndices.begin();
+    for(const std::shared_ptr<Run>& run : runs) {
+        if(!run)
+            continue;
+        Json j;
+        j.set("type", "job_queued")
+            .startObject("data")
+            .set("name", run->name)
+            .set("number", run->build)
+            .set("result", to_string(RunState::QUEUED))
+            .set("queueIndex", *index)
+            .set("reason", run->reason())
+            .EndObject();
+        http->notifyEvent(j.str(), run->name.c_str());
+        rpc->notifyEvent(*run, RunState::QUEUED, *index++);
+    }
+
+    assignNewJobs();
+    return runs;
+}
 
+bool Laminar::addAgent(std::shared_ptr<RemoteAgent> agent) {
+    // contexts of agents are keyed by NAME/CONTEXT, which cannot clash with
+    // the names of contexts in the configuration
+    std::string prefix = agent->name + "/";
+    for(const auto& it : contexts) {
+        if(it.first.compare(0, prefix.size(), prefix) == 0)
+            return false;
+    }
+    for(const auto& c : agent->contexts) {
+        std::shared_ptr<Context> context(new Context);
+        context->name = c.first;
+        context->numExecutors = c.second;
+        context->jobPatterns = contextJobPatterns(*config, c.first);
+        context->agent = agent;
+        contexts.emplace(prefix + c.first, context);
+    }
+    LLOG(INFO, "Agent connected", agent->name, agent->contexts.size());
     assignNewJobs();
-    return run;
+    return true;
+}
+
+void Laminar::removeAgent(const RemoteAgent* agent) {
+    for(auto it = contexts.begin(); it != contexts.end();) {
+        if(it->second->agent.get() == agent)
+            it = contexts.erase(it);
+        else
+            it++;
+    }
+    LLOG(INFO, "Agent disconnected", agent->name);
 }
 
 bool Laminar::abort(std::string job, uint buildNum) {
@@ -788,13 +1152,13 @@ bool Laminar::canQueue(const Context& ctx, const Run& run) const {
 
     // match may be jobs as defined by the context...
     for(std::string p : ctx.jobPatterns) {
-        if(fnmatch(p.c_str(), run.name.c_str(), FNM_EXTMATCH) == 0)
+        if(matchesPattern(p, run.name))
             return true;
     }
 
     // ...or context as defined by the job.
-    for(std::string p : jobContexts.at(run.name)) {
-        if(fnmatch(p.c_str(), ctx.name.c_str(), FNM_EXTMATCH) == 0)
+    for(std::string p : config->job(run.name).contextPatterns) {
+        if(matchesPattern(p, ctx.name))
             return true;
     }
 
@@ -817,23 +1181,88 @@ bool Laminar::tryStartRun(std::shared_ptr<Run> run, int queueIndex) {
                 lastResult = RunState(result.value_or(0));
             });
 
-            kj::Promise<RunState> onRunFinished = run->start(lastResult, ctx, *fsHome,[this](kj::Maybe<pid_t>& pid){return srv.onChildExit(pid);});
+            // reuse the latest successful run with the same key whose archive is still there
+            const JobConfig& job = config->job(run->name);
+            if(!job.cacheParams.empty()) {
+                run->setCacheKey(job.cacheParams);
+                tx->exec_params("SELECT number FROM builds WHERE name = $1 AND cacheKey = $2 AND result = $3 AND archiveRemoved IS NOT TRUE ORDER BY number DESC LIMIT 1",
+                                run->name, run->cacheKey, int(RunState::SUCCESS))
+                .for_each([&](uint number){
+                    run->reusedBuild = number;
+                });
+                // The archive is not listed again, since compressed files
+                // would then be taken for artifacts named $FILENAME.gz
+                if(run->reusedBuild) {
+                    tx->exec_params("SELECT filename, filesize, compressedSize, hash FROM artifacts WHERE name = $1 AND number = $2",
+                                    run->name, run->reusedBuild)
+                    .for_each([&](str filename, uint64_t filesize, std::optional<uint64_t> compressedSize, std::optional<str> hash){
+                        run->reusedArtifacts.push_back(StoredArtifact{filename, filesize, compressedSize, hash});
+                    });
+                }
+            }
+
+            // an agent has no access to laminard's cgroups, and a reused run needs none
+            if(cgroups.enabled() && !ctx->agent && !run->reusedBuild) {
+                std::string cpuMax, memoryMax;
+                if(auto it = config->contexts.find(ctx->name); it != config->contexts.end()) {
+                    cpuMax = it->second->cpuMax;
+                    memoryMax = it->second->memoryMax;
+                }
+                run->cgroup = cgroups.create(run->name + "." + std::to_string(run->build), cpuMax, memoryMax);
+            }
+
+            // Follow the files the run archives, so that clients can be told
+            // immediately and the archive need not be listed again
+            kj::Path archive{"archive", run->name, std::to_string(run->build)};
+            if(fsHome->tryOpenSubdir(archive, kj::WriteMode::CREATE|kj::WriteMode::MODIFY|kj::WriteMode::CREATE_PARENT) != nullptr && !run->reusedBuild) {
+                run->artifactsComplete = true;
+                run->archiveWatch = srv.watchTree((homePath/archive.asPtr()).toString(true).cStr(), [this, r=run.get()](const std::string& file, bool removed){
+                    handleArtifactChange(r, file, removed);
+                });
+                if(!run->archiveWatch)
+                    run->artifactsComplete = false;
+            }
+
+            kj::Promise<RunState> onRunFinished = run->start(lastResult, ctx, srv, config);
 
             tx->exec_params("UPDATE builds SET node = $1, startedAt = $2 WHERE name = $3 AND number = $4",
                             ctx->name, run->startedAt, run->name, run->build);
+            if(!run->cacheKey.empty()) {
+                std::optional<uint> reused;
+                if(run->reusedBuild)
+                    reused = run->reusedBuild;
+                tx->exec_params("UPDATE builds SET cacheKey = $1, reusedBuild = $2 WHERE name = $3 AND number = $4",
+                                run->cacheKey, reused, run->name, run->build);
+            }
 
             ctx->busyExecutors++;
 
-            kj::Promise<void> exec = srv.readDescriptor(run->output_fd, [this, run](const char*b, size_t n){
-                // handle log output
-                std::string s(b, n);
-                run->log += s;
-                http->notifyLog(run->name, run->build, s, false);
+            kj::Promise<void> exec = run->whenStarted().then([this, run]{
+                // the output pipe is available once the spawner has launched the leader
+                kj::Vector<kj::Promise<void>> reads;
+                reads.add(srv.readDescriptor(run->output_fd, [this, run](const char*b, size_t n){
+                    // handle log output
+                    std::string s(b, n);
+                    run->log += s;
+                    http->notifyLog(run->name, run->build, s, false);
+                    rpc->notifyLog(run->name, run->build, s, false);
+                }));
+                if(run->steps_fd >= 0) {
+                    auto partial = std::make_shared<std::string>();
+                    reads.add(srv.readDescriptor(run->steps_fd, [this, run, partial](const char*b, size_t n){
+                        partial->append(b, n);
+                        size_t start = 0;
+                        for(size_t nl; (nl = partial->find('\n', start)) != std::string::npos; start = nl + 1)
+                            handleLeaderRecord(run.get(), partial->substr(start, nl - start));
+                        partial->erase(0, start);
+                    }));
+                }
+                return kj::joinPromises(reads.releaseAsArray());
             }).then([run, p = kj::mv(onRunFinished)]() mutable {
                 // wait until leader reaped
                 return kj::mv(p);
             }).then([this, run](RunState){
-                handleRunFinished(run.get());
+                return handleRunFinished(run.get()).attach(kj::cp(run));
             });
             if(run->timeout > 0) {
                 exec = exec.attach(srv.addTimeout(run->timeout, [r=run.get()](){
@@ -860,6 +1289,7 @@ bool Laminar::tryStartRun(std::shared_ptr<Run> run, int queueIndex) {
             });
             j.EndObject();
             http->notifyEvent(j.str(), run->name.c_str());
+            rpc->notifyEvent(*run, RunState::RUNNING, 0);
             return true;
         }
     }
@@ -878,7 +1308,7 @@ void Laminar::assignNewJobs() {
     }
 }
 
-void Laminar::handleRunFinished(Run * r) {
+kj::Promise<void> Laminar::handleRunFinished(Run * r) {
     std::shared_ptr<Context> ctx = r->context;
 
     ctx->busyExecutors--;
@@ -888,6 +1318,39 @@ void Laminar::handleRunFinished(Run * r) {
     temp_transaction tx(settings.connection_string);
     tx->exec_params("UPDATE builds SET completedAt = $1, result = $2, output = $3, outputLen = $4 WHERE name = $5 AND number = $6",
                     completedAt, int(r->result), pqxx::binary_cast(r->log), r->log.length(), r->name, r->build);
+    if(!r->cgroup.empty()) {
+        // a last sample, so that the series covers the whole run
+        if(sampleInterval > 0) {
+            sampleResources(r);
+            tx->exec_params("UPDATE builds SET resourceSamples = $1 WHERE name = $2 AND number = $3",
+                            pqxx::binary_cast(r->samples.data()), r->name, r->build);
+        }
+        RunResources res = cgroups.release(r->cgroup);
+        tx->exec_params("UPDATE builds SET cpuTime = $1, peakMemory = $2, ioBytes = $3, peakPids = $4 WHERE name = $5 AND number = $6",
+                        int64_t(res.cpuTime), int64_t(res.peakMemory), int64_t(res.ioBytes), int64_t(res.peakPids), r->name, r->build);
+    }
+    if(!r->steps.empty()) {
+        auto stream = pqxx::stream_to::table(tx.ref(), {"build_steps"}, {"name", "number", "position", "step", "startedat", "completedat", "result"});
+        int position = 0;
+        for(const RunStep& step : r->steps) {
+            // a step still running when the leader exited was killed with it
+            std::optional<time_t> completedAt;
+            std::optional<int> result;
+            if(step.result != RunState::RUNNING) {
+                completedAt = step.completedAt;
+                result = int(step.result);
+            }
+            stream << std::tuple<str, uint, int, str, time_t, std::optional<time_t>, std::optional<int>>{
+                r->name, r->build, position++, step.name, step.startedAt, completedAt, result};
+        }
+        stream.complete();
+    }
+    if(!r->params.empty()) {
+        auto stream = pqxx::stream_to::table(tx.ref(), {"build_params"}, {"name", "number", "param", "value"});
+        for(const auto& param : r->params)
+            stream << std::tuple<str, uint, str, str>{r->name, r->build, param.first, param.second};
+        stream.complete();
+    }
     tx->exec("REFRESH MATERIALIZED VIEW build_time_changes");
     tx->exec("REFRESH MATERIALIZED VIEW builds_per_day");
     tx->exec("REFRESH MATERIALIZED VIEW low_pass_rates");
@@ -895,6 +1358,80 @@ void Laminar::handleRunFinished(Run * r) {
     tx->exec("REFRESH MATERIALIZED VIEW result_changed");
     tx->exec("REFRESH MATERIALIZED VIEW builds_per_job");
 
+    // The leader has exited, so the events of all files it archived are queued
+    bool indexed = false;
+    auto artifacts = kj::heap<std::vector<Artifact>>();
+    if(r->archiveWatch) {
+        r->archiveWatch->drain();
+        r->archiveWatch = nullptr;
+        if(r->artifactsComplete) {
+            *artifacts = artifactList(*r);
+            indexed = true;
+        }
+    }
+
+    // Otherwise, listing an archive with very many files takes seconds, so
+    // this and storing the rows happen on a worker thread. Clients are
+    // notified of the completion once the artifacts are known
+    std::string archive = (homePath/"archive"/r->name/std::to_string(r->build)).toString(true).cStr();
+    return srv.offload([a=artifacts.get(), indexed, archive, conn=std::string(settings.connection_string), name=r->name, build=r->build, reused=r->reusedBuild ? &r->reusedArtifacts : nullptr]{
+        temp_transaction tx(conn.c_str());
+        if(reused) {
+            // exactly the files which were linked, in the form they were
+            // linked in. The reused run's records may have changed since
+            auto stream = pqxx::stream_to::table(tx.ref(), {"artifacts"}, {"name", "number", "filename", "filesize", "compressedSize", "hash"});
+            for(const StoredArtifact& artifact : *reused) {
+                stream << std::tuple<str, uint, str, uint64_t, std::optional<uint64_t>, std::optional<str>>{
+                    name, build, artifact.filename, artifact.size, artifact.compressedSize, artifact.hash};
+                a->push_back(Artifact{artifact.filename, artifact.size});
+            }
+            stream.complete();
+            return;
+        }
+        if(!indexed)
+            *a = indexArtifacts(archive);
+        auto stream = pqxx::stream_to::table(tx.ref(), {"artifacts"}, {"name", "number", "filename", "filesize"});
+        for(const Artifact& artifact : *a)
+            stream << std::tuple<str, uint, str, uint64_t>{name, build, artifact.filename, artifact.size};
+        stream.complete();
+    }).then([](){}, [r](kj::Exception&& e){
+        LLOG(ERROR, "Could not index artifacts", r->name, r->build, e.getDescription());
+    }).then([this, r, completedAt, a=artifacts.get()](){
+        publishRunFinished(r, completedAt, *a);
+    }).attach(kj::mv(artifacts));
+}
+
+void Laminar::publishRunFinished(Run* r, time_t completedAt, const std::vector<Artifact>& artifacts) {
+    bool compress = config->job(r->name).compressArchive;
+    if((cas || compress) && !r->reusedBuild) {
+        // Compressing and hashing could take minutes for large artifacts.
+        // A compressed file is stored in the content store as it is
+        std::string archive = (homePath/"archive"/r->name/std::to_string(r->build)).toString(true).cStr();
+        kj::Maybe<ContentStore> store;
+        if(cas)
+            store = *cas;
+        srv.addTask(srv.offloadBulk([store, compress, conn=std::string(settings.connection_string), name=r->name, build=r->build, archive, artifacts]() mutable {
+            temp_transaction tx(conn.c_str());
+            for(const Artifact& artifact : artifacts) {
+                std::string path = archive + "/" + artifact.filename;
+                uint64_t compressedSize;
+                if(compress && compressArtifact(path, compressedSize)) {
+                    // getArtefact opens the .gz once the row says so
+                    tx->exec_params("UPDATE artifacts SET compressedSize = $1 WHERE name = $2 AND number = $3 AND filename = $4",
+                                    compressedSize, name, build, artifact.filename);
+                    unlink(path.c_str());
+                    path += ".gz";
+                }
+                KJ_IF_MAYBE(s, store) {
+                    std::string hash = s->store(path);
+                    if(!hash.empty())
+                        tx->exec_params("UPDATE artifacts SET hash = $1 WHERE name = $2 AND number = $3 AND filename = $4",
+                                        hash, name, build, artifact.filename);
+                }
+            }
+        }));
+    }
+
     // notify clients
     Json j;
     j.set("type", "job_completed")
@@ -907,16 +1444,16 @@ void Laminar::handleRunFinished(Run * r) {
             .set("result", to_string(r->result))
             .set("reason", r->reason());
     j.startArray("artifacts");
-    auto stream = pqxx::stream_to::table(tx.ref(), {"artifacts"}, {"name", "number", "filename", "filesize"});
-    populateArtifacts(j, r->name, r->build, &stream);
-    stream.complete();
+    writeArtifacts(j, r->name, r->build, artifacts);
     j.EndArray();
     j.EndObject();
     http->notifyEvent(j.str(), r->name);
+    rpc->notifyEvent(*r, r->result, 0, completedAt);
     http->notifyLog(r->name, r->build, "", true);
-    // erase reference to run from activeJobs. Since runFinished is called in a
-    // lambda whose context contains a shared_ptr<Run>, the run won't be deleted
-    // until the context is destroyed at the end of the lambda execution.
+    rpc->notifyLog(r->name, r->build, "", true);
+    // erase reference to run from activeJobs. The promise returned by
+    // handleRunFinished has a shared_ptr<Run> attached, so the run won't be
+    // deleted until this has returned.
     activeJobs.byRunPtr().erase(r);
 
     // remove old run directories
@@ -936,14 +1473,7 @@ void Laminar::handleRunFinished(Run * r) {
         // anyway so hence this (admittedly debatable) optimization.
         if(!fsHome->exists(d))
             break;
-        // must use a try/catch because remove will throw if deletion fails. Using
-        // tryRemove does not help because it still throws an exception for some
-        // errors such as EACCES
-        try {
-            fsHome->remove(d);
-        } catch(kj::Exception& e) {
-            LLOG(ERROR, "Could not remove directory", e.getDescription());
-        }
+        discardDirectory(d);
     }
 
     fsHome->symlink(kj::Path{"archive", r->name, "latest"}, std::to_string(r->build), kj::WriteMode::CREATE|kj::WriteMode::MODIFY);
@@ -952,8 +1482,186 @@ void Laminar::handleRunFinished(Run * r) {
     assignNewJobs();
 }
 
-kj::Maybe<kj::Own<const kj::ReadableFile>> Laminar::getArtefact(std::string path) {
-    return fsHome->openFile(kj::Path("archive").append(kj::Path::parse(path)));
+void Laminar::discardDirectory(const kj::Path& d) {
+    // Deleting a large directory could take seconds, so move it aside
+    // to be deleted in the background
+    std::string path = (homePath/d.asPtr()).toString(true).cStr();
+    if(trash->discard(path))
+        return;
+    // The rename fails if, for example, archive/ is on another filesystem
+    // than the trash. Then the directory is deleted where it is, but still
+    // not on the event loop. remove throws if deletion fails
+    srv.addTask(srv.offloadBulk([path]{
+        kj::newDiskFilesystem()->getRoot().remove(kj::Path::parse(path.substr(1)));
+    }).then([](){}, [path](kj::Exception&& e){
+        LLOG(ERROR, "Could not remove directory", path, e.getDescription());
+    }));
+}
+
+bool Laminar::collectArchives() {
+    int budget = ARCHIVE_GC_BATCH;
+    uint64_t reclaimed = 0;
+    int removed = 0;
+    temp_transaction tx(settings.connection_string);
+    for(const auto& it : config->jobs) {
+        const std::string& name = it.first;
+        const JobConfig& job = *it.second;
+        if(job.keepArchives <= 0 && job.keepArchiveDays <= 0)
+            continue;
+
+        // Archives of runs numbered up to and including this one are
+        // beyond the number to keep. Only completed runs are considered,
+        // since active runs are still writing to their archives
+        uint64_t lastExpired = 0;
+        if(job.keepArchives > 0) {
+            tx->exec_params("SELECT number FROM builds WHERE name = $1 AND result IS NOT NULL ORDER BY number DESC OFFSET $2 LIMIT 1",
+                            name, job.keepArchives)
+            .for_each([&](uint64_t number){
+                lastExpired = number;
+            });
+        }
+        time_t cutoff = job.keepArchiveDays > 0 ? time(nullptr) - time_t(job.keepArchiveDays) * 86400 : 0;
+        if(lastExpired == 0 && cutoff == 0)
+            continue;
+
+        // whatever happens, the target of archive/$JOB/latest must stay
+        uint latest = 0;
+        KJ_IF_MAYBE(target, fsHome->tryReadlink(kj::Path{"archive", name, "latest"})) {
+            latest = atoi(target->cStr());
+        }
+
+        std::vector<uint> expired;
+        tx->exec_params("SELECT number FROM builds WHERE name = $1 AND result IS NOT NULL AND archiveRemoved IS NOT TRUE "
+                        "AND number <> $2 AND (number <= $3 OR completedAt < $4) ORDER BY number LIMIT $5",
+                        name, latest, lastExpired, int64_t(cutoff), budget)
+        .for_each([&](uint number){
+            expired.push_back(number);
+        });
+
+        for(uint number : expired) {
+            // with deduplication, the space is only reclaimed once the
+            // content store is pruned, which reports it instead
+            if(!cas) {
+                tx->exec_params("SELECT COALESCE(SUM(COALESCE(compressedSize, filesize)), 0) FROM artifacts WHERE name = $1 AND number = $2", name, number)
+                .for_each([&](uint64_t bytes){
+                    reclaimed += bytes;
+                });
+            }
+            tx->exec_params("DELETE FROM artifacts WHERE name = $1 AND number = $2", name, number);
+            tx->exec_params("UPDATE builds SET archiveRemoved = TRUE WHERE name = $1 AND number = $2", name, number);
+            kj::Path d{"archive", name, std::to_string(number)};
+            if(fsHome->exists(d))
+                discardDirectory(d);
+            removed++;
+        }
+        budget -= expired.size();
+        if(budget <= 0)
+            break;
+    }
+
+    if(removed > 0) {
+        archivesRemoved += removed;
+        archiveBytesReclaimed += reclaimed;
+        LLOG(INFO, "Removed expired archives", removed, reclaimed);
+    }
+    return budget <= 0;
+}
+
+void Laminar::scheduleSampling() {
+    srv.addBackgroundTask(srv.addTimeout(sampleInterval, [this](){
+        for(const std::shared_ptr<Run>& run : activeJobs) {
+            // handleRunFinished takes the last sample of a reaped leader
+            if(run->cgroup.empty() || run->pid == nullptr)
+                continue;
+            sampleResources(run.get());
+        }
+        scheduleSampling();
+    }));
+}
+
+void Laminar::sampleResources(Run* r) {
+    ResourceSample sample;
+    sample.time = time(nullptr) - r->startedAt;
+    Cgroups::readUsage(r->cgroup, sample.cpuTime, sample.memory);
+    r->samples.append(sample);
+
+    // only clients of the run's page receive these
+    Json j;
+    j.set("type", "resource_sample")
+     .startObject("data")
+     .set("name", r->name)
+     .set("number", r->build)
+     .startArray("sample");
+    j.Uint64(sample.time);
+    j.Uint64(sample.cpuTime);
+    j.Uint64(sample.memory);
+    j.EndArray();
+    j.EndObject();
+    http->notifyRunEvent(j.str(), r->name, r->build);
+}
+
+void Laminar::writeSamples(Json& j, const std::vector<ResourceSample>& samples) {
+    // [time, cpuTime, memory], which is much shorter than an object
+    for(const ResourceSample& sample : samples) {
+        j.StartArray();
+        j.Uint64(sample.time);
+        j.Uint64(sample.cpuTime);
+        j.Uint64(sample.memory);
+        j.EndArray();
+    }
+}
+
+void Laminar::scheduleArchiveCollection(int seconds) {
+    srv.addBackgroundTask(srv.addTimeout(seconds, [this](){
+        // continue promptly with the next batch, if there is one
+        if(collectArchives()) {
+            scheduleArchiveCollection(1);
+            return;
+        }
+        scheduleArchiveCollection(ARCHIVE_GC_INTERVAL);
+        // contents are no longer needed once no archive links to them
+        if(cas) {
+            auto freed = kj::heap<uint64_t>(0);
+            srv.addBackgroundTask(srv.offloadBulk([store=*cas, f=freed.get()]() mutable {
+                *f = store.prune();
+            }).then([this, f=freed.get()](){
+                if(*f > 0) {
+                    archiveBytesReclaimed += *f;
+                    LLOG(INFO, "Pruned content store", *f);
+                }
+            }).attach(kj::mv(freed)));
+        }
+    }));
+}
+
+kj::Maybe<kj::Own<const kj::ReadableFile>> Laminar::getArtefact(std::string path, std::string& hash, bool& compressed) {
+    compressed = false;
+    kj::Path file = kj::Path("archive").append(kj::Path::parse(path));
+    // path is $JOB/$RUN/$FILENAME
+    size_t jobEnd = path.find('/');
+    size_t numEnd = jobEnd == std::string::npos ? jobEnd : path.find('/', jobEnd + 1);
+    if(numEnd == std::string::npos)
+        return fsHome->tryOpenFile(file);
+    std::string job = path.substr(0, jobEnd);
+    // Only a deduplicated or compressed artifact has anything in the
+    // database that the file itself doesn't tell. An artifact compressed
+    // before ARCHIVE_COMPRESS was unset is missing under its own name
+    if(!cas && !config->job(job).compressArchive) {
+        KJ_IF_MAYBE(f, fsHome->tryOpenFile(file)) {
+            return kj::mv(*f);
+        }
+    }
+    temp_transaction tx(settings.connection_string);
+    tx->exec_params("SELECT hash, compressedSize FROM artifacts WHERE name = $1 AND number = $2 AND filename = $3",
+                    job, atoi(path.c_str() + jobEnd + 1), path.substr(numEnd + 1))
+    .for_each([&](std::optional<str> h, std::optional<uint64_t> compressedSize){
+        hash = h.value_or("");
+        compressed = compressedSize.has_value();
+    });
+    // ARCHIVE_COMPRESS replaces the file with $FILENAME.gz
+    if(compressed)
+        return fsHome->tryOpenFile(kj::Path("archive").append(kj::Path::parse(path + ".gz")));
+    return fsHome->tryOpenFile(file);
 }
 
 bool Laminar::handleBadgeRequest(std::string job, std::string &badge) {
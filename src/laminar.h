@@ -22,6 +22,12 @@
 #include "run.h"
 #include "monitorscope.h"
 #include "context.h"
+#include "conf.h"
+#include "configuration.h"
+#include "cgroup.h"
+#include "trash.h"
+#include "cas.h"
+#include "artifacts.h"
 
 #include <unordered_map>
 #include <kj/filesystem.h>
@@ -36,6 +42,7 @@ class Json;
 
 class Http;
 class Rpc;
+class RemoteAgent;
 
 struct Settings {
     const char* home;
@@ -45,6 +52,21 @@ struct Settings {
     const char* connection_string;
 };
 
+// A summary of a run, queued, active or completed. Times not yet
+// reached are 0
+struct RunInfo {
+    std::string job;
+    uint number;
+    RunState state;
+    time_t queuedAt;
+    time_t startedAt;
+    time_t completedAt;
+    std::string reason;
+    std::string parentJob;
+    uint parentBuild;
+    std::string context;
+};
+
 // The main class implementing the application's business logic.
 class Laminar final {
 public:
@@ -55,6 +77,12 @@ public:
     // the supplied name is not a known job.
     std::shared_ptr<Run> queueJob(std::string name, ParamMap params = ParamMap(), bool frontOfQueue = false);
 
+    // Queues several jobs at once with a single database write and a single
+    // pass of the scheduler. The returned runs are in the order of the given
+    // jobs, which keep that order in the queue. An entry is nullptr if the
+    // corresponding name is not a known job.
+    std::vector<std::shared_ptr<Run>> queueJobs(std::vector<std::pair<std::string, ParamMap>> jobs, bool frontOfQueue = false);
+
     // Return the latest known number of the named job
     uint latestRun(std::string job);
 
@@ -67,9 +95,9 @@ public:
     // which should be provided as part of the scope.
     std::string getStatus(MonitorScope scope);
 
-    // Implements the laminarc function of setting arbitrary parameters on a run,
-    // (typically the current run) which will be made available in the environment
-    // of subsequent scripts.
+    // Records a parameter set on a run by `laminarc set`, which the leader has
+    // already made available in the environment of subsequent scripts. The
+    // parameters of a run are stored in the database when it completes.
     bool setParam(std::string job, uint buildNum, std::string param, std::string value);
 
     // Gets the list of jobs currently waiting in the execution queue
@@ -78,34 +106,76 @@ public:
     // Gets the list of currently executing jobs
     const RunSet& listRunningJobs();
 
+    // Gets the summary of a single run. Returns false if it is not known
+    bool getRun(std::string job, uint num, RunInfo& info);
+
+    // Gets summaries of runs of a job in descending order of number, starting
+    // below the given number (or from the latest if 0). If state is given,
+    // only completed runs with that result are included
+    std::vector<RunInfo> listRuns(std::string job, uint before, uint limit, kj::Maybe<RunState> state = nullptr);
+
     // Gets the list of known jobs - scans cfg/jobs for *.run files
     std::list<std::string> listKnownJobs();
 
     // Fetches the content of an artifact given its filename relative to
     // $LAMINAR_HOME/archive. Ideally, this would instead be served by a
-    // proper web server which handles this url.
-    kj::Maybe<kj::Own<const kj::ReadableFile>> getArtefact(std::string path);
+    // proper web server which handles this url. If the content has been
+    // hashed, hash is set to its SHA-256. If compressed is set, the content
+    // of the returned file is gzipped
+    kj::Maybe<kj::Own<const kj::ReadableFile>> getArtefact(std::string path, std::string& hash, bool& compressed);
 
     // Given the name of a job, populate the provided string reference with
     // SVG content describing the last known state of the job. Returns false
     // if the job is unknown.
     bool handleBadgeRequest(std::string job, std::string& badge);
 
+    // Offers the contexts of a newly connected agent for runs. Returns false
+    // if an agent of the same name is already connected
+    bool addAgent(std::shared_ptr<RemoteAgent> agent);
+
+    // Withdraws the contexts of an agent which disconnected. Runs it was
+    // executing finish as their RPC calls fail
+    void removeAgent(const RemoteAgent* agent);
+
     // Aborts a single job
     bool abort(std::string job, uint buildNum);
 
     // Abort all running jobs
     void abortAll();
 
+    // Removes a batch of archives which have expired according to the jobs'
+    // KEEP_ARCHIVES and KEEP_ARCHIVE_DAYS. Returns true if there may be more.
+    // Called periodically, see scheduleArchiveCollection
+    bool collectArchives();
+
 private:
-    bool loadConfiguration();
+    // Reloads the configuration. If changedPaths is empty, everything is
+    // re-read, otherwise only the given files are.
+    bool loadConfiguration(const std::set<std::string>& changedPaths = {});
     void loadCustomizations();
     void assignNewJobs();
     bool canQueue(const Context& ctx, const Run& run) const;
     bool tryStartRun(std::shared_ptr<Run> run, int queueIndex);
-    void handleRunFinished(Run*);
+    kj::Promise<void> handleRunFinished(Run*);
+    void publishRunFinished(Run* r, time_t completedAt, const std::vector<Artifact>& artifacts);
+    // moves a directory below $LAMINAR_HOME into the trash, or deletes it
+    // on a worker thread
+    void discardDirectory(const kj::Path& d);
+    void scheduleArchiveCollection(int seconds);
+    // Samples the resource usage of each active run every sampleInterval
+    // seconds, see SampleSeries
+    void scheduleSampling();
+    void sampleResources(Run* r);
+    static void writeSamples(Json& out, const std::vector<ResourceSample>& samples);
     // expects that Json has started an array
-    void populateArtifacts(Json& out, std::string job, uint num, pqxx::stream_to *stream = nullptr, kj::Path subdir = kj::Path::parse(".")) const;
+    void writeArtifacts(Json& out, std::string job, uint num, const std::vector<Artifact>& artifacts) const;
+    void populateArtifacts(Json& out, std::string job, uint num) const;
+    static std::vector<Artifact> artifactList(const Run& run);
+    // called by the watch of a run's archive, see Server::watchTree
+    void handleArtifactChange(Run* r, const std::string& file, bool removed);
+    // called for each record the leader writes to its steps pipe
+    void handleLeaderRecord(Run* r, const std::string& record);
+    static void writeStep(Json& out, const RunStep& step);
     void populateArtifactsFromDB(Json& out, std::string job, uint num) const;
 
     Run* activeRun(const std::string name, uint num) {
@@ -117,11 +187,8 @@ private:
 
     std::unordered_map<std::string, uint> buildNums;
 
-    std::unordered_map<std::string, std::set<std::string>> jobContexts;
-
-    std::unordered_map<std::string, std::string> jobDescriptions;
-
-    std::unordered_map<std::string, std::string> jobGroups;
+    // The current snapshot of the parsed contents of cfg
+    std::shared_ptr<const Configuration> config;
 
     RunSet activeJobs;
     Settings settings;
@@ -130,8 +197,18 @@ private:
     kj::Path homePath;
     kj::Own<const kj::Directory> fsHome;
     uint numKeepRunDirs;
+    // 0 if runs are not sampled
+    int sampleInterval;
+    ConfCache confCache;
+    Cgroups cgroups;
     std::string archiveUrl;
 
+    kj::Own<Trash> trash;
+    // if archived files are deduplicated, the store of their contents
+    kj::Own<ContentStore> cas;
+    // totals of archive garbage collection since startup
+    uint64_t archivesRemoved;
+    uint64_t archiveBytesReclaimed;
     kj::Own<Http> http;
     kj::Own<Rpc> rpc;
 };
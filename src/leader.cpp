@@ -20,15 +20,28 @@
 #include <string>
 #include <unistd.h>
 #include <queue>
+#include <map>
+#include <algorithm>
 #include <dirent.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 #include <sys/prctl.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <kj/async-io.h>
 #include <kj/async-unix.h>
 #include <kj/filesystem.h>
+#include <kj/vector.h>
 
 #include "run.h"
+#include "cgroup.h"
+#include "pidfd.h"
+#include "setparams.h"
+#include "trash.h"
+#include "workspace.h"
 
 // short syntax helper for kj::Path
 template<typename T>
@@ -44,6 +57,8 @@ struct Script {
     kj::Path path;
     kj::Path cwd;
     bool runOnAbort;
+    // if not empty, these are executed concurrently instead of path
+    std::vector<kj::Path> steps;
 };
 
 static void aggressive_recursive_kill(pid_t parent) {
@@ -78,16 +93,102 @@ static void aggressive_recursive_kill(pid_t parent) {
     closedir(proc);
 }
 
+// Reads the parent pid and state from /proc/PID/stat. The process name
+// may contain spaces and parentheses, so parse from the last ')'
+static bool read_proc_stat(const char* pid, pid_t& ppid, char& state) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%s/stat", pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+        return false;
+    char buf[512];
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if(n <= 0)
+        return false;
+    buf[n] = '\0';
+    char* p = strrchr(buf, ')');
+    return p && sscanf(p + 1, " %c %d", &state, &ppid) == 2;
+}
+
+// Sends SIGKILL to all descendents of parent. Unlike aggressive_recursive_kill,
+// /proc is scanned only once to build the process tree. Each process is then
+// signalled through a pidfd, after checking that the pidfd refers to the
+// process which was found in the tree and not to a new one which reused its
+// pid. Returns false if pidfds are not supported by the kernel.
+static bool pidfd_kill_descendents(pid_t parent) {
+    DIR* proc = opendir("/proc");
+    if(!proc)
+        return false;
+    std::unordered_map<pid_t, std::vector<pid_t>> children;
+    while(struct dirent* de = readdir(proc)) {
+        if(!isdigit(*de->d_name))
+            continue;
+        pid_t ppid;
+        char state;
+        // zombies are already dead, they just need to be reaped
+        if(read_proc_stat(de->d_name, ppid, state) && state != 'Z')
+            children[ppid].push_back(atoi(de->d_name));
+    }
+    closedir(proc);
+
+    std::unordered_set<pid_t> tree;
+    std::vector<pid_t> pending{parent};
+    while(!pending.empty()) {
+        pid_t p = pending.back();
+        pending.pop_back();
+        for(pid_t child : children[p]) {
+            tree.insert(child);
+            pending.push_back(child);
+        }
+    }
+
+    for(pid_t pid : tree) {
+        int pidfd = pidfdOpen(pid);
+        if(pidfd < 0) {
+            if(errno == ENOSYS)
+                return false;
+            continue; // already exited
+        }
+        // The process may have exited and its pid been reused between the
+        // scan and pidfd_open. It's ours if its parent is still in the tree
+        // (or is the leader, which adopts orphans as the subreaper)
+        pid_t ppid;
+        char state;
+        if(read_proc_stat(std::to_string(pid).c_str(), ppid, state) && (ppid == parent || tree.count(ppid))) {
+            fprintf(stderr, "[laminar] sending SIGKILL to pid %d\n", pid);
+            pidfdSendSignal(pidfd, SIGKILL);
+        }
+        close(pidfd);
+    }
+    return true;
+}
+
 
 class Leader final : public kj::TaskSet::ErrorHandler {
 public:
-    Leader(kj::AsyncIoContext& ioContext, kj::Filesystem& fs, const char* jobName, uint runNumber);
+    Leader(kj::AsyncIoContext& ioContext, kj::Filesystem& fs, const char* jobName, uint runNumber, std::string scriptsCgroup, std::string workspaceMode, int parallelSteps);
     RunState run();
 
 private:
     void taskFailed(kj::Exception&& exception) override;
+    void killDescendents();
+    void snapshotWorkspace();
+    void mergeWorkspace();
     kj::Promise<void> step(std::queue<Script>& scripts);
+    pid_t startScript(const kj::Path& path, const kj::Path& cwd, int outputFd = -1, const std::string& stepName = "");
+    kj::Promise<void> waitForScript(pid_t pid);
+    kj::Promise<void> reapOrphans(pid_t script);
+    void scriptExited(int status, const std::string& script);
+    void reportStep(const char* event, const std::string& script, const char* result = nullptr);
+    void reportParam(const std::string& name, const std::string& value);
+    void signalScripts(int sig);
+    kj::Promise<void> runSteps(Script& group);
+    void startSteps();
+    kj::Promise<void> reapSteps();
+    kj::Promise<void> forwardStepOutput(kj::AsyncInputStream& in, kj::ArrayPtr<char> buffer, const std::string& prefix, std::string& partial);
     kj::Promise<void> reapChildProcesses();
+    kj::Promise<void> waitChildSignal();
     kj::Promise<void> readEnvPipe(kj::AsyncInputStream* stream, char* buffer);
 
     kj::TaskSet tasks;
@@ -99,12 +200,37 @@ private:
     uint runNumber;
     pid_t currentGroupId;
     pid_t currentScriptPid;
+    std::queue<Script> initScripts;
     std::queue<Script> scripts;
+    // path relative to cfg of the script being executed, if not a group
+    std::string currentScriptName;
+    // see LEADER_STEPS_FD. -1 if not open
+    int stepsFd;
+    // the steps of the group being executed which have not started yet,
+    // and the pids (and process groups) of those which are running
+    std::queue<kj::Path> pendingSteps;
+    struct RunningStep {
+        std::string name;
+        // path relative to cfg, as reported in step records
+        std::string script;
+    };
+    std::map<pid_t, RunningStep> runningSteps;
+    kj::Path stepsCwd;
+    kj::Vector<kj::Promise<void>> stepOutputs;
+    int parallelSteps;
     int setEnvPipe[2];
+    // bytes read from setEnvPipe which do not yet make up a whole frame
+    std::string setEnvFrames;
     bool aborting;
+    // if not empty, the cgroup in which all scripts are executed
+    std::string scriptsCgroup;
+    // whether the scripts use a snapshot of the workspace, and whether
+    // it replaces the shared workspace afterwards
+    bool snapshot;
+    bool merge;
 };
 
-Leader::Leader(kj::AsyncIoContext &ioContext, kj::Filesystem &fs, const char *jobName, uint runNumber) :
+Leader::Leader(kj::AsyncIoContext &ioContext, kj::Filesystem &fs, const char *jobName, uint runNumber, std::string scriptsCgroup, std::string workspaceMode, int parallelSteps) :
     tasks(*this),
     result(RunState::SUCCESS),
     ioContext(ioContext),
@@ -112,22 +238,34 @@ Leader::Leader(kj::AsyncIoContext &ioContext, kj::Filesystem &fs, const char *jo
     rootPath(fs.getCurrentPath()),
     jobName(jobName),
     runNumber(runNumber),
-    aborting(false)
+    currentGroupId(0),
+    currentScriptPid(0),
+    stepsFd(fcntl(LEADER_STEPS_FD, F_SETFD, FD_CLOEXEC) == 0 ? LEADER_STEPS_FD : -1),
+    stepsCwd(nullptr),
+    parallelSteps(parallelSteps),
+    aborting(false),
+    scriptsCgroup(kj::mv(scriptsCgroup)),
+    snapshot(workspaceMode.compare(0, 8, "snapshot") == 0),
+    merge(workspaceMode == "snapshot,merge")
 {
     tasks.add(ioContext.unixEventPort.onSignal(SIGTERM).then([this](siginfo_t) {
+        while(!initScripts.empty())
+            initScripts.pop();
         while(scripts.size() && (!scripts.front().runOnAbort))
             scripts.pop();
+        while(!pendingSteps.empty())
+            pendingSteps.pop();
         // TODO: probably shouldn't do this if we are already in a runOnAbort script
-        kill(-currentGroupId, SIGTERM);
+        signalScripts(SIGTERM);
         return this->ioContext.provider->getTimer().afterDelay(2*kj::SECONDS).then([this]{
             aborting = true;
-            aggressive_recursive_kill(getpid());
+            killDescendents();
         });
     }));
 
     LSYSCALL(pipe(setEnvPipe));
     auto event = ioContext.lowLevelProvider->wrapInputFd(setEnvPipe[0], kj::LowLevelAsyncIoProvider::TAKE_OWNERSHIP);
-    auto buffer = kj::heapArrayBuilder<char>(1024);
+    auto buffer = kj::heapArrayBuilder<char>(PIPE_BUF);
     tasks.add(readEnvPipe(event, buffer.asPtr().begin()).attach(kj::mv(event), kj::mv(buffer)));
 }
 
@@ -141,7 +279,9 @@ RunState Leader::run()
     KJ_IF_MAYBE(ls, home.tryLstat(rd)) {
         LASSERT(ls->type == kj::FsNode::Type::DIRECTORY);
         LLOG(WARNING, "Working directory already exists, removing", rd.toString());
-        if(home.tryRemove(rd) == false) {
+        // laminard deletes the contents of the trash in the background
+        bool moved = Trash::moveInto(Trash::dirIn(rootPath.toString(true).cStr()), (rootPath/rd.asPtr()).toString(true).cStr());
+        if(!moved && home.tryRemove(rd) == false) {
             LLOG(WARNING, "Failed to remove working directory");
             createWorkdir = false;
         }
@@ -151,11 +291,9 @@ RunState Leader::run()
         return RunState::FAILED;
     }
 
-    // create an archive directory
+    // laminard normally creates the archive directory already, to watch it
     kj::Path archive = kj::Path{"archive",jobName,std::to_string(runNumber)};
-    if(home.exists(archive)) {
-        LLOG(WARNING, "Archive directory already exists", archive.toString());
-    } else if(home.tryOpenSubdir(archive, kj::WriteMode::CREATE|kj::WriteMode::CREATE_PARENT) == nullptr) {
+    if(!home.exists(archive) && home.tryOpenSubdir(archive, kj::WriteMode::CREATE|kj::WriteMode::CREATE_PARENT) == nullptr) {
         LLOG(ERROR, "Could not create archive directory", archive.toString());
         return RunState::FAILED;
     }
@@ -166,7 +304,7 @@ RunState Leader::run()
         home.openSubdir(ws, kj::WriteMode::CREATE|kj::WriteMode::CREATE_PARENT);
         // prepend the workspace init script
         if(home.exists(cfgDir/"jobs"/(jobName+".init")))
-            scripts.push({cfgDir/"jobs"/(jobName+".init"), kj::mv(ws), false});
+            initScripts.push({cfgDir/"jobs"/(jobName+".init"), kj::mv(ws), false});
     }
 
     // add scripts
@@ -178,6 +316,21 @@ RunState Leader::run()
         scripts.push({cfgDir/"jobs"/(jobName+".before"), rd.clone(), false});
     // main run script. must exist.
     scripts.push({cfgDir/"jobs"/(jobName+".run"), rd.clone(), false});
+    // steps executed concurrently after the main run script
+    kj::Path stepsDir = cfgDir/"jobs"/(jobName+".d");
+    if(home.exists(stepsDir)) {
+        std::vector<kj::String> names;
+        for(kj::String& name : home.openSubdir(stepsDir)->listNames()) {
+            if(name.endsWith(".run"))
+                names.push_back(kj::mv(name));
+        }
+        std::sort(names.begin(), names.end());
+        Script group{stepsDir.clone(), rd.clone(), false};
+        for(kj::String& name : names)
+            group.steps.push_back(stepsDir/name);
+        if(!group.steps.empty())
+            scripts.push(kj::mv(group));
+    }
     // job after-run script
     if(home.exists(cfgDir/"jobs"/(jobName+".after")))
         scripts.push({cfgDir/"jobs"/(jobName+".after"), rd.clone(), true});
@@ -186,16 +339,66 @@ RunState Leader::run()
         scripts.push({cfgDir/"after", rd.clone(), true});
 
     // Start executing scripts
-    return step(scripts).then([this](){
+    return step(initScripts).then([this](){
+        if(snapshot)
+            snapshotWorkspace();
+        return step(scripts);
+    }).then([this](){
+        if(merge && result == RunState::SUCCESS)
+            mergeWorkspace();
         return result;
     }).wait(ioContext.waitScope);
 }
 
+void Leader::snapshotWorkspace()
+{
+    // A failed init script leaves nothing worth snapshotting, and the
+    // run fails anyway when the remaining scripts are skipped
+    if(result != RunState::SUCCESS)
+        return;
+    std::string ws = (rootPath/"run"/jobName/"workspace").toString(true).cStr();
+    std::string dst = (rootPath/"run"/jobName/std::to_string(runNumber)/"workspace").toString(true).cStr();
+    SnapshotMethod method;
+    if(!::snapshotWorkspace(ws, dst, method)) {
+        fprintf(stderr, "[laminar] Failed to snapshot workspace: %s\n", strerror(errno));
+        result = RunState::FAILED;
+        while(scripts.size() && (!scripts.front().runOnAbort))
+            scripts.pop();
+        return;
+    }
+    fprintf(stderr, "[laminar] Snapshotted workspace (%s)\n", method == SnapshotMethod::REFLINK ? "reflink" : "hardlink");
+    setenv("WORKSPACE", dst.c_str(), true);
+}
+
+void Leader::mergeWorkspace()
+{
+    std::string home = rootPath.toString(true).cStr();
+    std::string ws = (rootPath/"run"/jobName/"workspace").toString(true).cStr();
+    std::string src = (rootPath/"run"/jobName/std::to_string(runNumber)/"workspace").toString(true).cStr();
+    if(::mergeWorkspace(src, ws, runNumber, Trash::dirIn(home)))
+        fprintf(stderr, "[laminar] Merged workspace\n");
+    else
+        fprintf(stderr, "[laminar] Workspace not merged, a later run may have merged already\n");
+}
+
 void Leader::taskFailed(kj::Exception &&exception)
 {
     LLOG(ERROR, exception);
 }
 
+void Leader::killDescendents()
+{
+    // Killing a cgroup is atomic with respect to forks, and costs nothing
+    // no matter how many other processes there are on the host
+    if(!scriptsCgroup.empty() && Cgroups::kill(scriptsCgroup)) {
+        fprintf(stderr, "[laminar] killing all processes in cgroup\n");
+        return;
+    }
+    if(pidfd_kill_descendents(getpid()))
+        return;
+    aggressive_recursive_kill(getpid());
+}
+
 kj::Promise<void> Leader::step(std::queue<Script> &scripts)
 {
     if(scripts.empty())
@@ -204,6 +407,26 @@ kj::Promise<void> Leader::step(std::queue<Script> &scripts)
     Script currentScript = kj::mv(scripts.front());
     scripts.pop();
 
+    if(!currentScript.steps.empty()) {
+        return runSteps(currentScript).then([&](){
+            return step(scripts);
+        });
+    }
+
+    currentScriptName = currentScript.path.slice(1, currentScript.path.size()).toString().cStr();
+    reportStep("started", currentScriptName);
+    pid_t pid = startScript(currentScript.path, currentScript.cwd);
+
+    currentScriptPid = pid;
+    currentGroupId = pid;
+
+    return waitForScript(pid).then([&](){
+        return step(scripts);
+    });
+}
+
+pid_t Leader::startScript(const kj::Path& path, const kj::Path& cwd, int outputFd, const std::string& stepName)
+{
     pid_t pid = fork();
     if(pid == 0) { // child
         // unblock all signals
@@ -214,9 +437,19 @@ kj::Promise<void> Leader::step(std::queue<Script> &scripts)
         // create a new process group to help us deal with any wayward forks
         setpgid(0, 0);
 
-        std::string buildNum = std::to_string(runNumber);
+        // scripts are kept apart from the leader, so that killing all the
+        // processes in the cgroup doesn't kill the leader too
+        if(!scriptsCgroup.empty())
+            Cgroups::join(scriptsCgroup);
+
+        // the output of a step is prefixed by the leader, see runSteps
+        if(outputFd >= 0) {
+            dup2(outputFd, STDOUT_FILENO);
+            dup2(outputFd, STDERR_FILENO);
+            setenv("STEP", stepName.c_str(), true);
+        }
 
-        LSYSCALL(chdir(currentScript.cwd.toString(false).cStr()));
+        LSYSCALL(chdir(cwd.toString(false).cStr()));
 
         setenv("RESULT", to_string(result).c_str(), true);
 
@@ -225,78 +458,294 @@ kj::Promise<void> Leader::step(std::queue<Script> &scripts)
         sprintf(pipeNum, "%d", setEnvPipe[1]);
         setenv("__LAMINAR_SETENV_PIPE", pipeNum, 1);
 
-        fprintf(stderr, "[laminar] Executing %s\n", currentScript.path.toString().cStr());
-        kj::String execPath = (rootPath/currentScript.path).toString(true);
+        fprintf(stderr, "[laminar] Executing %s\n", path.toString().cStr());
+        kj::String execPath = (rootPath/path).toString(true);
 
         execl(execPath.cStr(), execPath.cStr(), NULL);
-        fprintf(stderr, "[laminar] Failed to execute %s\n", currentScript.path.toString().cStr());
+        fprintf(stderr, "[laminar] Failed to execute %s\n", path.toString().cStr());
         _exit(1);
     }
+    return pid;
+}
 
-    currentScriptPid = pid;
-    currentGroupId = pid;
+void Leader::signalScripts(int sig)
+{
+    if(currentGroupId)
+        kill(-currentGroupId, sig);
+    for(auto& it : runningSteps)
+        kill(-it.first, sig);
+}
 
-    return reapChildProcesses().then([&](){
-        return step(scripts);
+// Executes the steps of a group concurrently, at most parallelSteps at once.
+// The output of each step is read through its own pipe and written to the
+// log line by line, prefixed with the step's name. Once a step fails, the
+// others are terminated and the remaining ones are not started
+kj::Promise<void> Leader::runSteps(Script& group)
+{
+    // a failure before the steps would fail the run anyway
+    if(result != RunState::SUCCESS)
+        return kj::READY_NOW;
+
+    fprintf(stderr, "[laminar] Executing %zu steps in %s, at most %d at once\n",
+            group.steps.size(), group.path.toString().cStr(), parallelSteps);
+    for(kj::Path& path : group.steps)
+        pendingSteps.push(kj::mv(path));
+    stepsCwd = group.cwd.clone();
+    currentGroupId = 0;
+    startSteps();
+    return reapSteps();
+}
+
+void Leader::startSteps()
+{
+    while(!pendingSteps.empty() && int(runningSteps.size()) < parallelSteps) {
+        kj::Path path = kj::mv(pendingSteps.front());
+        pendingSteps.pop();
+        kj::StringPtr filename = path.basename()[0];
+        std::string name(filename.begin(), filename.size() - 4); // without .run
+
+        int fds[2];
+        LSYSCALL(pipe2(fds, O_CLOEXEC));
+        std::string script = path.slice(1, path.size()).toString().cStr();
+        reportStep("started", script);
+        pid_t pid = startScript(path, stepsCwd, fds[1], name);
+        close(fds[1]);
+        runningSteps[pid] = RunningStep{name, script};
+
+        auto in = ioContext.lowLevelProvider->wrapInputFd(fds[0], kj::LowLevelAsyncIoProvider::TAKE_OWNERSHIP);
+        auto buffer = kj::heapArray<char>(4096);
+        auto prefix = kj::heap<std::string>("[" + name + "] ");
+        auto partial = kj::heap<std::string>();
+        stepOutputs.add(forwardStepOutput(*in, buffer, *prefix, *partial)
+                        .attach(kj::mv(in), kj::mv(buffer), kj::mv(prefix), kj::mv(partial)));
+    }
+}
+
+kj::Promise<void> Leader::reapSteps()
+{
+    while(!runningSteps.empty()) {
+        int status;
+        pid_t pid = waitpid(-1, &status, WNOHANG);
+        if(pid <= 0) {
+            return ioContext.unixEventPort.onSignal(SIGCHLD).then([this](siginfo_t) {
+                return reapSteps();
+            });
+        }
+        auto it = runningSteps.find(pid);
+        if(it == runningSteps.end())
+            continue; // some reparented process was reaped
+        bool failed = result != RunState::SUCCESS;
+        scriptExited(status, it->second.script);
+        if(!failed && result != RunState::SUCCESS) {
+            fprintf(stderr, "[laminar] Step %s failed, stopping the remaining steps\n", it->second.name.c_str());
+            while(!pendingSteps.empty())
+                pendingSteps.pop();
+            for(auto& other : runningSteps) {
+                if(other.first != pid)
+                    kill(-other.first, SIGTERM);
+            }
+        }
+        runningSteps.erase(it);
+        startSteps();
+    }
+    // Descendents which outlived their steps are dealt with like those of
+    // any script. Once they have exited, all output has been read
+    return reapChildProcesses().then([this]() {
+        return kj::joinPromises(stepOutputs.releaseAsArray());
     });
 }
 
-kj::Promise<void> Leader::reapChildProcesses()
+kj::Promise<void> Leader::forwardStepOutput(kj::AsyncInputStream& in, kj::ArrayPtr<char> buffer, const std::string& prefix, std::string& partial)
 {
-    return ioContext.unixEventPort.onSignal(SIGCHLD).then([this](siginfo_t) -> kj::Promise<void> {
-        while(true) {
-            int status;
-            errno = 0;
-            pid_t pid = waitpid(-1, &status, WNOHANG);
-            if(pid == -1 && errno == ECHILD) {
-                // all children exited
-                return kj::READY_NOW;
-            } else if(pid == 0) {
-                // child processes are still running
-                if(currentScriptPid) {
-                    // We could get here if a more deeply nested process was reparented to us
-                    // before the primary script executed. Quietly wait until the process we're
-                    // waiting for is done
-                    return reapChildProcesses();
-                }
-                // we were aborted by the primary process already, just wait until all
-                // SIGKILLs are processed
-                if(aborting) {
-                    return reapChildProcesses();
-                }
-                // Otherwise, reparented orphans are on borrowed time
-                // TODO list wayward processes?
-                fprintf(stderr, "[laminar] sending SIGHUP to adopted child processes\n");
-                kill(-currentGroupId, SIGHUP);
-                return ioContext.provider->getTimer().afterDelay(5*kj::SECONDS).then([this]{
-                    // TODO: should we mark the job as failed if we had to kill reparented processes?
-                    aggressive_recursive_kill(getpid());
-                    return reapChildProcesses();
-                }).exclusiveJoin(reapChildProcesses());
-            } else if(pid == currentScriptPid) {
-                // the script we were waiting for is done
-                // if we already marked as failed, preserve that
-                if(result == RunState::SUCCESS) {
-                    if(WIFSIGNALED(status) && (WTERMSIG(status) == SIGTERM || WTERMSIG(status) == SIGKILL))
-                        result = RunState::ABORTED;
-                    else if(WEXITSTATUS(status) != 0)
-                        result = RunState::FAILED;
-                }
-                currentScriptPid = 0;
-            } else {
-                // some reparented process was reaped
+    return in.tryRead(buffer.begin(), 1, buffer.size()).then([this,&in,buffer,&prefix,&partial](size_t n) {
+        if(n == 0) {
+            if(!partial.empty()) {
+                std::string line = prefix + partial + "\n";
+                fwrite(line.data(), 1, line.size(), stdout);
+                fflush(stdout);
             }
+            return kj::Promise<void>(kj::READY_NOW);
+        }
+        partial.append(buffer.begin(), n);
+        std::string out;
+        size_t start = 0;
+        for(size_t nl; (nl = partial.find('\n', start)) != std::string::npos; start = nl + 1) {
+            out.append(prefix);
+            out.append(partial, start, nl - start + 1);
+        }
+        partial.erase(0, start);
+        // a very long line without a newline is broken up
+        if(partial.size() >= buffer.size()) {
+            out.append(prefix);
+            out.append(partial);
+            out.append("\n");
+            partial.clear();
+        }
+        fwrite(out.data(), 1, out.size(), stdout);
+        fflush(stdout);
+        return forwardStepOutput(in, buffer, prefix, partial);
+    });
+}
+
+kj::Promise<void> Leader::waitForScript(pid_t pid)
+{
+    // A pidfd becomes readable exactly when the script exits, without
+    // waking up for the exits of any other (adopted) descendents
+    int pidfd = pidfdOpen(pid);
+    if(pidfd < 0)
+        return reapChildProcesses();
+
+    struct ScriptWatch {
+        ScriptWatch(kj::UnixEventPort& port, int fd) :
+            fd(fd),
+            observer(port, fd, kj::UnixEventPort::FdObserver::OBSERVE_READ)
+        {}
+        // the observer must be destroyed before the fd is closed
+        kj::AutoCloseFd fd;
+        kj::UnixEventPort::FdObserver observer;
+    };
+    auto watch = kj::heap<ScriptWatch>(ioContext.unixEventPort, pidfd);
+    kj::Promise<void> exited = watch->observer.whenBecomesReadable().exclusiveJoin(reapOrphans(pid));
+    return exited.then([this,pid,pidfd]() -> kj::Promise<void> {
+        int status;
+        if(!pidfdWait(pidfd, pid, status))
+            return reapChildProcesses();
+        scriptExited(status, currentScriptName);
+        currentScriptPid = 0;
+        // now wait for any descendents which were adopted by the leader
+        return reapChildProcesses();
+    }).attach(kj::mv(watch));
+}
+
+// Reaps the orphans adopted while a script runs, so that they don't pile
+// up as zombies. Never resolves, waitForScript cancels it when the script
+// exits
+kj::Promise<void> Leader::reapOrphans(pid_t script)
+{
+    return ioContext.unixEventPort.onSignal(SIGCHLD).then([this,script](siginfo_t) {
+        while(true) {
+            // WNOWAIT leaves the script's status for pidfdWait
+            siginfo_t info;
+            memset(&info, 0, sizeof(info));
+            if(waitid(P_ALL, 0, &info, WEXITED | WNOHANG | WNOWAIT) != 0 || info.si_pid == 0 || info.si_pid == script)
+                break;
+            waitpid(info.si_pid, nullptr, 0);
+        }
+        return reapOrphans(script);
+    });
+}
+
+void Leader::scriptExited(int status, const std::string& script)
+{
+    RunState state = RunState::SUCCESS;
+    if(WIFSIGNALED(status) && (WTERMSIG(status) == SIGTERM || WTERMSIG(status) == SIGKILL))
+        state = RunState::ABORTED;
+    else if(WEXITSTATUS(status) != 0)
+        state = RunState::FAILED;
+    reportStep("completed", script, to_string(state).c_str());
+    // if we already marked as failed, preserve that
+    if(result == RunState::SUCCESS)
+        result = state;
+}
+
+void Leader::reportStep(const char* event, const std::string& script, const char* result)
+{
+    if(stepsFd < 0)
+        return;
+    char line[PIPE_BUF];
+    int n = result
+        ? snprintf(line, sizeof(line), "%s %lld %s %s\n", event, (long long) time(nullptr), result, script.c_str())
+        : snprintf(line, sizeof(line), "%s %lld %s\n", event, (long long) time(nullptr), script.c_str());
+    // a line fits in PIPE_BUF, so it is written whole. If laminard does not
+    // read the records (as on an agent), the write just fails
+    if(n > 0 && n < int(sizeof(line)) && write(stepsFd, line, n) < 0)
+        stepsFd = -1;
+}
+
+void Leader::reportParam(const std::string& name, const std::string& value)
+{
+    if(stepsFd < 0)
+        return;
+    // unlike a step record, this may be longer than PIPE_BUF, but the
+    // leader is the only writer
+    std::string line = "param " + name + " " + escapeParamValue(value) + "\n";
+    for(size_t done = 0; done < line.size();) {
+        ssize_t n = write(stepsFd, line.data() + done, line.size() - done);
+        if(n < 0) {
+            stepsFd = -1;
+            return;
         }
+        done += n;
+    }
+}
+
+kj::Promise<void> Leader::waitChildSignal()
+{
+    return ioContext.unixEventPort.onSignal(SIGCHLD).then([this](siginfo_t) {
+        return reapChildProcesses();
     });
 }
 
+kj::Promise<void> Leader::reapChildProcesses()
+{
+    while(true) {
+        int status;
+        errno = 0;
+        pid_t pid = waitpid(-1, &status, WNOHANG);
+        if(pid == -1 && errno == ECHILD) {
+            // all children exited
+            return kj::READY_NOW;
+        } else if(pid == 0) {
+            // child processes are still running
+            if(currentScriptPid) {
+                // Only without pidfd support: the script is still running, or a more
+                // deeply nested process was reparented to us before the primary script
+                // exited. Quietly wait until the process we're waiting for is done
+                return waitChildSignal();
+            }
+            // we were aborted by the primary process already, just wait until all
+            // SIGKILLs are processed
+            if(aborting) {
+                return waitChildSignal();
+            }
+            // Otherwise, reparented orphans are on borrowed time
+            // TODO list wayward processes?
+            fprintf(stderr, "[laminar] sending SIGHUP to adopted child processes\n");
+            signalScripts(SIGHUP);
+            return ioContext.provider->getTimer().afterDelay(5*kj::SECONDS).then([this]{
+                // TODO: should we mark the job as failed if we had to kill reparented processes?
+                killDescendents();
+                return waitChildSignal();
+            }).exclusiveJoin(waitChildSignal());
+        } else if(pid == currentScriptPid) {
+            // the script we were waiting for is done
+            scriptExited(status, currentScriptName);
+            currentScriptPid = 0;
+        } else {
+            // some reparented process was reaped
+        }
+    }
+}
+
 kj::Promise<void> Leader::readEnvPipe(kj::AsyncInputStream *stream, char *buffer) {
-    return stream->tryRead(buffer, 1, 1024).then([this,stream,buffer](size_t sz) {
+    return stream->tryRead(buffer, 1, PIPE_BUF).then([this,stream,buffer](size_t sz) {
         if(sz > 0) {
-            buffer[sz] = '\0';
-            if(char* eq = strchr(buffer, '=')) {
-                *eq++ = '\0';
-                setenv(buffer, eq, 1);
+            setEnvFrames.append(buffer, sz);
+            ParamList params;
+            bool valid = decodeParamFrames(setEnvFrames, params);
+            for(const auto& param : params) {
+                if(param.first.empty() || param.first.find_first_of("= \n") != std::string::npos)
+                    continue;
+                setenv(param.first.c_str(), param.second.c_str(), 1);
+                reportParam(param.first, param.second);
+            }
+            if(!valid) {
+                // Nothing after a malformed frame can be trusted. Returning
+                // closes the read end, so that later `laminarc set` calls
+                // fail with EPIPE instead of their variables being lost
+                LLOG(ERROR, "Malformed laminarc set frame, no longer reading parameters");
+                setEnvFrames.clear();
+                return kj::Promise<void>(kj::READY_NOW);
             }
             return readEnvPipe(stream, kj::mv(buffer));
         }
@@ -305,14 +754,40 @@ kj::Promise<void> Leader::readEnvPipe(kj::AsyncInputStream *stream, char *buffer
 }
 
 int leader_main(void) {
+#ifndef HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCHDIR_NP
+    // the spawner can't change the directory of the process it spawns with
+    // this C library. leaderRequest sets PWD to $LAMINAR_HOME
+    if(const char* pwd = getenv("PWD"); pwd && chdir(pwd) != 0) {
+        fprintf(stderr, "[laminar] Failed to change directory to %s: %s\n", pwd, strerror(errno));
+        return EXIT_FAILURE;
+    }
+#endif
     auto ioContext = kj::setupAsyncIo();
     auto fs = kj::newDiskFilesystem();
 
     kj::UnixEventPort::captureSignal(SIGTERM);
-    // Don't use captureChildExit or onChildExit because they don't provide a way to
-    // reap orphaned child processes. Stick with the more fundamental onSignal.
+    // writing step records to a closed pipe must not kill the leader. Scripts
+    // unblock all signals, see startScript
+    sigset_t sigpipe;
+    sigemptyset(&sigpipe);
+    sigaddset(&sigpipe, SIGPIPE);
+    sigprocmask(SIG_BLOCK, &sigpipe, nullptr);
+    // Scripts are waited for through pidfds where possible, but orphaned descendents
+    // which are adopted by the leader can only be reaped on SIGCHLD. Don't use
+    // captureChildExit or onChildExit because they don't provide a way to do that.
     kj::UnixEventPort::captureSignal(SIGCHLD);
 
+    // Join the cgroup laminard created for this run, so that the resources
+    // used by all descendent processes are accounted (and limited) together
+    std::string scriptsCgroup;
+    if(const char* cgroup = getenv("__LAMINAR_CGROUP")) {
+        if(!Cgroups::join(cgroup))
+            fprintf(stderr, "[laminar] Failed to join cgroup %s: %s\n", cgroup, strerror(errno));
+        else
+            scriptsCgroup = Cgroups::createScripts(cgroup);
+        unsetenv("__LAMINAR_CGROUP");
+    }
+
     // Becoming a subreaper means any descendent process whose parent process disappears
     // will be reparented to this one instead of init (or higher layer subreaper).
     // We do this so that the run will wait until all descedents exit before executing
@@ -331,8 +806,29 @@ int leader_main(void) {
     if(!jobName || !runNumber)
         return EXIT_FAILURE;
 
-    Leader leader(ioContext, *fs, jobName, runNumber);
+    // see Run::start
+    std::string workspaceMode;
+    if(const char* mode = getenv("__LAMINAR_WORKSPACE_MODE")) {
+        workspaceMode = mode;
+        unsetenv("__LAMINAR_WORKSPACE_MODE");
+    }
+
+    // see Run::start. By default, as many steps as there are CPUs run at once
+    int parallelSteps = sysconf(_SC_NPROCESSORS_ONLN);
+    if(const char* steps = getenv("__LAMINAR_PARALLEL_STEPS")) {
+        parallelSteps = atoi(steps);
+        unsetenv("__LAMINAR_PARALLEL_STEPS");
+    }
+    if(parallelSteps < 1)
+        parallelSteps = 1;
+
+    Leader leader(ioContext, *fs, jobName, runNumber, scriptsCgroup, workspaceMode, parallelSteps);
+    RunState result = leader.run();
+
+    // all scripts have exited, so this should succeed
+    if(!scriptsCgroup.empty())
+        rmdir(scriptsCgroup.c_str());
 
     // Parent process will cast back to RunState
-    return int(leader.run());
+    return int(result);
 }
@@ -27,9 +27,9 @@
 // any wayward child processes.
 
 // This could have been implemented as a separate process, but
-// instead we just fork & exec /proc/self/exe from the main laminar
-// daemon, and distinguish based on argv[0]. This saves installing
-// another binary and avoids some associated pitfalls.
+// instead the spawner helper (see spawner.h) forks & execs
+// /proc/self/exe, and we distinguish based on argv[0]. This saves
+// installing another binary and avoids some associated pitfalls.
 
 int leader_main(void);
 
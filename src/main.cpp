@@ -16,9 +16,11 @@
 /// You should have received a copy of the GNU General Public License
 /// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
 ///
+#include "agent.h"
 #include "laminar.h"
 #include "leader.h"
 #include "server.h"
+#include "spawner.h"
 #include "log.h"
 
 #include <fcntl.h>
@@ -52,6 +54,7 @@ static void usage(std::ostream& out) {
     out << "Usage:\n";
     out << "  -h|--help       show this help message\n";
     out << "  -v              enable verbose output\n";
+    out << "  --agent         execute runs for the server at $LAMINAR_HOST\n";
 }
 
 static void on_sighup(int)
@@ -65,9 +68,12 @@ int main(int argc, char** argv) {
     if(argv[0][0] == '{')
         return leader_main();
 
+    bool agent = false;
     for(int i = 1; i < argc; ++i) {
         if(strcmp(argv[i], "-v") == 0) {
             kj::_::Debug::setLogLevel(kj::_::Debug::Severity::INFO);
+        } else if(strcmp(argv[i], "--agent") == 0) {
+            agent = true;
         } else if(strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
             return usage(std::cout), EXIT_SUCCESS;
         } else {
@@ -84,6 +90,13 @@ int main(int argc, char** argv) {
     close(STDIN_FILENO);
     LASSERT(open("/dev/null", O_RDONLY) == STDIN_FILENO);
 
+    // Fork the helper process which launches run leaders now, while this
+    // process is still small. See spawner.h
+    int spawnerFd = Spawner::startHelper();
+
+    if(agent)
+        return agent_main(spawnerFd);
+
     auto ioContext = kj::setupAsyncIo();
 
     Settings settings;
@@ -94,11 +107,9 @@ int main(int argc, char** argv) {
     settings.archive_url = getenv("LAMINAR_ARCHIVE_URL") ?: ARCHIVE_URL_DEFAULT;
     settings.connection_string = getenv("LAMINAR_CONNECTION_STRING") ?: "";
 
-    server = new Server(ioContext);
+    server = new Server(ioContext, spawnerFd);
     laminar = new Laminar(*server, settings);
 
-    kj::UnixEventPort::captureChildExit();
-
     signal(SIGINT, &laminar_quit);
     signal(SIGTERM, &laminar_quit);
     signal(SIGHUP, &on_sighup);
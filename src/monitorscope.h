@@ -50,6 +50,11 @@ struct MonitorScope {
         // know whether to display the "next" arrow.
     }
 
+    // for events which only matter to the page of the run itself
+    bool wantsRun(std::string ajob, uint anum) const {
+        return type == RUN && ajob == job && anum == num;
+    }
+
     Type type;
     std::string job;
     uint num ;
@@ -0,0 +1,37 @@
+///
+/// Copyright 2022 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#ifndef LAMINAR_PATTERN_H_
+#define LAMINAR_PATTERN_H_
+
+#include <fnmatch.h>
+#include <string>
+
+// FNM_EXTMATCH isn't supported under musl
+#if !defined(FNM_EXTMATCH)
+#define FNM_EXTMATCH 0
+#endif
+
+// Matches a job or context name against a glob pattern as given in
+// JOBS, CONTEXTS or laminarc subscribe, with extended patterns where the
+// C library supports them
+inline bool matchesPattern(const std::string& pattern, const std::string& name) {
+    return fnmatch(pattern.c_str(), name.c_str(), FNM_EXTMATCH) == 0;
+}
+
+#endif // LAMINAR_PATTERN_H_
@@ -0,0 +1,71 @@
+///
+/// Copyright 2022 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#ifndef LAMINAR_PIDFD_H_
+#define LAMINAR_PIDFD_H_
+
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#ifndef P_PIDFD
+#define P_PIDFD 3
+#endif
+
+// Wrappers around the pidfd system calls, which older C libraries do not
+// provide. They fail with ENOSYS if the kernel doesn't support pidfds
+// (before Linux 5.3), in which case callers fall back to signals.
+
+inline int pidfdOpen(pid_t pid) {
+#ifdef SYS_pidfd_open
+    return syscall(SYS_pidfd_open, pid, 0);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+inline int pidfdSendSignal(int pidfd, int sig) {
+#ifdef SYS_pidfd_send_signal
+    return syscall(SYS_pidfd_send_signal, pidfd, sig, nullptr, 0);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+// Reaps the process referred to by pidfd, which must have exited (the
+// pidfd polls readable), and returns its status in the format of waitpid
+inline bool pidfdWait(int pidfd, pid_t pid, int& status) {
+    siginfo_t info;
+    memset(&info, 0, sizeof(info));
+    if(waitid(idtype_t(P_PIDFD), pidfd, &info, WEXITED) == 0) {
+        if(info.si_code == CLD_EXITED)
+            status = (info.si_status & 0xff) << 8;
+        else
+            status = (info.si_status & 0x7f) | (info.si_code == CLD_DUMPED ? 0x80 : 0);
+        return true;
+    }
+    // Linux 5.3 has pidfd_open, but waitid only accepts P_PIDFD from 5.4
+    return errno == EINVAL && waitpid(pid, &status, 0) == pid;
+}
+
+#endif // LAMINAR_PIDFD_H_
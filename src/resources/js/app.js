@@ -394,6 +394,49 @@ const Charts = (() => {
         c.update();
       };
       return c;
+    },
+    createResourcesChart: (id, samples) => {
+      // samples are [time, cpuTime (ms), memory (bytes)]. CPU usage is
+      // the CPU time used between consecutive samples, in CPUs
+      const cpu = (s, i) => i == 0 ? 0 : (s[1] - samples[i-1][1]) / 1000 / Math.max(s[0] - samples[i-1][0], 1);
+      const c = new Chart(document.getElementById(id), {
+        type: 'line',
+        data: {
+          labels: samples.map(s => s[0]),
+          datasets: [{
+            label: 'CPUs',
+            borderColor: "#7483af",
+            data: samples.map(cpu),
+            pointRadius: 0,
+            yAxisID: 'cpu',
+          },{
+            label: 'Memory (MiB)',
+            borderColor: "#afa674",
+            data: samples.map(s => s[2] / 1048576),
+            pointRadius: 0,
+            yAxisID: 'memory',
+          }]
+        },
+        options: {
+          plugins: {
+            title: { display: true, text: 'Resource usage' },
+          },
+          hover: { mode: null },
+          scales: {
+            x: { title: {display: true, text: 'Seconds'} },
+            cpu: { position: 'left', title: {display: true, text: 'CPUs'} },
+            memory: { position: 'right', title: {display: true, text: 'MiB'}, grid: {drawOnChartArea: false} },
+          },
+        }
+      });
+      c.sampleAdded = sample => {
+        samples.push(sample);
+        c.data.labels.push(sample[0]);
+        c.data.datasets[0].data.push(cpu(sample, samples.length - 1));
+        c.data.datasets[1].data.push(sample[2] / 1048576);
+        c.update('none');
+      };
+      return c;
     }
   };
 })();
@@ -664,8 +707,9 @@ const Run = templateId => {
   const utf8decoder = new TextDecoder('utf-8');
   const ansi_up = new AnsiUp;
   ansi_up.use_classes = true;
+  let chtResources = null;
   const state = {
-    job: { artifacts: [], upstream: {} },
+    job: { artifacts: [], steps: [], samples: [], params: {}, upstream: {} },
     latestNum: null,
     logComplete: false,
   };
@@ -754,6 +798,12 @@ const Run = templateId => {
         state.latestNum = data.latestNum;
         state.jobsRunning = [data];
         state.logComplete = false;
+        if(chtResources)
+          chtResources.destroy();
+        // defer chart to nextTick because it gets a DOM element which isn't rendered yet
+        this.$nextTick(() => {
+          chtResources = Charts.createResourcesChart("chartResources", data.samples);
+        });
         // DOM is used directly for performance
         document.getElementsByTagName('code')[0].innerHTML = '';
         if(this.logstream)
@@ -782,6 +832,30 @@ const Run = templateId => {
           this.$forceUpdate();
         }
       },
+      artifact_added: function(data) {
+        if(data.number === state.number) {
+          const i = state.job.artifacts.findIndex(a => a.filename === data.filename);
+          if(i < 0)
+            state.job.artifacts.push(data);
+          else
+            state.job.artifacts.splice(i, 1, data);
+          this.$forceUpdate();
+        }
+      },
+      step_changed: function(data) {
+        if(data.number === state.number) {
+          const i = state.job.steps.findIndex(s => s.name === data.step.name && s.started === data.step.started);
+          if(i < 0)
+            state.job.steps.push(data.step);
+          else
+            state.job.steps.splice(i, 1, data.step);
+          this.$forceUpdate();
+        }
+      },
+      resource_sample: function(data) {
+        if(data.number === state.number && chtResources)
+          chtResources.sampleAdded(data.sample);
+      },
       runComplete: function(run) {
         return !!run && (run.result === 'aborted' || run.result === 'failed' || run.result === 'success');
       },
@@ -20,6 +20,61 @@
 #include "laminar.capnp.h"
 #include "laminar.h"
 #include "log.h"
+#include "context.h"
+#include "agent.h"
+#include "pattern.h"
+
+// the largest piece of log output sent in one LogSink.write call
+#define LOG_CHUNK_SIZE 65536
+// the most runs returned by one listRuns call
+#define MAX_LIST_RUNS 100
+// the most events kept for a subscriber which is slow to receive them
+#define MAX_PENDING_EVENTS 1000
+
+// A client of the follow method, registered in Rpc::logFollowers
+// until it has been sent the log it asked for
+struct LogFollower {
+    LogFollower(std::set<LogFollower*>& set, std::string job, uint run) :
+        job(job),
+        run(run),
+        set(set)
+    {
+        set.insert(this);
+    }
+    ~LogFollower() {
+        set.erase(this);
+    }
+    std::string job;
+    uint run;
+    // output before this offset is not sent
+    uint64_t skip = 0;
+    std::list<std::string> pendingOutput;
+    bool complete = false;
+    kj::Own<kj::PromiseFulfiller<void>> fulfiller;
+private:
+    std::set<LogFollower*>& set;
+};
+
+// A client of the waitAll method, registered in Rpc::runWaiters until
+// all the runs it waits for have finished and been reported. This costs
+// far less per run than a waiting run call
+struct RunWaiter {
+    typedef std::pair<std::string, uint> RunId;
+    RunWaiter(std::set<RunWaiter*>& set) :
+        set(set)
+    {
+        set.insert(this);
+    }
+    ~RunWaiter() {
+        set.erase(this);
+    }
+    std::set<RunId> outstanding;
+    // runs which finished but have not been reported yet
+    std::list<std::pair<RunId, RunState>> finished;
+    kj::Own<kj::PromiseFulfiller<void>> fulfiller;
+private:
+    std::set<RunWaiter*>& set;
+};
 
 namespace {
 
@@ -34,15 +89,193 @@ LaminarCi::JobResult fromRunState(RunState state) {
     }
 }
 
+// Sends the output collected by a follower to its sink. The returned
+// promise resolves when the sink's flow control allows more to be sent
+kj::Promise<void> writePending(LogFollower* f, LaminarCi::LogSink::Client sink) {
+    std::list<std::string> chunks = kj::mv(f->pendingOutput);
+    kj::Promise<void> p = kj::READY_NOW;
+    for(std::string& s : chunks) {
+        size_t start = std::min<uint64_t>(f->skip, s.size());
+        f->skip -= start;
+        for(size_t i = start; i < s.size(); i += LOG_CHUNK_SIZE) {
+            p = p.then([sink, &s, i]() mutable {
+                auto req = sink.writeRequest();
+                req.setChunk(capnp::Data::Reader(reinterpret_cast<const kj::byte*>(s.data()) + i,
+                                                 std::min<size_t>(LOG_CHUNK_SIZE, s.size() - i)));
+                return req.send();
+            });
+        }
+    }
+    return p.attach(kj::mv(chunks));
+}
+
+kj::Promise<void> followLog(LogFollower* f, LaminarCi::LogSink::Client sink) {
+    kj::Promise<void> ready = kj::READY_NOW;
+    if(f->pendingOutput.empty() && !f->complete) {
+        auto paf = kj::newPromiseAndFulfiller<void>();
+        f->fulfiller = kj::mv(paf.fulfiller);
+        ready = kj::mv(paf.promise);
+    }
+    return ready.then([f, sink]() mutable {
+        // output arriving while this is written is sent in the next round
+        bool done = f->complete;
+        return writePending(f, sink).then([f, sink, done]() mutable {
+            return done ? kj::Promise<void>(kj::READY_NOW) : followLog(f, sink);
+        });
+    });
+}
+
+
+// Sends the results of finished runs to the listener as they arrive,
+// until all the runs the waiter waits for have been reported
+kj::Promise<void> reportFinished(RunWaiter* w, LaminarCi::RunListener::Client listener) {
+    kj::Promise<void> ready = kj::READY_NOW;
+    if(w->finished.empty()) {
+        if(w->outstanding.empty())
+            return kj::READY_NOW;
+        auto paf = kj::newPromiseAndFulfiller<void>();
+        w->fulfiller = kj::mv(paf.fulfiller);
+        ready = kj::mv(paf.promise);
+    }
+    return ready.then([w, listener]() mutable {
+        std::list<std::pair<RunWaiter::RunId, RunState>> finished = kj::mv(w->finished);
+        kj::Promise<void> p = kj::READY_NOW;
+        for(auto& f : finished) {
+            p = p.then([listener, &f]() mutable {
+                auto req = listener.finishedRequest();
+                req.getRun().setJob(f.first.first);
+                req.getRun().setBuildNum(f.first.second);
+                req.setResult(fromRunState(f.second));
+                return req.send();
+            });
+        }
+        return p.attach(kj::mv(finished)).then([w, listener]() mutable {
+            return reportFinished(w, listener);
+        });
+    });
+}
+
 }
+
+// A client of the subscribe method. Events matching its filter are queued
+// and sent to the listener one streaming call at a time, so that a slow
+// listener only holds up itself
+class EventSubscriber final : public LaminarCi::Subscription::Server {
+public:
+    struct Event {
+        LaminarCi::Event::Kind kind;
+        std::string job;
+        uint build;
+        RunState result;
+        time_t queuedAt;
+        time_t startedAt;
+        time_t completedAt;
+        std::string reason;
+        std::string context;
+        uint queueIndex;
+        uint missed;
+    };
+
+    EventSubscriber(std::set<EventSubscriber*>& set, std::vector<std::string> patterns, LaminarCi::EventListener::Client listener) :
+        patterns(kj::mv(patterns)),
+        listener(kj::mv(listener)),
+        delivery(kj::READY_NOW),
+        set(set)
+    {
+        set.insert(this);
+    }
+    ~EventSubscriber() {
+        set.erase(this);
+    }
+
+    bool wants(const std::string& job) const {
+        if(patterns.empty())
+            return true;
+        for(const std::string& p : patterns) {
+            if(matchesPattern(p, job))
+                return true;
+        }
+        return false;
+    }
+
+    void push(Event e) {
+        if(failed)
+            return;
+        if(pending.size() >= MAX_PENDING_EVENTS) {
+            missed++;
+            return;
+        }
+        e.missed = missed;
+        missed = 0;
+        pending.push_back(kj::mv(e));
+        // otherwise, the delivery in progress continues with this event
+        if(pending.size() == 1) {
+            delivery = deliver().eagerlyEvaluate([this](kj::Exception&& ex){
+                LLOG(WARNING, "Could not deliver event", ex.getDescription());
+                pending.clear();
+                failed = true;
+            });
+        }
+    }
+
+private:
+    kj::Promise<void> deliver() {
+        const Event& e = pending.front();
+        auto req = listener.eventRequest();
+        auto event = req.initEvent();
+        event.setKind(e.kind);
+        event.getRun().setJob(e.job);
+        event.getRun().setBuildNum(e.build);
+        event.setResult(fromRunState(e.result));
+        event.setQueuedAt(e.queuedAt);
+        event.setStartedAt(e.startedAt);
+        event.setCompletedAt(e.completedAt);
+        event.setReason(e.reason);
+        event.setContext(e.context);
+        event.setQueueIndex(e.queueIndex);
+        event.setMissed(e.missed);
+        return req.send().then([this]{
+            pending.pop_front();
+            return pending.empty() ? kj::Promise<void>(kj::READY_NOW) : deliver();
+        });
+    }
+
+    std::vector<std::string> patterns;
+    LaminarCi::EventListener::Client listener;
+    std::list<Event> pending;
+    uint missed = 0;
+    bool failed = false;
+    kj::Promise<void> delivery;
+    std::set<EventSubscriber*>& set;
+};
+
+// Held by a connected agent. Its contexts are withdrawn when the agent
+// releases this, which happens at the latest when it disconnects
+class AgentRegistrationImpl final : public LaminarCi::AgentRegistration::Server {
+public:
+    AgentRegistrationImpl(Laminar& laminar, std::shared_ptr<RemoteAgent> agent) :
+        laminar(laminar),
+        agent(kj::mv(agent))
+    {}
+    ~AgentRegistrationImpl() {
+        laminar.removeAgent(agent.get());
+    }
+private:
+    Laminar& laminar;
+    std::shared_ptr<RemoteAgent> agent;
+};
+
 // This is the implementation of the Laminar Cap'n Proto RPC interface.
 // As such, it implements the pure virtual interface generated from
 // laminar.capnp with calls to the primary Laminar class
 class RpcImpl : public LaminarCi::Server {
 public:
-    RpcImpl(Laminar& l) :
+    RpcImpl(Laminar& l, std::set<LogFollower*>& logFollowers, std::set<EventSubscriber*>& eventSubscribers, std::set<RunWaiter*>& runWaiters) :
         LaminarCi::Server(),
-        laminar(l)
+        laminar(l),
+        logFollowers(logFollowers),
+        eventSubscribers(eventSubscribers),
+        runWaiters(runWaiters)
     {
     }
 
@@ -63,6 +296,28 @@ public:
         return kj::READY_NOW;
     }
 
+    // Queue several jobs at once, without waiting for them to start. A
+    // build number of 0 is returned for each job which could not be queued
+    kj::Promise<void> queueBatch(QueueBatchContext context) override {
+        auto jobs = context.getParams().getJobs();
+        std::vector<std::pair<std::string, ParamMap>> requests;
+        requests.reserve(jobs.size());
+        for(auto job : jobs)
+            requests.emplace_back(job.getJobName().cStr(), params(job.getParams()));
+        LLOG(INFO, "RPC queueBatch", requests.size());
+        std::vector<std::shared_ptr<Run>> runs = laminar.queueJobs(kj::mv(requests), context.getParams().getFrontOfQueue());
+        auto buildNums = context.getResults().initBuildNums(runs.size());
+        LaminarCi::MethodResult result = LaminarCi::MethodResult::SUCCESS;
+        for(uint i = 0; i < runs.size(); ++i) {
+            if(runs[i])
+                buildNums.set(i, runs[i]->build);
+            else
+                result = LaminarCi::MethodResult::FAILED;
+        }
+        context.getResults().setResult(result);
+        return kj::READY_NOW;
+    }
+
     // Start a job, without waiting for it to finish
     kj::Promise<void> start(StartContext context) override {
         std::string jobName = context.getParams().getJobName();
@@ -143,7 +398,131 @@ public:
         return kj::READY_NOW;
     }
 
+    // Send a run's log output to a sink from the given offset. If untilComplete
+    // is set, output of an active run is sent as it is produced until the run
+    // finishes, otherwise only the output so far is sent
+    kj::Promise<void> follow(FollowContext context) override {
+        std::string jobName = context.getParams().getRun().getJob();
+        uint buildNum = context.getParams().getRun().getBuildNum();
+        LLOG(INFO, "RPC follow", jobName, buildNum);
+        std::string output;
+        bool complete;
+        if(!laminar.handleLogRequest(jobName, buildNum, output, complete)) {
+            context.getResults().setResult(LaminarCi::MethodResult::FAILED);
+            return kj::READY_NOW;
+        }
+        auto f = kj::heap<LogFollower>(logFollowers, jobName, buildNum);
+        f->skip = context.getParams().getFromOffset();
+        f->pendingOutput.push_back(kj::mv(output));
+        f->complete = complete || !context.getParams().getUntilComplete();
+        LaminarCi::LogSink::Client sink = context.getParams().getSink();
+        return followLog(f.get(), sink).then([sink]() mutable {
+            return sink.doneRequest().send().ignoreResult();
+        }).then([context]() mutable {
+            context.getResults().setResult(LaminarCi::MethodResult::SUCCESS);
+        }).attach(kj::mv(f));
+    }
+
+    // Send events of runs of the jobs matching the filter to a listener, until
+    // the returned subscription is released
+    kj::Promise<void> subscribe(SubscribeContext context) override {
+        std::vector<std::string> patterns;
+        for(auto p : context.getParams().getFilter().getJobs())
+            patterns.push_back(p.cStr());
+        LLOG(INFO, "RPC subscribe", patterns.size());
+        context.getResults().setSubscription(kj::heap<EventSubscriber>(eventSubscribers, kj::mv(patterns), context.getParams().getListener()));
+        return kj::READY_NOW;
+    }
+
+    // Get the summary of a single run
+    kj::Promise<void> getRun(GetRunContext context) override {
+        std::string jobName = context.getParams().getRun().getJob();
+        uint buildNum = context.getParams().getRun().getBuildNum();
+        RunInfo info;
+        if(laminar.getRun(jobName, buildNum, info)) {
+            context.getResults().setResult(LaminarCi::MethodResult::SUCCESS);
+            setRunInfo(context.getResults().initInfo(), info);
+        } else {
+            context.getResults().setResult(LaminarCi::MethodResult::FAILED);
+        }
+        return kj::READY_NOW;
+    }
+
+    // List the runs of a job, most recent first. The returned cursor, if not
+    // zero, is passed back to get the next page
+    kj::Promise<void> listRuns(ListRunsContext context) override {
+        std::string jobName = context.getParams().getJob();
+        uint limit = std::min<uint>(context.getParams().getLimit() ?: MAX_LIST_RUNS, MAX_LIST_RUNS);
+        kj::Maybe<RunState> state;
+        switch(context.getParams().getResultFilter()) {
+        case LaminarCi::JobResult::SUCCESS: state = RunState::SUCCESS; break;
+        case LaminarCi::JobResult::FAILED:  state = RunState::FAILED; break;
+        case LaminarCi::JobResult::ABORTED: state = RunState::ABORTED; break;
+        default: break;
+        }
+        std::vector<RunInfo> runs = laminar.listRuns(jobName, context.getParams().getCursor(), limit, state);
+        auto res = context.getResults().initRuns(runs.size());
+        for(uint i = 0; i < runs.size(); ++i)
+            setRunInfo(res[i], runs[i]);
+        if(runs.size() == limit)
+            context.getResults().setNextCursor(runs.back().number);
+        return kj::READY_NOW;
+    }
+
+    // Offer the contexts of an agent for runs, which the agent executes
+    kj::Promise<void> registerAgent(RegisterAgentContext context) override {
+        auto params = context.getParams();
+        std::string name = params.getName();
+        LLOG(INFO, "RPC registerAgent", name);
+        std::vector<std::pair<std::string, int>> contexts;
+        for(auto c : params.getContexts())
+            contexts.emplace_back(c.getName().cStr(), c.getExecutors());
+        auto agent = std::make_shared<RemoteAgent>(name, kj::mv(contexts), params.getExecutor());
+        if(!laminar.addAgent(agent))
+            return KJ_EXCEPTION(FAILED, "an agent of this name is already connected", name);
+        context.getResults().setRegistration(kj::heap<AgentRegistrationImpl>(laminar, kj::mv(agent)));
+        return kj::READY_NOW;
+    }
+
+    // Wait for several runs to finish, sending each result to the listener
+    // as soon as it is known. Runs which have already finished are reported
+    // first, and runs which are not known are reported with result UNKNOWN
+    kj::Promise<void> waitAll(WaitAllContext context) override {
+        auto runs = context.getParams().getRuns();
+        LLOG(INFO, "RPC waitAll", runs.size());
+        auto w = kj::heap<RunWaiter>(runWaiters);
+        LaminarCi::MethodResult result = LaminarCi::MethodResult::SUCCESS;
+        for(auto r : runs) {
+            RunWaiter::RunId id(r.getJob().cStr(), r.getBuildNum());
+            RunInfo info;
+            if(!laminar.getRun(id.first, id.second, info)) {
+                w->finished.emplace_back(id, RunState::UNKNOWN);
+                result = LaminarCi::MethodResult::FAILED;
+            } else if(info.completedAt) {
+                w->finished.emplace_back(id, info.state);
+            } else {
+                w->outstanding.insert(id);
+            }
+        }
+        return reportFinished(w.get(), context.getParams().getListener()).then([context, result]() mutable {
+            context.getResults().setResult(result);
+        }).attach(kj::mv(w));
+    }
+
 private:
+    static void setRunInfo(LaminarCi::RunInfo::Builder builder, const RunInfo& info) {
+        builder.getRun().setJob(info.job);
+        builder.getRun().setBuildNum(info.number);
+        builder.setResult(fromRunState(info.state));
+        builder.setQueuedAt(info.queuedAt);
+        builder.setStartedAt(info.startedAt);
+        builder.setCompletedAt(info.completedAt);
+        builder.setReason(info.reason);
+        builder.setContext(info.context);
+        builder.getUpstream().setJob(info.parentJob);
+        builder.getUpstream().setBuildNum(info.parentBuild);
+    }
+
     // Helper to convert an RPC parameter list to a hash map
     ParamMap params(const capnp::List<LaminarCi::JobParam>::Reader& paramReader) {
         ParamMap res;
@@ -154,13 +533,59 @@ private:
     }
 
     Laminar& laminar;
-    std::unordered_map<const Run*, std::list<kj::PromiseFulfillerPair<RunState>>> runWaiters;
+    std::set<LogFollower*>& logFollowers;
+    std::set<EventSubscriber*>& eventSubscribers;
+    std::set<RunWaiter*>& runWaiters;
 };
 
 Rpc::Rpc(Laminar& li) :
-    rpcInterface(kj::heap<RpcImpl>(li))
+    rpcInterface(kj::heap<RpcImpl>(li, logFollowers, eventSubscribers, runWaiters))
 {}
 
+void Rpc::notifyLog(std::string job, uint run, std::string log_chunk, bool eot) {
+    for(LogFollower* f : logFollowers) {
+        if(f->job == job && f->run == run) {
+            f->pendingOutput.push_back(log_chunk);
+            f->complete = f->complete || eot;
+            if(f->fulfiller && f->fulfiller->isWaiting())
+                f->fulfiller->fulfill();
+        }
+    }
+}
+
+void Rpc::notifyEvent(const Run& run, RunState state, uint queueIndex, time_t completedAt) {
+    EventSubscriber::Event e;
+    switch(state) {
+    case RunState::QUEUED:  e.kind = LaminarCi::Event::Kind::QUEUED; break;
+    case RunState::RUNNING: e.kind = LaminarCi::Event::Kind::STARTED; break;
+    default:
+        e.kind = LaminarCi::Event::Kind::COMPLETED;
+    }
+    e.job = run.name;
+    e.build = run.build;
+    e.result = state;
+    e.queuedAt = run.queuedAt;
+    e.startedAt = state == RunState::QUEUED ? 0 : run.startedAt;
+    e.completedAt = completedAt;
+    e.reason = run.reason();
+    if(run.context)
+        e.context = run.context->name;
+    e.queueIndex = queueIndex;
+    for(EventSubscriber* s : eventSubscribers) {
+        if(s->wants(run.name))
+            s->push(e);
+    }
+    if(state == RunState::QUEUED || state == RunState::RUNNING)
+        return;
+    for(RunWaiter* w : runWaiters) {
+        if(w->outstanding.erase(RunWaiter::RunId(run.name, run.build))) {
+            w->finished.emplace_back(RunWaiter::RunId(run.name, run.build), state);
+            if(w->fulfiller && w->fulfiller->isWaiting())
+                w->fulfiller->fulfill();
+        }
+    }
+}
+
 // Context for an RPC connection
 struct RpcConnection {
     RpcConnection(kj::Own<kj::AsyncIoStream>&& stream,
@@ -22,15 +22,35 @@
 #include <capnp/ez-rpc.h>
 #include <capnp/rpc-twoparty.h>
 #include <capnp/rpc.capnp.h>
+#include <string>
+#include <set>
+
+#include "run.h"
 
 class Laminar;
+struct LogFollower;
+struct RunWaiter;
+class EventSubscriber;
 
 class Rpc {
 public:
     Rpc(Laminar&li);
     kj::Promise<void> accept(kj::Own<kj::AsyncIoStream>&& connection);
 
+    // Passes a chunk of a run's log output to clients following it
+    void notifyLog(std::string job, uint run, std::string log_chunk, bool eot);
+
+    // Passes a change of a run's state to subscribed clients and, if the
+    // run completed, to clients waiting for it. State is one of QUEUED,
+    // RUNNING or the result of a completed run
+    void notifyEvent(const Run& run, RunState state, uint queueIndex, time_t completedAt = 0);
+
     capnp::Capability::Client rpcInterface;
+
+private:
+    std::set<LogFollower*> logFollowers;
+    std::set<EventSubscriber*> eventSubscribers;
+    std::set<RunWaiter*> runWaiters;
 };
 
 #endif //LAMINAR_RPC_H_
@@ -17,13 +17,20 @@
 /// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
 ///
 #include "run.h"
+#include "artifacts.h"
 #include "context.h"
-#include "conf.h"
+#include "configuration.h"
 #include "log.h"
+#include "spawner.h"
+#include "server.h"
+#include "agent.h"
+#include "sha256.h"
 
 #include <iostream>
+#include <fcntl.h>
 #include <unistd.h>
 #include <signal.h>
+#include <sys/wait.h>
 
 // short syntax helper for kj::Path
 template<typename T>
@@ -77,111 +84,176 @@ Run::~Run() {
     LLOG(INFO, "Run destroyed");
 }
 
-static void setEnvFromFile(const kj::Path& rootPath, kj::Path file) {
-    StringMap vars = parseConfFile((rootPath/file).toString(true).cStr());
-    for(auto& it : vars) {
-        setenv(it.first.c_str(), it.second.c_str(), true);
+Spawner::Request leaderRequest(const StringMap& vars, const ParamMap& params, const std::string& home, const std::string& job, uint build) {
+    StringMap env;
+    for(char** e = environ; *e; ++e) {
+        if(const char* eq = strchr(*e, '='))
+            env.emplace(std::string(*e, eq), eq + 1);
     }
+
+    for(auto& it : vars)
+        env[it.first] = it.second;
+
+    // parameterized vars, which do not override the environment files
+    for(auto& pair : params) {
+        env.emplace(pair.first, pair.second);
+    }
+
+    std::string PATH = home + "/cfg/scripts";
+    if(auto it = env.find("PATH"); it != env.end()) {
+        PATH.append(":");
+        PATH.append(it->second);
+    }
+
+    std::string runNumStr = std::to_string(build);
+
+    env["PATH"] = PATH;
+    env["WORKSPACE"] = home + "/run/" + job + "/workspace";
+    env["ARCHIVE"] = home + "/archive/" + job + "/" + runNumStr;
+    // RESULT set in leader process
+
+    // leader process assumes $LAMINAR_HOME as CWD
+    env["PWD"] = home;
+
+    // The leader process is launched by the spawner helper, see spawner.h.
+    // We could just fork/wait over all the steps here directly, but then we
+    // can't set a nice name for the process tree. There is pthread_setname_np,
+    // but it's limited to 16 characters, which most of the time probably isn't
+    // enough. Instead, laminard is executed with this name and handles that in
+    // main() by calling leader_main()
+    Spawner::Request request;
+    request.cwd = home;
+    request.procName = "{laminar} " + job + ":" + runNumStr;
+    request.env.reserve(env.size());
+    for(auto& it : env)
+        request.env.push_back(it.first + "=" + it.second);
+    return request;
 }
 
-kj::Promise<RunState> Run::start(RunState lastResult, std::shared_ptr<Context> ctx, const kj::Directory &fsHome, std::function<kj::Promise<int>(kj::Maybe<pid_t>&)> getPromise)
+kj::Promise<RunState> Run::start(RunState lastResult, std::shared_ptr<Context> ctx, Server& srv, std::shared_ptr<const Configuration> config)
 {
-    kj::Path cfgDir{"cfg"};
+    std::string home = rootPath.toString(true).cStr();
+    const JobConfig& job = config->job(name);
 
     // add job timeout if specified
-    if(fsHome.exists(cfgDir/"jobs"/(name+".conf"))) {
-        timeout = parseConfFile((rootPath/cfgDir/"jobs"/(name+".conf")).toString(true).cStr()).get<int>("TIMEOUT", 0);
-    }
+    timeout = job.timeout;
+
+    // Assemble the initial environment of the leader here, from the parsed
+    // environment files in the configuration snapshot, so that nothing needs
+    // to be parsed or set after forking. Dynamic vars, including "RESULT" and
+    // any set by `laminarc set`, have to be handled in the leader process.
+    // Those which depend on where the leader runs are added by leaderRequest
+    StringMap env;
 
-    int plog[2];
-    LSYSCALL(pipe(plog));
-
-    // Fork a process leader to run all the steps of the job. This gives us a nice
-    // process tree output (job name and number as the process name) and helps
-    // contain any wayward descendent processes.
-    pid_t leader;
-    LSYSCALL(leader = fork());
-
-    if(leader == 0) {
-        // All output from this process will be captured in the plog pipe
-        close(plog[0]);
-        dup2(plog[1], STDOUT_FILENO);
-        dup2(plog[1], STDERR_FILENO);
-        close(plog[1]);
-
-        // All initial/fixed env vars can be set here. Dynamic ones, including
-        // "RESULT" and any set by `laminarc set` have to be handled in the subprocess.
-
-        // add environment files
-        if(fsHome.exists(cfgDir/"env"))
-            setEnvFromFile(rootPath, cfgDir/"env");
-        if(fsHome.exists(cfgDir/"contexts"/(ctx->name+".env")))
-            setEnvFromFile(rootPath, cfgDir/"contexts"/(ctx->name+".env"));
-        if(fsHome.exists(cfgDir/"jobs"/(name+".env")))
-            setEnvFromFile(rootPath, cfgDir/"jobs"/(name+".env"));
-
-        // parameterized vars
-        for(auto& pair : params) {
-            setenv(pair.first.c_str(), pair.second.c_str(), false);
-        }
-
-        std::string PATH = (rootPath/"cfg"/"scripts").toString(true).cStr();
-        if(const char* p = getenv("PATH")) {
-            PATH.append(":");
-            PATH.append(p);
-        }
-
-        std::string runNumStr = std::to_string(build);
-
-        setenv("PATH", PATH.c_str(), true);
-        setenv("RUN", runNumStr.c_str(), true);
-        setenv("JOB", name.c_str(), true);
-        setenv("CONTEXT", ctx->name.c_str(), true);
-        setenv("LAST_RESULT", to_string(lastResult).c_str(), true);
-        setenv("WORKSPACE", (rootPath/"run"/name/"workspace").toString(true).cStr(), true);
-        setenv("ARCHIVE", (rootPath/"archive"/name/runNumStr).toString(true).cStr(), true);
-        // RESULT set in leader process
-
-        // leader process assumes $LAMINAR_HOME as CWD
-        LSYSCALL(chdir(rootPath.toString(true).cStr()));
-        setenv("PWD", rootPath.toString(true).cStr(), 1);
-
-        // We could just fork/wait over all the steps here directly, but then we
-        // can't set a nice name for the process tree. There is pthread_setname_np,
-        // but it's limited to 16 characters, which most of the time probably isn't
-        // enough. Instead, we'll just exec ourselves and handle that in laminard's
-        // main() by calling leader_main()
-        char* procName;
-        if(asprintf(&procName, "{laminar} %s:%d", name.data(), build) > 0)
-            execl("/proc/self/exe", procName, NULL); // does not return
-        _exit(EXIT_FAILURE);
+    // add environment files
+    const StringMap* contextEnv = nullptr;
+    if(auto it = config->contexts.find(ctx->name); it != config->contexts.end())
+        contextEnv = &it->second->env;
+    for(const StringMap* vars : { &config->env, contextEnv, &job.env }) {
+        if(!vars)
+            continue;
+        for(auto& it : *vars)
+            env[it.first] = it.second;
     }
 
+    env["RUN"] = std::to_string(build);
+    env["JOB"] = name;
+    env["CONTEXT"] = ctx->name;
+    env["LAST_RESULT"] = to_string(lastResult);
+
+    // the leader moves itself into its cgroup before starting any scripts
+    if(!cgroup.empty())
+        env["__LAMINAR_CGROUP"] = cgroup;
+
+    // the leader replaces WORKSPACE with its snapshot after the init script
+    if(job.snapshotWorkspace)
+        env["__LAMINAR_WORKSPACE_MODE"] = job.mergeWorkspace ? "snapshot,merge" : "snapshot";
+
+    // the leader executes the steps in cfg/jobs/$JOB.d this many at once
+    if(job.parallelSteps > 0)
+        env["__LAMINAR_PARALLEL_STEPS"] = std::to_string(job.parallelSteps);
+
     // All good, we've "started"
     startedAt = time(nullptr);
     context = ctx;
 
-    output_fd = plog[0];
-    close(plog[1]);
-    pid = leader;
+    kj::Promise<Spawner::Child> leader = nullptr;
+    if(reusedBuild)
+        leader = reuse(srv);
+    else if(ctx->agent)
+        leader = ctx->agent->execute(srv, *this, env, (rootPath/"archive"/name/std::to_string(build)).toString(true).cStr());
+    else
+        leader = srv.getSpawner().spawn(leaderRequest(env, params, home, name, build));
 
-    // notifies the rpc client if the start command was used
-    started.fulfiller->fulfill();
+    return leader.then([this](Spawner::Child leader){
+        output_fd = leader.output_fd;
+        steps_fd = leader.steps_fd;
+        pid = leader.pid;
 
-    return getPromise(pid).then([this](int status){
+        // notifies the rpc client if the start command was used
+        started.fulfiller->fulfill();
+
+        return kj::mv(leader.exited);
+    }, [this](kj::Exception&& e) -> kj::Promise<int> {
+        started.fulfiller->reject(kj::cp(e));
+        return kj::mv(e);
+    }).then([this](int status){
+        // The leader process has been reaped
+        pid = nullptr;
         // The leader process passes a RunState through the return value.
         // Check it didn't die abnormally, then cast to get it back.
         result = WIFEXITED(status) ? RunState(WEXITSTATUS(status)) : RunState::ABORTED;
         finished.fulfiller->fulfill(RunState(result));
         return result;
-    });
+    }).eagerlyEvaluate(nullptr);
 }
 
 std::string Run::reason() const {
     return reasonMsg;
 }
 
+void Run::setCacheKey(const std::set<std::string>& cacheParams) {
+    // the job's name is included, so keys of different jobs never match
+    Sha256 sha;
+    sha.update(name.data(), name.size() + 1);
+    for(const std::string& p : cacheParams) {
+        auto it = params.find(p);
+        std::string kv = p + "=" + (it == params.end() ? "" : it->second);
+        sha.update(kv.data(), kv.size() + 1);
+    }
+    cacheKey = sha.hexDigest();
+}
+
+// Behaves like a leader which exits successfully at once, after the archive
+// of the reused run has been linked into this run's
+kj::Promise<Spawner::Child> Run::reuse(Server& srv) {
+    int fds[2];
+    LSYSCALL(pipe2(fds, O_CLOEXEC));
+    std::string msg = "[laminar] Reusing the result of run #" + std::to_string(reusedBuild) + ", which had the same CACHE_KEY\n";
+    LSYSCALL(write(fds[1], msg.data(), msg.size()));
+    close(fds[1]);
+
+    std::string from = (rootPath/"archive"/name/std::to_string(reusedBuild)).toString(true).cStr();
+    std::string to = (rootPath/"archive"/name/std::to_string(build)).toString(true).cStr();
+    auto linked = std::make_shared<bool>(false);
+    Spawner::Child child;
+    child.pid = 0;
+    child.output_fd = fds[0];
+    child.steps_fd = -1;
+    child.exited = srv.offload([from, to, files=&reusedArtifacts, linked]{
+        *linked = linkArtifacts(from, to, *files);
+    }).then([linked]{
+        return W_EXITCODE(int(*linked ? RunState::SUCCESS : RunState::FAILED), 0);
+    });
+    return kj::mv(child);
+}
+
 bool Run::abort() {
+    // a reused result has no leader
+    if(reusedBuild)
+        return false;
+    if(context && context->agent)
+        return pid != nullptr && context->agent->abort(*this);
     // if the Maybe is empty, wait() was already called on this process
     KJ_IF_MAYBE(p, pid) {
         kill(-*p, SIGTERM);
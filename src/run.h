@@ -22,12 +22,19 @@
 #include <string>
 #include <queue>
 #include <list>
+#include <map>
+#include <set>
 #include <functional>
 #include <ostream>
 #include <unordered_map>
 #include <memory>
+#include <vector>
 #include <kj/async.h>
 #include <kj/filesystem.h>
+#include "artifacts.h"
+#include "spawner.h"
+#include "conf.h"
+#include "samples.h"
 
 // Definition needed for musl
 typedef unsigned int uint;
@@ -44,9 +51,28 @@ enum class RunState {
 std::string to_string(const RunState& rs);
 
 class Context;
+class Server;
+class Configuration;
+class TreeWatcher;
 
 typedef std::unordered_map<std::string, std::string> ParamMap;
 
+// A script executed by a run's leader, see LEADER_STEPS_FD. The result is
+// RUNNING until the script has completed
+struct RunStep {
+    // path of the script relative to cfg
+    std::string name;
+    time_t startedAt;
+    time_t completedAt;
+    RunState result;
+};
+
+// Describes the launch of a run's leader in the given $LAMINAR_HOME. The
+// environment is that of the calling process, overlaid with vars, then
+// params where not already set, then the variables derived from home.
+// Used by laminard and by agents, see agent.h
+Spawner::Request leaderRequest(const StringMap& vars, const ParamMap& params, const std::string& home, const std::string& job, uint build);
+
 // Represents an execution of a job.
 class Run {
 public:
@@ -57,7 +83,7 @@ public:
     Run(const Run&) = delete;
     Run& operator=(const Run&) = delete;
 
-    kj::Promise<RunState> start(RunState lastResult, std::shared_ptr<Context> ctx, const kj::Directory &fsHome, std::function<kj::Promise<int>(kj::Maybe<pid_t>&)> getPromise);
+    kj::Promise<RunState> start(RunState lastResult, std::shared_ptr<Context> ctx, Server& srv, std::shared_ptr<const Configuration> config);
 
     // aborts this run
     bool abort();
@@ -74,14 +100,40 @@ public:
     int parentBuild = 0;
     uint build = 0;
     std::string log;
+    // the leader process while it runs. 0 if the run executes on an agent
     kj::Maybe<pid_t> pid;
     int output_fd;
+    // see Spawner::Child
+    int steps_fd = -1;
+    // see JobConfig::cacheParams. If reusedBuild is set, the run completes
+    // at once with the result and archive of that earlier run
+    std::string cacheKey;
+    uint reusedBuild = 0;
+    // the artifact records of the reused run, read when the run starts.
+    // They are linked and then recorded as this run's
+    std::vector<StoredArtifact> reusedArtifacts;
+    // the scripts started so far, in order of starting
+    std::vector<RunStep> steps;
     std::unordered_map<std::string, std::string> params;
     int timeout = 0;
+    // path of the cgroup the leader should join, if any
+    std::string cgroup;
+    // the resource usage of the cgroup, sampled while the run is active
+    SampleSeries samples;
+    // the files in the archive and their sizes, maintained while the run is
+    // active. Incomplete if archiveWatch is null or events were lost
+    std::map<std::string, uint64_t> artifacts;
+    bool artifactsComplete = false;
+    kj::Own<TreeWatcher> archiveWatch;
 
     time_t queuedAt;
     time_t startedAt;
+    // Computes the cacheKey from the values of the given parameters
+    void setCacheKey(const std::set<std::string>& cacheParams);
+
 private:
+    kj::Promise<Spawner::Child> reuse(Server& srv);
+
     // adds a script to the queue of scripts to be executed by this run
     void addScript(kj::Path scriptPath, kj::Path scriptWorkingDir, bool runOnAbort = false);
 
@@ -0,0 +1,67 @@
+///
+/// Copyright 2022 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#include "samples.h"
+
+namespace {
+
+void putVarint(std::string& out, int64_t delta) {
+    // zigzag, so that small negative differences are short too
+    uint64_t v = (uint64_t(delta) << 1) ^ uint64_t(delta >> 63);
+    while(v >= 0x80) {
+        out += char(v | 0x80);
+        v >>= 7;
+    }
+    out += char(v);
+}
+
+bool getVarint(const std::string& in, size_t& pos, int64_t& delta) {
+    uint64_t v = 0;
+    for(int shift = 0; pos < in.size() && shift < 64; shift += 7) {
+        uint8_t b = in[pos++];
+        v |= uint64_t(b & 0x7f) << shift;
+        if(!(b & 0x80)) {
+            delta = int64_t(v >> 1) ^ -int64_t(v & 1);
+            return true;
+        }
+    }
+    return false;
+}
+
+}
+
+void SampleSeries::append(const ResourceSample& sample) {
+    putVarint(encoded, int64_t(sample.time - last.time));
+    putVarint(encoded, int64_t(sample.cpuTime - last.cpuTime));
+    putVarint(encoded, int64_t(sample.memory / 1024 - last.memory / 1024));
+    last = sample;
+}
+
+std::vector<ResourceSample> SampleSeries::decode(const std::string& data) {
+    std::vector<ResourceSample> samples;
+    ResourceSample s;
+    size_t pos = 0;
+    int64_t dt, dcpu, dmem;
+    while(getVarint(data, pos, dt) && getVarint(data, pos, dcpu) && getVarint(data, pos, dmem)) {
+        s.time += dt;
+        s.cpuTime += dcpu;
+        s.memory += dmem * 1024;
+        samples.push_back(s);
+    }
+    return samples;
+}
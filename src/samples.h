@@ -0,0 +1,54 @@
+///
+/// Copyright 2022 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#ifndef LAMINAR_SAMPLES_H_
+#define LAMINAR_SAMPLES_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// The resources used by the processes of a run at one point in time
+struct ResourceSample {
+    // seconds since the run started
+    uint64_t time = 0;
+    // user and system CPU time used so far in milliseconds
+    uint64_t cpuTime = 0;
+    // current memory usage in bytes
+    uint64_t memory = 0;
+};
+
+// The samples taken over the lifetime of a run, encoded compactly enough
+// to be kept in memory for every active run and stored with the build.
+// Each sample is the difference from the previous one as three zigzag
+// LEB128 varints, with memory in KiB, so at regular intervals a sample
+// takes about five bytes.
+class SampleSeries {
+public:
+    void append(const ResourceSample& sample);
+    bool empty() const { return encoded.empty(); }
+    const std::string& data() const { return encoded; }
+
+    static std::vector<ResourceSample> decode(const std::string& data);
+
+private:
+    std::string encoded;
+    ResourceSample last;
+};
+
+#endif // LAMINAR_SAMPLES_H_
@@ -21,26 +21,291 @@
 #include "rpc.h"
 #include "http.h"
 #include "laminar.h"
+#include "spawner.h"
 
 #include <kj/async-io.h>
 #include <kj/async-unix.h>
 #include <kj/threadlocal.h>
 
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <signal.h>
+#include <string.h>
 #include <sys/eventfd.h>
 #include <sys/inotify.h>
 #include <sys/signalfd.h>
 #include <sys/stat.h>
 
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+
 // Size of buffer used to read from file descriptors. Should be
 // a multiple of sizeof(struct signalfd_siginfo) == 128
 #define PROC_IO_BUFSIZE 4096
 
-Server::Server(kj::AsyncIoContext& io) :
+// The worker threads behind Server::offload, one for each lane, so that
+// long bulk work does not delay prompt work. Completed functions are
+// collected and the event loop is woken through an eventfd
+struct Offloader {
+    enum Lane { PROMPT, BULK, LANES };
+    struct Job {
+        uint64_t id;
+        std::function<void()> fn;
+    };
+    struct Completion {
+        uint64_t id;
+        std::string error;
+    };
+
+    Offloader() :
+        efd(eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK)),
+        nextId(0),
+        stopping(false)
+    {
+        for(int lane = 0; lane < LANES; ++lane)
+            threads[lane] = std::thread(&Offloader::worker, this, Lane(lane));
+    }
+
+    ~Offloader() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        cv.notify_all();
+        for(std::thread& thread : threads)
+            thread.join();
+    }
+
+    uint64_t submit(Lane lane, std::function<void()> fn) {
+        uint64_t id = nextId++;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            jobs[lane].push_back(Job{id, kj::mv(fn)});
+        }
+        cv.notify_all();
+        return id;
+    }
+
+    std::deque<Completion> takeCompleted() {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::deque<Completion> result;
+        result.swap(completed);
+        return result;
+    }
+
+    void worker(Lane lane) {
+        std::unique_lock<std::mutex> lock(mutex);
+        while(true) {
+            cv.wait(lock, [this,lane]{ return stopping || !jobs[lane].empty(); });
+            if(stopping)
+                return;
+            Job job = kj::mv(jobs[lane].front());
+            jobs[lane].pop_front();
+            lock.unlock();
+            std::string error;
+            try {
+                job.fn();
+            } catch(kj::Exception& e) {
+                error = e.getDescription().cStr();
+            } catch(std::exception& e) {
+                error = e.what();
+            } catch(...) {
+                error = "unknown exception";
+            }
+            lock.lock();
+            completed.push_back(Completion{job.id, kj::mv(error)});
+            eventfd_write(efd, 1);
+        }
+    }
+
+    int efd;
+    // only used on the event loop
+    uint64_t nextId;
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool stopping;
+    std::deque<Job> jobs[LANES];
+    std::deque<Completion> completed;
+    std::thread threads[LANES];
+};
+
+struct TreeWatcherImpl;
+
+// One inotify instance serves all tree watches, since the number of
+// instances per user is limited (max_user_instances, 128 by default)
+struct TreeWatches {
+    TreeWatches(kj::UnixEventPort& port, int fd) :
+        fd(fd),
+        observer(port, fd, kj::UnixEventPort::FdObserver::OBSERVE_READ),
+        task(nullptr)
+    {
+        task = watch().eagerlyEvaluate([](kj::Exception&& e){
+            LLOG(ERROR, e);
+        });
+    }
+    kj::Promise<void> watch() {
+        return observer.whenBecomesReadable().then([this]{
+            drain();
+            return watch();
+        });
+    }
+    void drain();
+
+    kj::AutoCloseFd fd;
+    // watch descriptor to the watcher of the tree the directory belongs to
+    std::map<int, TreeWatcherImpl*> watchers;
+    kj::UnixEventPort::FdObserver observer;
+    kj::Promise<void> task;
+};
+
+struct TreeWatcherImpl final : public TreeWatcher {
+    TreeWatcherImpl(std::shared_ptr<TreeWatches> watches, const std::string& root, std::function<void(const std::string&, bool)> fn) :
+        shared(kj::mv(watches)),
+        watches(*shared),
+        root(root),
+        fn(kj::mv(fn))
+    {
+        addTree(std::string());
+    }
+    ~TreeWatcherImpl() {
+        for(const auto& d : dirs) {
+            inotify_rm_watch(watches.fd, d.first);
+            watches.watchers.erase(d.first);
+        }
+    }
+    void drain() override {
+        watches.drain();
+    }
+    void handle(const struct inotify_event* ev) {
+        auto it = dirs.find(ev->wd);
+        if(it == dirs.end())
+            return;
+        if(ev->mask & IN_IGNORED) {
+            watches.watchers.erase(it->first);
+            dirs.erase(it);
+            return;
+        }
+        std::string path = it->second.empty() ? ev->name : it->second + "/" + ev->name;
+        if(ev->mask & IN_ISDIR) {
+            // files may have been created in the directory before it is watched
+            if(ev->mask & (IN_CREATE | IN_MOVED_TO))
+                addTree(path);
+            else if(ev->mask & IN_MOVED_FROM)
+                removeTree(path);
+            return;
+        }
+        // A new file is reported once it is closed after writing. A hard
+        // link has no such event, so the tree must be rescanned
+        if(ev->mask & IN_CREATE) {
+            struct stat st;
+            if(fstatat(AT_FDCWD, (root + "/" + path).c_str(), &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(st.st_mode) && st.st_nlink > 1)
+                fn(std::string(), false);
+            return;
+        }
+        fn(path, ev->mask & (IN_DELETE | IN_MOVED_FROM));
+    }
+    void addTree(const std::string& dir) {
+        std::string abs = dir.empty() ? root : root + "/" + dir;
+        int wd = inotify_add_watch(watches.fd, abs.c_str(), IN_ONLYDIR | IN_CREATE | IN_CLOSE_WRITE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO);
+        // A directory already watched for another tree, e.g. one moved
+        // there from this one, has the same descriptor and stays with it
+        if(wd < 0 || watches.watchers.emplace(wd, this).first->second != this) {
+            // e.g. max_user_watches was reached, so the tree can't be
+            // followed any more
+            fn(std::string(), false);
+            return;
+        }
+        dirs[wd] = dir;
+        DIR* d = opendir(abs.c_str());
+        if(!d) {
+            fn(std::string(), false);
+            return;
+        }
+        while(struct dirent* de = readdir(d)) {
+            if(strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+                continue;
+            std::string path = dir.empty() ? de->d_name : dir + "/" + de->d_name;
+            unsigned char type = de->d_type;
+            if(type == DT_UNKNOWN) {
+                // not every filesystem fills in d_type
+                struct stat st;
+                if(fstatat(dirfd(d), de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+                    fn(std::string(), false);
+                    continue;
+                }
+                type = S_ISDIR(st.st_mode) ? DT_DIR : DT_REG;
+            }
+            if(type == DT_DIR)
+                addTree(path);
+            else
+                fn(path, false);
+        }
+        closedir(d);
+    }
+    // The files below a directory that was moved away are not reported
+    // as removed, so the tree must be rescanned
+    void removeTree(const std::string& dir) {
+        for(auto it = dirs.begin(); it != dirs.end();) {
+            if(it->second == dir || it->second.compare(0, dir.size() + 1, dir + "/") == 0) {
+                inotify_rm_watch(watches.fd, it->first);
+                watches.watchers.erase(it->first);
+                it = dirs.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        fn(std::string(), false);
+    }
+
+    std::shared_ptr<TreeWatches> shared;
+    TreeWatches& watches;
+    std::string root;
+    std::function<void(const std::string&, bool)> fn;
+    // watch descriptor to the path of the directory relative to root
+    std::map<int, std::string> dirs;
+};
+
+void TreeWatches::drain() {
+    alignas(struct inotify_event) char buf[PROC_IO_BUFSIZE];
+    ssize_t n;
+    while((n = read(fd, buf, sizeof(buf))) > 0) {
+        for(char* p = buf; p < buf + n;) {
+            const struct inotify_event* ev = reinterpret_cast<const struct inotify_event*>(p);
+            p += sizeof(struct inotify_event) + ev->len;
+            if(ev->mask & IN_Q_OVERFLOW) {
+                // the lost events may have belonged to any tree
+                std::set<TreeWatcherImpl*> all;
+                for(const auto& w : watchers)
+                    all.insert(w.second);
+                for(TreeWatcherImpl* w : all)
+                    w->fn(std::string(), false);
+                continue;
+            }
+            auto it = watchers.find(ev->wd);
+            if(it != watchers.end())
+                it->second->handle(ev);
+        }
+    }
+}
+
+Server::Server(kj::AsyncIoContext& io, int spawnerFd) :
     ioContext(io),
     listeners(kj::heap<kj::TaskSet>(*this)),
-    childTasks(*this)
+    childTasks(*this),
+    rpcConnections(kj::heap<kj::TaskSet>(*this)),
+    spawner(kj::heap<Spawner>(*io.lowLevelProvider, spawnerFd)),
+    offloader(kj::heap<Offloader>())
 {
+    // Not part of the listeners, because offloaded work may still be
+    // awaited by child tasks during shutdown
+    auto event = ioContext.lowLevelProvider->wrapInputFd(offloader->efd, kj::LowLevelAsyncIoProvider::TAKE_OWNERSHIP);
+    offloadWatch = handleOffloadCompletions(event).attach(kj::mv(event)).eagerlyEvaluate([](kj::Exception&& e){
+        LLOG(ERROR, e);
+    });
 }
 
 Server::~Server() {
@@ -65,7 +330,10 @@ void Server::start() {
     // TODO not sure the comments below are true
     // 3. run the loop once more to send any pending output to http clients
     ioContext.waitScope.poll();
-    // 4. return: http connections will be destructed when class is deleted
+    // 4. disconnect RPC clients, which may be agents or subscribers that
+    // would otherwise stay connected indefinitely
+    rpcConnections = nullptr;
+    // 5. return: http connections will be destructed when class is deleted
 }
 
 void Server::stop() {
@@ -80,35 +348,132 @@ kj::Promise<void> Server::readDescriptor(int fd, std::function<void(const char*,
     return handleFdRead(event, buffer.asPtr().begin(), cb).attach(std::move(event)).attach(std::move(buffer));
 }
 
+kj::Own<kj::AsyncOutputStream> Server::writeDescriptor(int fd) {
+    return ioContext.lowLevelProvider->wrapOutputFd(fd, kj::LowLevelAsyncIoProvider::TAKE_OWNERSHIP);
+}
+
 void Server::addTask(kj::Promise<void>&& task) {
     childTasks.add(kj::mv(task));
 }
 
+void Server::addBackgroundTask(kj::Promise<void>&& task) {
+    listeners->add(kj::mv(task));
+}
+
+kj::Own<TreeWatcher> Server::watchTree(const std::string& root, std::function<void(const std::string&, bool)> fn)
+{
+    if(!treeWatches) {
+        int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if(fd < 0) {
+            // e.g. max_user_instances was reached
+            LLOG(WARNING, "Could not watch tree", root, strerror(errno));
+            return nullptr;
+        }
+        treeWatches = std::make_shared<TreeWatches>(ioContext.unixEventPort, fd);
+    }
+    return kj::heap<TreeWatcherImpl>(treeWatches, root, kj::mv(fn));
+}
+
+kj::Promise<void> Server::offload(std::function<void()> fn) {
+    auto paf = kj::newPromiseAndFulfiller<void>();
+    // the completion can't be handled before this returns to the event loop
+    offloaded[offloader->submit(Offloader::PROMPT, kj::mv(fn))] = kj::mv(paf.fulfiller);
+    return kj::mv(paf.promise);
+}
+
+kj::Promise<void> Server::offloadBulk(std::function<void()> fn) {
+    auto paf = kj::newPromiseAndFulfiller<void>();
+    offloaded[offloader->submit(Offloader::BULK, kj::mv(fn))] = kj::mv(paf.fulfiller);
+    return kj::mv(paf.promise);
+}
+
+kj::Promise<void> Server::handleOffloadCompletions(kj::AsyncInputStream* stream) {
+    static uint64_t _;
+    return stream->read(&_, sizeof(uint64_t)).then([this,stream]{
+        for(Offloader::Completion& c : offloader->takeCompleted()) {
+            auto it = offloaded.find(c.id);
+            if(it == offloaded.end())
+                continue;
+            if(c.error.empty())
+                it->second->fulfill();
+            else
+                it->second->reject(KJ_EXCEPTION(FAILED, "Offloaded function failed", c.error.c_str()));
+            offloaded.erase(it);
+        }
+        return handleOffloadCompletions(stream);
+    });
+}
+
 kj::Promise<void> Server::addTimeout(int seconds, std::function<void ()> cb) {
     return ioContext.lowLevelProvider->getTimer().afterDelay(seconds * kj::SECONDS).then([cb](){
         cb();
     }).eagerlyEvaluate(nullptr);
 }
 
-kj::Promise<int> Server::onChildExit(kj::Maybe<pid_t> &pid) {
-    return ioContext.unixEventPort.onChildExit(pid);
-}
-
-Server::PathWatcher& Server::watchPaths(std::function<void()> fn)
+Server::PathWatcher& Server::watchPaths(std::function<void(const std::set<std::string>&)> fn)
 {
     struct PathWatcherImpl final : public PathWatcher {
         PathWatcher& addPath(const char* path) override {
-            inotify_add_watch(fd, path, IN_ONLYDIR | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE);
+            int wd = inotify_add_watch(fd, path, IN_ONLYDIR | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO);
+            if(wd >= 0)
+                paths[wd] = path;
             return *this;
         }
         int fd;
+        std::map<int, std::string> paths;
+        // changes accumulated since the callback was last invoked
+        std::set<std::string> pending;
+        bool overflowed = false;
+        // when the first of the pending changes was seen
+        kj::Maybe<kj::TimePoint> batchStart;
+        // delivers the pending changes, restarted by every event
+        kj::Promise<void> timer = nullptr;
     };
     auto pwi = kj::heap<PathWatcherImpl>();
-    PathWatcher* pw = pwi.get();
+    PathWatcherImpl* pw = pwi.get();
 
     pwi->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
-    listeners->add(readDescriptor(pwi->fd, [fn](const char*, size_t){
-        fn();
+    listeners->add(readDescriptor(pwi->fd, [this,fn,pw](const char* buf, size_t sz){
+        // A read from an inotify descriptor always returns whole events
+        for(const char* p = buf; p < buf + sz;) {
+            const struct inotify_event* ev = reinterpret_cast<const struct inotify_event*>(p);
+            if(ev->mask & IN_Q_OVERFLOW) {
+                // events were dropped, so the set of changes is unknown
+                pw->overflowed = true;
+            } else {
+                auto it = pw->paths.find(ev->wd);
+                if(it != pw->paths.end())
+                    pw->pending.insert(ev->len ? it->second + "/" + ev->name : it->second);
+            }
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+        if(pw->pending.empty() && !pw->overflowed)
+            return;
+        // Something like a git checkout touches many files in quick succession.
+        // Rather than invoking the callback for each read, collect everything
+        // until the changes settle and deliver it at once, but no later than
+        // WATCH_MAX_DELAY after the first change, in case they never settle.
+        // Replacing the promise cancels the previous timer
+        kj::Timer& timer = ioContext.lowLevelProvider->getTimer();
+        kj::TimePoint deliverAt = timer.now() + WATCH_DEBOUNCE;
+        KJ_IF_MAYBE(start, pw->batchStart) {
+            if(*start + WATCH_MAX_DELAY < deliverAt)
+                deliverAt = *start + WATCH_MAX_DELAY;
+        } else {
+            pw->batchStart = timer.now();
+        }
+        pw->timer = timer.atTime(deliverAt).then([fn,pw](){
+            std::set<std::string> changed;
+            // an empty set means anything may have changed
+            if(!pw->overflowed)
+                changed.swap(pw->pending);
+            pw->pending.clear();
+            pw->overflowed = false;
+            pw->batchStart = nullptr;
+            fn(changed);
+        }).eagerlyEvaluate([](kj::Exception&& e){
+            LLOG(ERROR, e);
+        });
     }).attach(kj::mv(pwi)));
     return *pw;
 }
@@ -152,7 +517,7 @@ kj::Promise<void> Server::acceptRpcClient(Rpc& rpc, kj::Own<kj::ConnectionReceiv
     kj::ConnectionReceiver& cr = *listener.get();
     return cr.accept().then(kj::mvCapture(kj::mv(listener),
         [this, &rpc](kj::Own<kj::ConnectionReceiver>&& listener, kj::Own<kj::AsyncIoStream>&& connection) {
-            addTask(rpc.accept(kj::mv(connection)));
+            rpcConnections->add(rpc.accept(kj::mv(connection)));
             return acceptRpcClient(rpc, kj::mv(listener));
         }));
 }
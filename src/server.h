@@ -24,16 +24,32 @@
 #include <capnp/message.h>
 #include <capnp/capability.h>
 #include <functional>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
 #include <sys/types.h>
 
 class Laminar;
 class Http;
 class Rpc;
+class Spawner;
+struct Offloader;
+struct TreeWatches;
+
+// See Server::watchTree
+class TreeWatcher {
+public:
+    virtual ~TreeWatcher() {}
+    // Handles all the events the kernel has queued, without waiting for
+    // the event loop
+    virtual void drain() = 0;
+};
 
 // This class manages the program's asynchronous event loop
 class Server final : public kj::TaskSet::ErrorHandler {
 public:
-    Server(kj::AsyncIoContext& ioContext);
+    Server(kj::AsyncIoContext& ioContext, int spawnerFd);
     ~Server();
     void start();
     void stop();
@@ -41,19 +57,50 @@ public:
     // add a file descriptor to be monitored for output. The callback will be
     // invoked with the read data
     kj::Promise<void> readDescriptor(int fd, std::function<void(const char*,size_t)> cb);
+    // wrap a file descriptor for asynchronous writing. Takes ownership of fd
+    kj::Own<kj::AsyncOutputStream> writeDescriptor(int fd);
 
     void addTask(kj::Promise<void> &&task);
+    // add a task which is cancelled rather than awaited when the server stops
+    void addBackgroundTask(kj::Promise<void> &&task);
     // add a one-shot timer callback
     kj::Promise<void> addTimeout(int seconds, std::function<void()> cb);
 
-    // get a promise which resolves when a child process exits
-    kj::Promise<int> onChildExit(kj::Maybe<pid_t>& pid);
+    // Runs fn on a worker thread, for blocking work such as listing an
+    // archive. Functions are run one at a time in the order given. fn must
+    // not touch anything belonging to the event loop. The promise resolves
+    // on the event loop after fn has returned, and is rejected if fn threw
+    kj::Promise<void> offload(std::function<void()> fn);
+    // Like offload, but on a separate worker for work which may take minutes,
+    // such as hashing or compressing archives, so that it never delays the
+    // completion of a run
+    kj::Promise<void> offloadBulk(std::function<void()> fn);
+
+    // the client of the helper process which launches run leaders
+    Spawner& getSpawner() { return *spawner; }
 
     struct PathWatcher {
         virtual PathWatcher& addPath(const char* path) = 0;
     };
 
-    PathWatcher& watchPaths(std::function<void()>);
+    // Watch the added directories for changes. Changes are collected until
+    // none has happened for WATCH_DEBOUNCE, or WATCH_MAX_DELAY has passed
+    // since the first of them, then the callback is invoked once with the
+    // absolute paths of the files (or directories) which changed.
+    // If the kernel's event queue overflowed, the set is empty and the
+    // callback should assume that anything may have changed
+    PathWatcher& watchPaths(std::function<void(const std::set<std::string>&)>);
+    static constexpr kj::Duration WATCH_DEBOUNCE = 100 * kj::MILLISECONDS;
+    static constexpr kj::Duration WATCH_MAX_DELAY = 5 * WATCH_DEBOUNCE;
+
+    // Watch the directory tree at root, including directories created later,
+    // until the returned object is destroyed. The callback is invoked for
+    // every existing file, and whenever a file is closed after writing or
+    // moved in, with its path relative to root. If a file is
+    // deleted or moved away, removed is true. If events were lost, a
+    // directory couldn't be watched or a hard link was created, the path is
+    // empty and the tree must be rescanned. Returns null if no watch could be created at all
+    kj::Own<TreeWatcher> watchTree(const std::string& root, std::function<void(const std::string& path, bool removed)> fn);
 
     void listenRpc(Rpc& rpc, kj::StringPtr rpcBindAddress);
     void listenHttp(Http& http, kj::StringPtr httpBindAddress);
@@ -61,15 +108,28 @@ public:
 private:
     kj::Promise<void> acceptRpcClient(Rpc& rpc, kj::Own<kj::ConnectionReceiver>&& listener);
     kj::Promise<void> handleFdRead(kj::AsyncInputStream* stream, char* buffer, std::function<void(const char*,size_t)> cb);
+    kj::Promise<void> handleOffloadCompletions(kj::AsyncInputStream* stream);
 
     void taskFailed(kj::Exception&& exception) override;
 
 private:
     int efd_quit;
     kj::AsyncIoContext& ioContext;
+    // created by the first watchTree, and shared with the watchers, which
+    // may outlive the server
+    std::shared_ptr<TreeWatches> treeWatches;
     kj::Own<kj::TaskSet> listeners;
     kj::TaskSet childTasks;
+    // closed only after childTasks, so that clients waiting on runs get
+    // their results, but long-lived clients such as agents do not hold up
+    // shutdown
+    kj::Own<kj::TaskSet> rpcConnections;
+    kj::Own<Spawner> spawner;
     kj::Maybe<kj::Promise<void>> reapWatch;
+    // destroyed in reverse order, so the worker stops first
+    kj::Maybe<kj::Promise<void>> offloadWatch;
+    std::map<uint64_t, kj::Own<kj::PromiseFulfiller<void>>> offloaded;
+    kj::Own<Offloader> offloader;
 };
 
 #endif // LAMINAR_SERVER_H_
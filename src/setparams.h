@@ -0,0 +1,123 @@
+///
+/// Copyright 2022 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#ifndef LAMINAR_SETPARAMS_H_
+#define LAMINAR_SETPARAMS_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+// `laminarc set` passes variables to the leader of the run it is called
+// from through the pipe in $__LAMINAR_SETENV_PIPE. Each call writes one
+// frame: a uint32_t length, then that many bytes holding one or more
+// variables, each as a uint32_t length and the name followed by a uint32_t
+// length and the value. Both ends are on the same machine, so lengths are
+// in host byte order. A writer reopens the pipe through /proc/self/fd, so
+// that it has its own open file description, and holds an exclusive flock
+// on that for the whole frame, so frames larger than PIPE_BUF are not
+// interleaved. If the leader cannot decode the stream, it closes the pipe.
+
+typedef std::vector<std::pair<std::string, std::string>> ParamList;
+
+inline void appendFrameField(std::string& out, const std::string& field) {
+    uint32_t len = field.size();
+    out.append(reinterpret_cast<const char*>(&len), sizeof(len));
+    out.append(field);
+}
+
+// Reads a field at pos, which must end by end. Returns false if it doesn't
+inline bool readFrameField(const std::string& in, size_t& pos, size_t end, std::string& field) {
+    uint32_t len;
+    if(end - pos < sizeof(len))
+        return false;
+    memcpy(&len, in.data() + pos, sizeof(len));
+    pos += sizeof(len);
+    if(end - pos < len)
+        return false;
+    field.assign(in, pos, len);
+    pos += len;
+    return true;
+}
+
+inline std::string encodeParamFrame(const ParamList& params) {
+    std::string payload;
+    for(const auto& param : params) {
+        appendFrameField(payload, param.first);
+        appendFrameField(payload, param.second);
+    }
+    std::string frame;
+    appendFrameField(frame, payload);
+    return frame;
+}
+
+// Removes the complete frames from the start of buffer and appends their
+// variables to params. Returns false if a frame is malformed, after which
+// the rest of the stream cannot be decoded
+inline bool decodeParamFrames(std::string& buffer, ParamList& params) {
+    size_t pos = 0;
+    uint32_t len;
+    while(buffer.size() - pos >= sizeof(len)) {
+        memcpy(&len, buffer.data() + pos, sizeof(len));
+        if(buffer.size() - pos - sizeof(len) < len)
+            break;
+        size_t end = pos + sizeof(len) + len;
+        pos += sizeof(len);
+        while(pos < end) {
+            std::string name, value;
+            if(!readFrameField(buffer, pos, end, name) || !readFrameField(buffer, pos, end, value))
+                return false;
+            params.emplace_back(std::move(name), std::move(value));
+        }
+    }
+    buffer.erase(0, pos);
+    return true;
+}
+
+// The leader reports each variable to laminard on LEADER_STEPS_FD as a
+// line "param NAME VALUE". Backslashes and newlines in the value are
+// escaped, so that it fits on the line
+inline std::string escapeParamValue(const std::string& value) {
+    std::string res;
+    res.reserve(value.size());
+    for(char c : value) {
+        if(c == '\\')
+            res += "\\\\";
+        else if(c == '\n')
+            res += "\\n";
+        else
+            res += c;
+    }
+    return res;
+}
+
+inline std::string unescapeParamValue(const std::string& value) {
+    std::string res;
+    res.reserve(value.size());
+    for(size_t i = 0; i < value.size(); ++i) {
+        if(value[i] == '\\' && i + 1 < value.size())
+            res += value[++i] == 'n' ? '\n' : value[i];
+        else
+            res += value[i];
+    }
+    return res;
+}
+
+#endif // LAMINAR_SETPARAMS_H_
@@ -0,0 +1,44 @@
+///
+/// Copyright 2022 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#ifndef LAMINAR_SHA256_H_
+#define LAMINAR_SHA256_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+// Minimal SHA-256 (FIPS 180-4), used to identify archived files by their
+// content without depending on a crypto library
+class Sha256 {
+public:
+    Sha256();
+    void update(const void* data, size_t len);
+    // Returns the digest as lowercase hex. The object must not be used afterwards
+    std::string hexDigest();
+
+private:
+    void transform(const uint8_t* block);
+
+    uint32_t state[8];
+    uint64_t length;
+    uint8_t buffer[64];
+    size_t buffered;
+};
+
+#endif // LAMINAR_SHA256_H_
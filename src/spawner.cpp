@@ -0,0 +1,331 @@
+///
+/// Copyright 2022 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#include "spawner.h"
+#include "log.h"
+#include "pidfd.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <vector>
+
+namespace {
+
+// Sent from the helper to laminard. A STARTED event carries the read
+// ends of the leader's output and steps pipes as ancillary data. If the helper could
+// not fork, pid is the negated errno and no descriptor is attached.
+struct Event {
+    enum Type : uint32_t { STARTED, EXITED } type;
+    pid_t pid;
+    int status;
+};
+
+// Requests are framed as a native-endian uint32 length followed by that
+// many bytes of NUL-terminated strings: the working directory, the process
+// name (argv[0]) and then the complete environment as KEY=VALUE strings.
+void putString(std::string& buf, const std::string& s) {
+    buf.append(s);
+    buf.push_back('\0');
+}
+
+bool readAll(int fd, void* buf, size_t len) {
+    char* p = static_cast<char*>(buf);
+    while(len > 0) {
+        ssize_t n = read(fd, p, len);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool sendEvent(int sock, const Event& ev, const int* fds = nullptr, int nfds = 0) {
+    struct iovec iov = { const_cast<Event*>(&ev), sizeof(Event) };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    char control[CMSG_SPACE(2 * sizeof(int))];
+    if(nfds > 0) {
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+    }
+    ssize_t n;
+    do {
+        n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    } while(n < 0 && errno == EINTR);
+    return n == sizeof(Event);
+}
+
+// Returns the pid of the launched leader, or -1
+pid_t handleRequest(int sock, std::string& payload) {
+    std::vector<char*> fields;
+    for(size_t i = 0; i < payload.size(); i += strlen(&payload[i]) + 1)
+        fields.push_back(&payload[i]);
+    if(fields.size() < 2) {
+        sendEvent(sock, Event{Event::STARTED, -EINVAL, 0});
+        return -1;
+    }
+
+    int plog[2];
+    if(pipe2(plog, O_CLOEXEC) != 0) {
+        sendEvent(sock, Event{Event::STARTED, -errno, 0});
+        return -1;
+    }
+    int psteps[2];
+    if(pipe2(psteps, O_CLOEXEC) != 0) {
+        sendEvent(sock, Event{Event::STARTED, -errno, 0});
+        close(plog[0]);
+        close(plog[1]);
+        return -1;
+    }
+
+    char* argv[] = { fields[1], nullptr };
+    fields.push_back(nullptr);
+    char** envp = &fields[2];
+
+    // All output from the leader will be captured in the plog pipe. Both
+    // ends are close-on-exec, but dup2 clears the flag on the copies
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, plog[1], STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, plog[1], STDERR_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, psteps[1], LEADER_STEPS_FD);
+    // leader process assumes $LAMINAR_HOME as CWD. Otherwise it changes
+    // there itself, see leader_main
+#ifdef HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCHDIR_NP
+    posix_spawn_file_actions_addchdir_np(&actions, fields[0]);
+#endif
+
+    // The helper ignores termination signals and blocks SIGCHLD, but the
+    // leader and its scripts should get the default behaviour
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+    sigset_t mask;
+    sigemptyset(&mask);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGHUP);
+    posix_spawnattr_setsigdefault(&attr, &mask);
+
+    // Fork a process leader to run all the steps of the job. This gives us a nice
+    // process tree output (job name and number as the process name) and helps
+    // contain any wayward descendent processes. The leader is laminard itself,
+    // distinguished by its process name, see leader_main(). glibc implements
+    // posix_spawn with clone(CLONE_VM|CLONE_VFORK), so nothing is copied.
+    pid_t leader;
+    int err = posix_spawn(&leader, "/proc/self/exe", &actions, &attr, argv, envp);
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    close(plog[1]);
+    close(psteps[1]);
+    if(err != 0) {
+        close(plog[0]);
+        close(psteps[0]);
+        sendEvent(sock, Event{Event::STARTED, -err, 0});
+        return -1;
+    }
+    int fds[] = { plog[0], psteps[0] };
+    sendEvent(sock, Event{Event::STARTED, leader, 0}, fds, 2);
+    close(plog[0]);
+    close(psteps[0]);
+    return leader;
+}
+
+// A leader which has not yet been reaped
+struct Tracked {
+    pid_t pid;
+    // -1 if the kernel does not support pidfds
+    int pidfd;
+};
+
+[[noreturn]] void spawnerMain(int sock) {
+    // Termination signals are usually delivered to the whole process group.
+    // The helper must outlive laminard's shutdown sequence, which waits for
+    // the leaders to exit, so it only quits when its socket is closed.
+    signal(SIGINT, SIG_IGN);
+    signal(SIGTERM, SIG_IGN);
+    signal(SIGHUP, SIG_IGN);
+
+    // Each leader is watched through a pidfd, which becomes readable when
+    // that leader exits, so exits are never coalesced and nothing has to be
+    // swept. SIGCHLD is only used on kernels without pidfd support.
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, nullptr);
+    int sfd = signalfd(-1, &mask, SFD_CLOEXEC);
+
+    std::vector<Tracked> leaders;
+    std::vector<struct pollfd> fds;
+    while(true) {
+        fds.clear();
+        fds.push_back({ sock, POLLIN, 0 });
+        fds.push_back({ sfd, POLLIN, 0 });
+        // poll ignores negative descriptors
+        for(const Tracked& leader : leaders)
+            fds.push_back({ leader.pidfd, POLLIN, 0 });
+
+        if(poll(fds.data(), fds.size(), -1) < 0) {
+            if(errno == EINTR)
+                continue;
+            _exit(EXIT_FAILURE);
+        }
+        // iterate backwards so erasing keeps the indices into fds valid
+        for(size_t i = leaders.size(); i-- > 0;) {
+            int status;
+            if((fds[i + 2].revents & POLLIN) && pidfdWait(leaders[i].pidfd, leaders[i].pid, status)) {
+                sendEvent(sock, Event{Event::EXITED, leaders[i].pid, status});
+                close(leaders[i].pidfd);
+                leaders.erase(leaders.begin() + i);
+            }
+        }
+        if(fds[1].revents & POLLIN) {
+            struct signalfd_siginfo si;
+            if(read(sfd, &si, sizeof(si)) < 0 && errno != EAGAIN)
+                _exit(EXIT_FAILURE);
+            // signals coalesce, so check every leader without a pidfd
+            for(size_t i = leaders.size(); i-- > 0;) {
+                int status;
+                if(leaders[i].pidfd < 0 && waitpid(leaders[i].pid, &status, WNOHANG) == leaders[i].pid) {
+                    sendEvent(sock, Event{Event::EXITED, leaders[i].pid, status});
+                    leaders.erase(leaders.begin() + i);
+                }
+            }
+        }
+        if(fds[0].revents & (POLLIN|POLLHUP)) {
+            uint32_t len;
+            if(!readAll(sock, &len, sizeof(len)))
+                _exit(EXIT_SUCCESS); // laminard went away
+            std::string payload(len, '\0');
+            if(!readAll(sock, &payload[0], len))
+                _exit(EXIT_SUCCESS);
+            pid_t pid = handleRequest(sock, payload);
+            // a pidfd can be opened even if the leader already exited, as
+            // long as it has not been reaped
+            if(pid > 0)
+                leaders.push_back(Tracked{pid, pidfdOpen(pid)});
+        }
+    }
+}
+
+}
+
+int Spawner::startHelper() {
+    int sv[2];
+    LSYSCALL(socketpair(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0, sv));
+    pid_t pid;
+    LSYSCALL(pid = fork());
+    if(pid == 0) {
+        close(sv[0]);
+        spawnerMain(sv[1]);
+    }
+    close(sv[1]);
+    return sv[0];
+}
+
+Spawner::Spawner(kj::LowLevelAsyncIoProvider& provider, int fd) :
+    stream(provider.wrapUnixSocketFd(fd)),
+    writes(kj::READY_NOW),
+    reader(readEvents().eagerlyEvaluate([](kj::Exception&& e){
+        // Without the helper, no runs can be started or completed
+        fprintf(stderr, "fatal: lost connection to spawner: %s\n", e.getDescription().cStr());
+        exit(EXIT_FAILURE);
+    }))
+{
+}
+
+Spawner::~Spawner() {
+}
+
+kj::Promise<Spawner::Child> Spawner::spawn(const Request& rq) {
+    std::string payload;
+    putString(payload, rq.cwd);
+    putString(payload, rq.procName);
+    for(const std::string& e : rq.env)
+        putString(payload, e);
+
+    uint32_t len = payload.size();
+    auto frame = kj::heapArray<char>(sizeof(len) + len);
+    memcpy(frame.begin(), &len, sizeof(len));
+    memcpy(frame.begin() + sizeof(len), payload.data(), len);
+
+    // kj streams allow only one outstanding write, so chain them
+    writes = writes.then([this, frame = kj::mv(frame)]() mutable {
+        kj::ArrayPtr<const char> data = frame;
+        return stream->write(data.begin(), data.size()).attach(kj::mv(frame));
+    }).eagerlyEvaluate(nullptr);
+
+    auto paf = kj::newPromiseAndFulfiller<Child>();
+    pendingSpawns.push_back(kj::mv(paf.fulfiller));
+    return kj::mv(paf.promise);
+}
+
+kj::Promise<void> Spawner::readEvents() {
+    auto event = kj::heap<Event>();
+    auto fd = kj::heapArray<kj::AutoCloseFd>(2);
+    Event* ev = event.get();
+    kj::AutoCloseFd* received = fd.begin();
+    // The buffers are owned by the continuation rather than attached to the
+    // promise, so they are released before the next read is chained
+    return stream->tryReadWithFds(ev, sizeof(Event), sizeof(Event), received, 2)
+            .then([this, event = kj::mv(event), fd = kj::mv(fd)](kj::AsyncCapabilityStream::ReadResult result) mutable -> kj::Promise<void> {
+        if(result.byteCount < sizeof(Event))
+            return KJ_EXCEPTION(DISCONNECTED, "spawner helper exited");
+        if(event->type == Event::STARTED) {
+            LASSERT(!pendingSpawns.empty());
+            kj::Own<kj::PromiseFulfiller<Child>> fulfiller = kj::mv(pendingSpawns.front());
+            pendingSpawns.pop_front();
+            if(event->pid < 0 || result.capCount == 0) {
+                fulfiller->reject(KJ_EXCEPTION(FAILED, "spawner could not launch leader", strerror(-event->pid)));
+            } else {
+                auto exited = kj::newPromiseAndFulfiller<int>();
+                exitWaiters[event->pid] = kj::mv(exited.fulfiller);
+                int steps = result.capCount > 1 ? fd[1].release() : -1;
+                fulfiller->fulfill(Child{event->pid, fd[0].release(), steps, kj::mv(exited.promise)});
+            }
+        } else if(event->type == Event::EXITED) {
+            auto it = exitWaiters.find(event->pid);
+            if(it != exitWaiters.end()) {
+                it->second->fulfill(kj::cp(event->status));
+                exitWaiters.erase(it);
+            }
+        }
+        return readEvents();
+    });
+}
@@ -0,0 +1,90 @@
+///
+/// Copyright 2022 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#ifndef LAMINAR_SPAWNER_H_
+#define LAMINAR_SPAWNER_H_
+
+#include <kj/async-io.h>
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <sys/types.h>
+
+// Definition needed for musl
+typedef unsigned int uint;
+
+// The descriptor on which a leader reports the start and completion of each
+// of its scripts, one line each, as "started TIME NAME" and "completed TIME
+// RESULT NAME". NAME is the path of the script relative to cfg. Variables
+// set with `laminarc set` are reported on it too, see setparams.h
+constexpr int LEADER_STEPS_FD = 3;
+
+// Forking the leader process directly from laminard means copying the page
+// tables of a process which holds every run's log, the HTTP state and the
+// database connections, so launch latency grows with the size of the daemon.
+// Instead, main() forks a small helper process before any of that exists,
+// and laminard asks the helper to fork leaders on its behalf over a unix
+// socket. The helper passes back the pid and the read ends of the leader's
+// output and steps pipes (via SCM_RIGHTS) and later reports the leader's exit status,
+// since the leader is the helper's child and not laminard's. Leaders are
+// launched with posix_spawn, which avoids copying even the helper's page
+// tables, so the cost of a launch is small and constant.
+class Spawner {
+public:
+    // Forks the helper process and returns laminard's end of the socket
+    // connected to it. Must be called early in main(), before the event
+    // loop is set up and while the process is still small.
+    static int startHelper();
+
+    Spawner(kj::LowLevelAsyncIoProvider& provider, int fd);
+    ~Spawner();
+
+    // Describes the leader process to be launched. The environment is
+    // complete, so the helper has nothing to parse or compute after forking
+    struct Request {
+        std::string cwd;
+        std::string procName;
+        std::vector<std::string> env;
+    };
+
+    // A launched leader process. The output_fd and steps_fd are owned by
+    // the receiver. steps_fd is -1 if the steps are not reported
+    struct Child {
+        pid_t pid;
+        int output_fd;
+        int steps_fd;
+        // resolves with the wait status of the leader once it exits
+        kj::Promise<int> exited;
+    };
+
+    kj::Promise<Child> spawn(const Request& request);
+
+private:
+    kj::Promise<void> readEvents();
+
+    kj::Own<kj::AsyncCapabilityStream> stream;
+    // The helper serves requests in order, so responses to spawn()
+    // are matched to the oldest outstanding request
+    std::deque<kj::Own<kj::PromiseFulfiller<Child>>> pendingSpawns;
+    std::unordered_map<pid_t, kj::Own<kj::PromiseFulfiller<int>>> exitWaiters;
+    kj::Promise<void> writes;
+    kj::Promise<void> reader;
+};
+
+#endif // LAMINAR_SPAWNER_H_
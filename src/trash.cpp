@@ -0,0 +1,185 @@
+///
+/// Copyright 2022 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#include "trash.h"
+#include "log.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+// without new entries, the trash is checked for entries from leader processes this often
+#define TRASH_RESCAN_INTERVAL std::chrono::seconds(60)
+
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_WHO_PROCESS 1
+
+Trash::Trash(const std::string& home) :
+    dir(dirIn(home)),
+    notified(false),
+    stopping(false),
+    pending(0),
+    removedEntries(0),
+    removedFiles(0)
+{
+    if(mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST)
+        LLOG(ERROR, "Could not create trash directory", dir, strerror(errno));
+    thread = std::thread(&Trash::worker, this);
+}
+
+Trash::~Trash() {
+    stopping = true;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        notified = true;
+    }
+    cv.notify_one();
+    thread.join();
+}
+
+bool Trash::moveInto(const std::string& trashDir, const std::string& path) {
+    // unique among all processes which may be moving things into the trash
+    static std::atomic<unsigned> counter(0);
+    std::string base = path.substr(path.rfind('/') + 1);
+    std::string dest = trashDir + "/" + std::to_string(time(nullptr)) + "." + std::to_string(getpid())
+            + "." + std::to_string(counter++) + "." + base;
+    return rename(path.c_str(), dest.c_str()) == 0;
+}
+
+bool Trash::discard(const std::string& path) {
+    if(!moveInto(dir, path))
+        return false;
+    pending++;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        notified = true;
+    }
+    cv.notify_one();
+    return true;
+}
+
+Trash::Stats Trash::stats() const {
+    return Stats{pending, removedEntries, removedFiles};
+}
+
+void Trash::worker() {
+    // Deletion is never urgent, so don't compete with runs for the disk or
+    // the CPU. On Linux, both of these only apply to the calling thread
+    syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+
+    int dirfd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(dirfd < 0)
+        return;
+
+    std::unique_lock<std::mutex> lock(mutex);
+    while(!stopping) {
+        notified = false;
+        lock.unlock();
+        empty(dirfd);
+        lock.lock();
+        cv.wait_for(lock, TRASH_RESCAN_INTERVAL, [this]{ return notified; });
+    }
+    close(dirfd);
+}
+
+void Trash::empty(int dirfd) {
+    // list first, so that entries added meanwhile are found by the next scan
+    std::vector<std::string> entries;
+    int fd = dup(dirfd);
+    DIR* d = fdopendir(fd);
+    if(!d) {
+        close(fd);
+        return;
+    }
+    rewinddir(d);
+    while(struct dirent* de = readdir(d)) {
+        if(strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0)
+            entries.push_back(de->d_name);
+    }
+    closedir(d);
+
+    pending = entries.size();
+    for(const std::string& entry : entries) {
+        if(stopping)
+            return;
+        if(removeTree(dirfd, entry.c_str()))
+            removedEntries++;
+        else
+            LLOG(WARNING, "Could not completely delete from trash", entry, strerror(errno));
+        if(pending > 0)
+            pending--;
+    }
+}
+
+// Read-only directories, such as a go module cache, have to be made
+// writable before their entries can be removed
+static int unlinkWritable(int dirfd, const char* name, int flags) {
+    int r = unlinkat(dirfd, name, flags);
+    if(r != 0 && errno == EACCES) {
+        fchmod(dirfd, 0700);
+        r = unlinkat(dirfd, name, flags);
+    }
+    return r;
+}
+
+bool Trash::removeTree(int parentfd, const char* name) {
+    int fd = openat(parentfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if(fd < 0 && errno == EACCES) {
+        fchmodat(parentfd, name, 0700, 0);
+        fd = openat(parentfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    }
+    if(fd < 0) {
+        if(errno != ENOTDIR && errno != ELOOP)
+            return false;
+        // not a directory
+        if(unlinkWritable(parentfd, name, 0) != 0)
+            return false;
+        removedFiles++;
+        return true;
+    }
+
+    DIR* d = fdopendir(fd);
+    if(!d) {
+        close(fd);
+        return false;
+    }
+    while(struct dirent* de = readdir(d)) {
+        if(strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+        if(stopping)
+            break;
+        if(de->d_type == DT_DIR || de->d_type == DT_UNKNOWN) {
+            // failures show up when removing this directory
+            removeTree(fd, de->d_name);
+        } else if(unlinkWritable(fd, de->d_name, 0) == 0) {
+            removedFiles++;
+        }
+    }
+    closedir(d);
+    return unlinkWritable(parentfd, name, AT_REMOVEDIR) == 0;
+}
@@ -0,0 +1,76 @@
+///
+/// Copyright 2022 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#ifndef LAMINAR_TRASH_H_
+#define LAMINAR_TRASH_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <stdint.h>
+
+// Removing a run directory or workspace with hundreds of thousands of
+// files can take seconds, which must not happen on the event loop. Instead,
+// directories are renamed into $LAMINAR_HOME/.trash, which is instant,
+// and a background thread with idle IO priority deletes the contents of
+// the trash. Leader processes may move directories into the trash too,
+// so the thread also rescans it periodically.
+class Trash {
+public:
+    // Creates the trash directory below home and starts the worker
+    explicit Trash(const std::string& home);
+    ~Trash();
+
+    static std::string dirIn(const std::string& home) { return home + "/.trash"; }
+
+    // Moves the file or directory at path into the trash directory, which
+    // must be on the same filesystem. Safe to call from any process.
+    static bool moveInto(const std::string& trashDir, const std::string& path);
+
+    // Moves path into the trash and wakes the worker. Returns false if the
+    // path could not be moved, and the caller should delete it some other way
+    bool discard(const std::string& path);
+
+    struct Stats {
+        // entries in the trash waiting to be deleted
+        uint64_t pending;
+        // entries and files deleted since startup
+        uint64_t removedEntries;
+        uint64_t removedFiles;
+    };
+    Stats stats() const;
+
+private:
+    void worker();
+    void empty(int dirfd);
+    bool removeTree(int parentfd, const char* name);
+
+    std::string dir;
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool notified;
+    std::atomic<bool> stopping;
+    std::atomic<uint64_t> pending;
+    std::atomic<uint64_t> removedEntries;
+    std::atomic<uint64_t> removedFiles;
+    std::thread thread;
+};
+
+#endif // LAMINAR_TRASH_H_
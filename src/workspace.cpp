@@ -0,0 +1,187 @@
+///
+/// Copyright 2022 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#include "workspace.h"
+#include "trash.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/fs.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#ifndef RENAME_EXCHANGE
+#define RENAME_EXCHANGE (1 << 1)
+#endif
+
+namespace {
+
+// Copies a regular file by reflink, or hardlinks it if that's not possible
+bool snapshotFile(int srcfd, int dstfd, const char* name, const struct stat& st, SnapshotMethod& method) {
+    if(method == SnapshotMethod::REFLINK) {
+        int in = openat(srcfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        if(in >= 0) {
+            int out = openat(dstfd, name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+            if(out < 0) {
+                close(in);
+                return false;
+            }
+            if(ioctl(out, FICLONE, in) == 0) {
+                // keep timestamps, otherwise everything looks out of date to make
+                struct timespec times[2] = { st.st_atim, st.st_mtim };
+                futimens(out, times);
+                fchmod(out, st.st_mode & 07777);
+                close(out);
+                close(in);
+                return true;
+            }
+            int err = errno;
+            close(out);
+            close(in);
+            unlinkat(dstfd, name, 0);
+            // the filesystem can't do it, so don't try again for the other files
+            if(err == EOPNOTSUPP || err == ENOTTY || err == EXDEV || err == EINVAL || err == ENOSYS)
+                method = SnapshotMethod::HARDLINK;
+            else
+                return false;
+        }
+        // unreadable files can still be hardlinked
+    }
+    return linkat(srcfd, name, dstfd, name, 0) == 0;
+}
+
+bool snapshotDir(int srcfd, int dstfd, SnapshotMethod& method) {
+    int fd = dup(srcfd);
+    DIR* d = fdopendir(fd);
+    if(!d) {
+        close(fd);
+        return false;
+    }
+    bool ok = true;
+    while(struct dirent* de = readdir(d)) {
+        const char* name = de->d_name;
+        if(strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+            continue;
+        struct stat st;
+        if(fstatat(srcfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+            ok = false;
+            break;
+        }
+        if(S_ISDIR(st.st_mode)) {
+            // writable until populated, in case the original is read-only
+            if(mkdirat(dstfd, name, 0700) != 0) {
+                ok = false;
+                break;
+            }
+            int subsrc = openat(srcfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            int subdst = openat(dstfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            ok = subsrc >= 0 && subdst >= 0 && snapshotDir(subsrc, subdst, method);
+            if(ok) {
+                struct timespec times[2] = { st.st_atim, st.st_mtim };
+                futimens(subdst, times);
+                fchmod(subdst, st.st_mode & 07777);
+            }
+            if(subsrc >= 0)
+                close(subsrc);
+            if(subdst >= 0)
+                close(subdst);
+        } else if(S_ISREG(st.st_mode)) {
+            ok = snapshotFile(srcfd, dstfd, name, st, method);
+        } else if(S_ISLNK(st.st_mode)) {
+            char target[PATH_MAX];
+            ssize_t n = readlinkat(srcfd, name, target, sizeof(target) - 1);
+            if(n >= 0) {
+                target[n] = '\0';
+                ok = symlinkat(target, dstfd, name) == 0;
+            } else {
+                ok = false;
+            }
+        }
+        // sockets, fifos and devices are not copied
+        if(!ok)
+            break;
+    }
+    closedir(d);
+    return ok;
+}
+
+}
+
+bool snapshotWorkspace(const std::string& src, const std::string& dst, SnapshotMethod& method) {
+    method = SnapshotMethod::REFLINK;
+    // A merging run exchanges the workspace under an exclusive lock, so
+    // this must not copy half of the old tree and half of the new one
+    std::string lockPath = src + ".lock";
+    int lockfd = open(lockPath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if(lockfd < 0)
+        return false;
+    flock(lockfd, LOCK_SH);
+    bool ok = false;
+    int srcfd = open(src.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(srcfd >= 0 && mkdir(dst.c_str(), 0755) == 0) {
+        int dstfd = open(dst.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        ok = dstfd >= 0 && snapshotDir(srcfd, dstfd, method);
+        if(dstfd >= 0)
+            close(dstfd);
+    }
+    if(srcfd >= 0)
+        close(srcfd);
+    close(lockfd);
+    return ok;
+}
+
+bool mergeWorkspace(const std::string& snapshot, const std::string& workspace, uint runNumber, const std::string& trashDir) {
+    // The lock file records the number of the run which last merged, so
+    // that a run which finishes after a later one doesn't overwrite its
+    // results. The lock serialises concurrent leaders of the same job
+    std::string lockPath = workspace + ".lock";
+    int fd = open(lockPath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if(fd < 0)
+        return false;
+    flock(fd, LOCK_EX);
+    char buf[32] = {0};
+    if(pread(fd, buf, sizeof(buf) - 1, 0) < 0)
+        buf[0] = '\0';
+    uint lastMerged = strtoul(buf, nullptr, 10);
+
+    bool merged = false;
+    if(runNumber > lastMerged) {
+        if(syscall(SYS_renameat2, AT_FDCWD, snapshot.c_str(), AT_FDCWD, workspace.c_str(), RENAME_EXCHANGE) == 0) {
+            // the snapshot path now holds the previous workspace
+            Trash::moveInto(trashDir, snapshot);
+            merged = true;
+        } else if(errno == ENOENT) {
+            merged = rename(snapshot.c_str(), workspace.c_str()) == 0;
+        }
+        if(merged) {
+            std::string num = std::to_string(runNumber);
+            if(ftruncate(fd, 0) != 0 || pwrite(fd, num.data(), num.size(), 0) != ssize_t(num.size()))
+                fprintf(stderr, "[laminar] Failed to record workspace merge\n");
+        }
+    }
+    close(fd);
+    return merged;
+}
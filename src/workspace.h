@@ -0,0 +1,49 @@
+///
+/// Copyright 2022 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#ifndef LAMINAR_WORKSPACE_H_
+#define LAMINAR_WORKSPACE_H_
+
+#include <string>
+
+// Definition needed for musl
+typedef unsigned int uint;
+
+// With WORKSPACE_MODE=snapshot, each run gets a private copy of the job's
+// workspace, so that parallel runs can't interfere with each other. The
+// copy is made cheaply by sharing the storage of regular files: on
+// filesystems which support reflinks (btrfs, xfs) each file is cloned and
+// can be modified independently. Otherwise the files are hardlinked, which
+// is safe for tools which replace files (such as git and most compilers)
+// but not for tools which modify files in place.
+enum class SnapshotMethod {
+    REFLINK,
+    HARDLINK
+};
+
+// Creates dst (which must not exist) as a snapshot of the directory tree
+// at src, holding a shared lock on src.lock so that no merge replaces src
+// meanwhile. On success, method is the way regular files were copied
+bool snapshotWorkspace(const std::string& src, const std::string& dst, SnapshotMethod& method);
+
+// Atomically exchanges the job's shared workspace with the snapshot of a
+// finished run, unless a later run has already done so. The previous
+// workspace is moved into the trash. Returns true if the merge happened
+bool mergeWorkspace(const std::string& snapshot, const std::string& workspace, uint runNumber, const std::string& trashDir);
+
+#endif // LAMINAR_WORKSPACE_H_
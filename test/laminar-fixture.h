@@ -45,7 +45,7 @@ public:
 
     void SetUp() override {
         tmp.init();
-        server = new Server(*ioContext);
+        server = new Server(*ioContext, spawnerFd);
         laminar = new Laminar(*server, settings);
     }
 
@@ -104,6 +104,12 @@ public:
             std::string content = "EXECUTORS=" + std::to_string(nexec);
             (*f)->writeAll(content);
         }
+        waitForConfigReload();
+    }
+
+    // changes to the configuration are applied after a short delay
+    void waitForConfigReload() {
+        ioContext->lowLevelProvider->getTimer().afterDelay(Server::WATCH_DEBOUNCE + 50 * kj::MILLISECONDS).wait(ioContext->waitScope);
     }
 
     kj::String stripLaminarLogLines(const kj::String& str) {
@@ -151,6 +157,7 @@ public:
     Server* server;
     Laminar* laminar;
     static kj::AsyncIoContext* ioContext;
+    static int spawnerFd;
 };
 
 #endif // LAMINAR_FIXTURE_H_
@@ -20,8 +20,13 @@
 #include "laminar-fixture.h"
 #include "conf.h"
 
+#include <signal.h>
+#include <spawn.h>
+#include <sys/wait.h>
+
 // TODO: consider handling this differently
 kj::AsyncIoContext* LaminarFixture::ioContext;
+int LaminarFixture::spawnerFd;
 
 TEST_F(LaminarFixture, EmptyStatusMessageStructure) {
     auto es = eventSource("/");
@@ -153,6 +158,7 @@ TEST_F(LaminarFixture, Abort) {
 
 TEST_F(LaminarFixture, JobDescription) {
     defineJob("foo", "true", "DESCRIPTION=bar");
+    waitForConfigReload();
     auto es = eventSource("/jobs/foo");
     ioContext->waitScope.poll();
     ASSERT_EQ(1, es->messages().size());
@@ -186,3 +192,424 @@ TEST_F(LaminarFixture, QueueFront) {
     EXPECT_STREQ("job_started", started2["type"].GetString());
     EXPECT_STREQ("foo", started2["data"]["name"].GetString());
 }
+
+TEST_F(LaminarFixture, QueueBatch) {
+    setNumExecutors(0);
+    defineJob("foo", "true");
+    defineJob("bar", "true");
+    auto es = eventSource("/");
+    auto req = client().queueBatchRequest();
+    auto jobs = req.initJobs(3);
+    jobs[0].setJobName("foo");
+    jobs[1].setJobName("nonexistent");
+    jobs[2].setJobName("bar");
+    auto res = req.send().wait(ioContext->waitScope);
+    EXPECT_EQ(LaminarCi::MethodResult::FAILED, res.getResult());
+    ASSERT_EQ(3, res.getBuildNums().size());
+    EXPECT_EQ(1, res.getBuildNums()[0]);
+    EXPECT_EQ(0, res.getBuildNums()[1]);
+    EXPECT_EQ(1, res.getBuildNums()[2]);
+    ioContext->waitScope.poll();
+    ASSERT_EQ(3, es->messages().size());
+    auto queued1 = es->messages().at(1).GetObject();
+    EXPECT_STREQ("foo", queued1["data"]["name"].GetString());
+    EXPECT_EQ(0, queued1["data"]["queueIndex"].GetInt());
+    auto queued2 = es->messages().at(2).GetObject();
+    EXPECT_STREQ("bar", queued2["data"]["name"].GetString());
+    EXPECT_EQ(1, queued2["data"]["queueIndex"].GetInt());
+}
+
+class LogCollector : public LaminarCi::LogSink::Server {
+public:
+    LogCollector(std::string& output, bool& finished) : output(output), finished(finished) {}
+protected:
+    kj::Promise<void> write(WriteContext context) override {
+        auto chunk = context.getParams().getChunk();
+        output.append(reinterpret_cast<const char*>(chunk.begin()), chunk.size());
+        return kj::READY_NOW;
+    }
+    kj::Promise<void> done(DoneContext context) override {
+        finished = true;
+        return kj::READY_NOW;
+    }
+private:
+    std::string& output;
+    bool& finished;
+};
+
+TEST_F(LaminarFixture, FollowLog) {
+    defineJob("foo", "echo hello; echo world");
+    auto run = runJob("foo");
+    for(uint64_t offset : {uint64_t(0), uint64_t(run.log.size() - 6)}) {
+        std::string output;
+        bool done = false;
+        auto req = client().followRequest();
+        req.getRun().setJob("foo");
+        req.getRun().setBuildNum(1);
+        req.setFromOffset(offset);
+        req.setUntilComplete(true);
+        req.setSink(kj::heap<LogCollector>(output, done));
+        auto res = req.send().wait(ioContext->waitScope);
+        EXPECT_EQ(LaminarCi::MethodResult::SUCCESS, res.getResult());
+        EXPECT_TRUE(done);
+        EXPECT_EQ(std::string(run.log.cStr() + offset), output);
+    }
+    EXPECT_STREQ("world\n", run.log.cStr() + run.log.size() - 6);
+}
+
+class EventCollector : public LaminarCi::EventListener::Server {
+public:
+    EventCollector(std::vector<std::pair<LaminarCi::Event::Kind, std::string>>& events) : events(events) {}
+protected:
+    kj::Promise<void> event(EventContext context) override {
+        auto e = context.getParams().getEvent();
+        events.emplace_back(e.getKind(), e.getRun().getJob());
+        return kj::READY_NOW;
+    }
+private:
+    std::vector<std::pair<LaminarCi::Event::Kind, std::string>>& events;
+};
+
+TEST_F(LaminarFixture, SubscribeEvents) {
+    defineJob("foo", "true");
+    defineJob("bar", "true");
+    std::vector<std::pair<LaminarCi::Event::Kind, std::string>> events;
+    auto req = client().subscribeRequest();
+    req.getFilter().initJobs(1).set(0, "f*");
+    req.setListener(kj::heap<EventCollector>(events));
+    auto subscription = req.send().wait(ioContext->waitScope).getSubscription();
+    runJob("bar");
+    runJob("foo");
+    ioContext->waitScope.poll();
+    ASSERT_EQ(3, events.size());
+    EXPECT_EQ(LaminarCi::Event::Kind::QUEUED, events[0].first);
+    EXPECT_EQ(LaminarCi::Event::Kind::STARTED, events[1].first);
+    EXPECT_EQ(LaminarCi::Event::Kind::COMPLETED, events[2].first);
+    for(auto& e : events)
+        EXPECT_EQ("foo", e.second);
+}
+
+TEST_F(LaminarFixture, QueryRuns) {
+    defineJob("foo", "[ \"$fail\" != 1 ]");
+    runJob("foo");
+    runJob("foo", StringMap{{"fail", "1"}});
+    runJob("foo");
+
+    auto get = client().getRunRequest();
+    get.getRun().setJob("foo");
+    get.getRun().setBuildNum(2);
+    auto run = get.send().wait(ioContext->waitScope);
+    ASSERT_EQ(LaminarCi::MethodResult::SUCCESS, run.getResult());
+    EXPECT_EQ(LaminarCi::JobResult::FAILED, run.getInfo().getResult());
+    EXPECT_STREQ("default", run.getInfo().getContext().cStr());
+    EXPECT_NE(0, run.getInfo().getCompletedAt());
+
+    get.getRun().setBuildNum(4);
+    EXPECT_EQ(LaminarCi::MethodResult::FAILED, get.send().wait(ioContext->waitScope).getResult());
+
+    auto list = client().listRunsRequest();
+    list.setJob("foo");
+    list.setLimit(2);
+    auto page1 = list.send().wait(ioContext->waitScope);
+    ASSERT_EQ(2, page1.getRuns().size());
+    EXPECT_EQ(3, page1.getRuns()[0].getRun().getBuildNum());
+    EXPECT_EQ(2, page1.getRuns()[1].getRun().getBuildNum());
+    list.setCursor(page1.getNextCursor());
+    auto page2 = list.send().wait(ioContext->waitScope);
+    ASSERT_EQ(1, page2.getRuns().size());
+    EXPECT_EQ(1, page2.getRuns()[0].getRun().getBuildNum());
+    EXPECT_EQ(0, page2.getNextCursor());
+
+    list.setCursor(0);
+    list.setResultFilter(LaminarCi::JobResult::SUCCESS);
+    auto successes = list.send().wait(ioContext->waitScope);
+    ASSERT_EQ(2, successes.getRuns().size());
+    EXPECT_EQ(3, successes.getRuns()[0].getRun().getBuildNum());
+    EXPECT_EQ(1, successes.getRuns()[1].getRun().getBuildNum());
+}
+
+class FakeExecutor : public LaminarCi::Executor::Server {
+protected:
+    kj::Promise<void> execute(ExecuteContext context) override {
+        auto output = context.getParams().getOutput();
+        auto log = output.logRequest();
+        log.setChunk(kj::StringPtr("remote\n").asBytes());
+        auto artifact = output.artifactRequest();
+        artifact.setFilename("dir/out.txt");
+        artifact.setData(kj::StringPtr("data").asBytes());
+        return log.send().then([artifact=kj::mv(artifact)]() mutable {
+            return artifact.send();
+        }).then([output]() mutable {
+            return output.doneRequest().send().ignoreResult();
+        }).then([context]() mutable {
+            context.getResults().setResult(LaminarCi::JobResult::SUCCESS);
+        });
+    }
+};
+
+TEST_F(LaminarFixture, RemoteAgent) {
+    defineJob("foo", "false", "CONTEXTS=remote");
+    waitForConfigReload();
+    auto req = client().registerAgentRequest();
+    req.setName("agent1");
+    auto ctx = req.initContexts(1);
+    ctx[0].setName("remote");
+    ctx[0].setExecutors(1);
+    req.setExecutor(kj::heap<FakeExecutor>());
+    auto registration = req.send().wait(ioContext->waitScope).getRegistration();
+
+    auto run = runJob("foo");
+    EXPECT_EQ(LaminarCi::JobResult::SUCCESS, run.result);
+    EXPECT_EQ("remote\n", std::string(stripLaminarLogLines(run.log).cStr()));
+    EXPECT_EQ("data", tmp.fs->openFile(kj::Path{"archive", "foo", "1", "dir", "out.txt"})->readAllText());
+
+    // the name is taken while the first agent is connected
+    auto req2 = client().registerAgentRequest();
+    req2.setName("agent1");
+    req2.setExecutor(kj::heap<FakeExecutor>());
+    EXPECT_ANY_THROW(req2.send().wait(ioContext->waitScope));
+}
+
+// A real agent: this test binary started with --agent (see main.cpp) in its
+// own LAMINAR_HOME, connected to the fixture's server
+class AgentProcess {
+public:
+    AgentProcess(const std::string& server, const char* name, const TempDir& home) {
+        std::string vars[] = {
+            "LAMINAR_HOST=" + server,
+            std::string("LAMINAR_HOME=") + home.path.toString(true).cStr(),
+            std::string("LAMINAR_AGENT_NAME=") + name,
+            "LAMINAR_AGENT_CONTEXTS=remote:1",
+            std::string("PATH=") + (getenv("PATH") ?: "/usr/bin:/bin"),
+        };
+        char* envp[] = { &vars[0][0], &vars[1][0], &vars[2][0], &vars[3][0], &vars[4][0], nullptr };
+        char* argv[] = { const_cast<char*>("laminar-tests"), const_cast<char*>("--agent"), nullptr };
+        LASSERT(posix_spawn(&pid, "/proc/self/exe", nullptr, nullptr, argv, envp) == 0, "could not start agent");
+    }
+    ~AgentProcess() {
+        kill(pid, SIGTERM);
+        waitpid(pid, nullptr, 0);
+    }
+private:
+    pid_t pid;
+};
+
+TEST_F(LaminarFixture, LocalAgents) {
+    // the server only needs to know the jobs, the agents execute their own copies
+    defineJob("foo", "false", "CONTEXTS=remote");
+    defineJob("slow", "false", "CONTEXTS=remote");
+    waitForConfigReload();
+    TempDir home1, home2;
+    for(TempDir* home : {&home1, &home2}) {
+        home->init();
+        home->fs->openFile(kj::Path{"cfg", "jobs", "foo.run"}, kj::WriteMode::CREATE | kj::WriteMode::EXECUTABLE)
+            ->writeAll("#!/bin/sh\necho agent\nmkdir -p $ARCHIVE/dir\necho data > $ARCHIVE/dir/out.txt\n");
+        home->fs->openFile(kj::Path{"cfg", "jobs", "slow.run"}, kj::WriteMode::CREATE | kj::WriteMode::EXECUTABLE)
+            ->writeAll("#!/bin/sh\nsleep 30\n");
+    }
+    AgentProcess agent1(bind_rpc, "agent1", home1);
+    AgentProcess agent2(bind_rpc, "agent2", home2);
+
+    // each agent has one executor, so while one executes slow, the other executes foo
+    auto slowReq = client().runRequest();
+    slowReq.setJobName("slow");
+    auto slow = slowReq.send();
+    time_t start = time(nullptr);
+    auto run = runJob("foo");
+    EXPECT_EQ(LaminarCi::JobResult::SUCCESS, run.result);
+    EXPECT_EQ("agent\n", std::string(stripLaminarLogLines(run.log).cStr()));
+    EXPECT_EQ("data\n", tmp.fs->openFile(kj::Path{"archive", "foo", "1", "dir", "out.txt"})->readAllText());
+    // once uploaded, the agent keeps neither the archive nor the run directory
+    for(TempDir* home : {&home1, &home2}) {
+        EXPECT_FALSE(home->fs->exists(kj::Path{"archive", "foo", "1"}));
+        EXPECT_FALSE(home->fs->exists(kj::Path{"run", "foo", "1"}));
+    }
+
+    auto abort = client().abortRequest();
+    abort.getRun().setJob("slow");
+    abort.getRun().setBuildNum(1);
+    EXPECT_EQ(LaminarCi::MethodResult::SUCCESS, abort.send().wait(ioContext->waitScope).getResult());
+    EXPECT_EQ(LaminarCi::JobResult::ABORTED, slow.wait(ioContext->waitScope).getResult());
+    EXPECT_LT(time(nullptr) - start, 20);
+}
+
+class RunCollector : public LaminarCi::RunListener::Server {
+public:
+    RunCollector(std::vector<std::pair<uint, LaminarCi::JobResult>>& results) : results(results) {}
+protected:
+    kj::Promise<void> finished(FinishedContext context) override {
+        results.emplace_back(context.getParams().getRun().getBuildNum(), context.getParams().getResult());
+        return kj::READY_NOW;
+    }
+private:
+    std::vector<std::pair<uint, LaminarCi::JobResult>>& results;
+};
+
+TEST_F(LaminarFixture, WaitAll) {
+    defineJob("foo", "[ \"$fail\" != 1 ]");
+    runJob("foo");
+    setNumExecutors(0);
+    auto queue = client().queueBatchRequest();
+    auto jobs = queue.initJobs(2);
+    jobs[0].setJobName("foo");
+    jobs[1].setJobName("foo");
+    jobs[1].initParams(1)[0].setName("fail");
+    jobs[1].getParams()[0].setValue("1");
+    queue.send().wait(ioContext->waitScope);
+
+    std::vector<std::pair<uint, LaminarCi::JobResult>> results;
+    auto req = client().waitAllRequest();
+    auto runs = req.initRuns(4);
+    for(uint i = 0; i < 4; ++i) {
+        runs[i].setJob("foo");
+        runs[i].setBuildNum(i + 1);
+    }
+    req.setListener(kj::heap<RunCollector>(results));
+    auto res = req.send();
+    ioContext->waitScope.poll();
+    // the finished run and the unknown one are reported immediately
+    ASSERT_EQ(2, results.size());
+    EXPECT_EQ(1, results[0].first);
+    EXPECT_EQ(LaminarCi::JobResult::SUCCESS, results[0].second);
+    EXPECT_EQ(4, results[1].first);
+    EXPECT_EQ(LaminarCi::JobResult::UNKNOWN, results[1].second);
+
+    setNumExecutors(1);
+    EXPECT_EQ(LaminarCi::MethodResult::FAILED, res.wait(ioContext->waitScope).getResult());
+    ASSERT_EQ(4, results.size());
+    EXPECT_EQ(2, results[2].first);
+    EXPECT_EQ(LaminarCi::JobResult::SUCCESS, results[2].second);
+    EXPECT_EQ(3, results[3].first);
+    EXPECT_EQ(LaminarCi::JobResult::FAILED, results[3].second);
+}
+
+TEST_F(LaminarFixture, ParallelSteps) {
+    defineJob("foo", "true", "PARALLEL_STEPS=3");
+    for(auto step : {std::make_pair("a", "echo hello; echo $STEP"), std::make_pair("b", "sleep 0.5; false"), std::make_pair("c", "sleep 30")}) {
+        KJ_IF_MAYBE(f, tmp.fs->tryOpenFile(kj::Path{"cfg", "jobs", "foo.d", std::string(step.first) + ".run"},
+                kj::WriteMode::CREATE | kj::WriteMode::CREATE_PARENT | kj::WriteMode::EXECUTABLE)) {
+            (*f)->writeAll(std::string("#!/bin/sh\n") + step.second + "\n");
+        }
+    }
+    waitForConfigReload();
+    time_t start = time(nullptr);
+    auto run = runJob("foo");
+    // the failure of b stops c
+    EXPECT_EQ(LaminarCi::JobResult::FAILED, run.result);
+    EXPECT_LT(time(nullptr) - start, 10);
+    std::string log = stripLaminarLogLines(run.log).cStr();
+    EXPECT_NE(std::string::npos, log.find("[a] hello\n[a] a\n"));
+}
+
+TEST_F(LaminarFixture, RunSteps) {
+    defineJob("foo", "false");
+    KJ_IF_MAYBE(f, tmp.fs->tryOpenFile(kj::Path{"cfg", "jobs", "foo.before"},
+            kj::WriteMode::CREATE | kj::WriteMode::EXECUTABLE)) {
+        (*f)->writeAll("#!/bin/sh\ntrue\n");
+    }
+    runJob("foo");
+    auto es = eventSource("/jobs/foo/1");
+    ioContext->waitScope.poll();
+    ASSERT_EQ(1, es->messages().size());
+    auto steps = es->messages().front().GetObject()["data"]["steps"].GetArray();
+    ASSERT_EQ(2, steps.Size());
+    EXPECT_STREQ("jobs/foo.before", steps[0]["name"].GetString());
+    EXPECT_STREQ("success", steps[0]["result"].GetString());
+    EXPECT_STREQ("jobs/foo.run", steps[1]["name"].GetString());
+    EXPECT_STREQ("failed", steps[1]["result"].GetString());
+    EXPECT_LE(steps[0]["completed"].GetInt64(), steps[1]["started"].GetInt64());
+}
+
+TEST_F(LaminarFixture, ArtifactEvents) {
+    defineJob("foo", "echo x > $ARCHIVE/a; echo y > $ARCHIVE/b; mv $ARCHIVE/b $ARCHIVE/c");
+    auto es = eventSource("/jobs/foo/1");
+    runJob("foo");
+
+    // each file once, when it was written or moved in
+    std::vector<std::string> added;
+    for(const rapidjson::Document& d : es->messages())
+        if(std::string(d["type"].GetString()) == "artifact_added")
+            added.push_back(d["data"]["filename"].GetString());
+    EXPECT_EQ((std::vector<std::string>{"a", "b", "c"}), added);
+}
+
+TEST_F(LaminarFixture, CacheKey) {
+    defineJob("foo", "echo ran; echo $commit > $ARCHIVE/out", "CACHE_KEY=commit");
+    auto run = runJob("foo", StringMap({{"commit", "a"}}));
+    EXPECT_EQ(LaminarCi::JobResult::SUCCESS, run.result);
+    // the same key reuses the result and the archive of the first run
+    run = runJob("foo", StringMap({{"commit", "a"}}));
+    EXPECT_EQ(LaminarCi::JobResult::SUCCESS, run.result);
+    std::string log = stripLaminarLogLines(run.log).cStr();
+    EXPECT_EQ(std::string::npos, log.find("ran"));
+    EXPECT_NE(std::string::npos, std::string(run.log.cStr()).find("Reusing the result of run #1"));
+    EXPECT_EQ("a\n", tmp.fs->openFile(kj::Path{"archive", "foo", "2", "out"})->readAllText());
+    // a different key executes the job
+    run = runJob("foo", StringMap({{"commit", "b"}}));
+    EXPECT_EQ(LaminarCi::JobResult::SUCCESS, run.result);
+    EXPECT_EQ("ran\n", std::string(stripLaminarLogLines(run.log).cStr()));
+}
+
+TEST_F(LaminarFixture, CacheKeyCompressedArchive) {
+    defineJob("foo", "seq 1000 > $ARCHIVE/out", "CACHE_KEY=commit\nARCHIVE_COMPRESS=1");
+    EXPECT_EQ(LaminarCi::JobResult::SUCCESS, runJob("foo", StringMap({{"commit", "a"}})).result);
+    // the original is removed once the compression is recorded
+    kj::Path original{"archive", "foo", "1", "out"};
+    for(int i = 0; i < 100 && tmp.fs->exists(original); ++i)
+        ioContext->lowLevelProvider->getTimer().afterDelay(50 * kj::MILLISECONDS).wait(ioContext->waitScope);
+    ASSERT_FALSE(tmp.fs->exists(original));
+
+    EXPECT_EQ(LaminarCi::JobResult::SUCCESS, runJob("foo", StringMap({{"commit", "a"}})).result);
+    // the reused run has the same artifact, not one named out.gz
+    EXPECT_TRUE(tmp.fs->exists(kj::Path{"archive", "foo", "2", "out.gz"}));
+    kj::HttpHeaderTable headerTable;
+    auto response = kj::newHttpClient(ioContext->lowLevelProvider->getTimer(), headerTable,
+                                      *ioContext->provider->getNetwork().parseAddress(bind_http.c_str()).wait(ioContext->waitScope))
+            ->request(kj::HttpMethod::GET, "/archive/foo/2/out", kj::HttpHeaders(headerTable)).response.wait(ioContext->waitScope);
+    ASSERT_EQ(200, response.statusCode);
+    std::string content = response.body->readAllText().wait(ioContext->waitScope).cStr();
+    // the output of seq 1000, decompressed for a client which didn't ask for gzip
+    EXPECT_EQ(3893, content.size());
+    EXPECT_EQ(0, content.find("1\n2\n3\n"));
+}
+
+TEST_F(LaminarFixture, CacheKeyDuringCompression) {
+    // large enough that the compression of the first run's archive is
+    // still in progress when the second run reuses it
+    defineJob("foo", "seq 3000000 > $ARCHIVE/out", "CACHE_KEY=commit\nARCHIVE_COMPRESS=1");
+    EXPECT_EQ(LaminarCi::JobResult::SUCCESS, runJob("foo", StringMap({{"commit", "a"}})).result);
+    EXPECT_EQ(LaminarCi::JobResult::SUCCESS, runJob("foo", StringMap({{"commit", "a"}})).result);
+    kj::Path original{"archive", "foo", "1", "out"};
+    for(int i = 0; i < 200 && tmp.fs->exists(original); ++i)
+        ioContext->lowLevelProvider->getTimer().afterDelay(50 * kj::MILLISECONDS).wait(ioContext->waitScope);
+    ASSERT_FALSE(tmp.fs->exists(original));
+
+    // whichever form was linked, the reused run serves the same content
+    kj::HttpHeaderTable headerTable;
+    auto client = kj::newHttpClient(ioContext->lowLevelProvider->getTimer(), headerTable,
+                                    *ioContext->provider->getNetwork().parseAddress(bind_http.c_str()).wait(ioContext->waitScope));
+    auto get = [&](kj::StringPtr url) {
+        auto response = client->request(kj::HttpMethod::GET, url, kj::HttpHeaders(headerTable)).response.wait(ioContext->waitScope);
+        EXPECT_EQ(200, response.statusCode);
+        return std::string(response.body->readAllText().wait(ioContext->waitScope).cStr());
+    };
+    std::string content = get("/archive/foo/1/out");
+    EXPECT_EQ(0, content.find("1\n2\n3\n"));
+    EXPECT_EQ(content, get("/archive/foo/2/out"));
+}
+
+TEST_F(LaminarFixture, CollectArchivesWithoutTrash) {
+    defineJob("foo", "echo x > $ARCHIVE/out", "KEEP_ARCHIVES=1");
+    runJob("foo");
+    runJob("foo");
+    // as if archive/ were on another filesystem than the trash
+    tmp.fs->remove(kj::Path{".trash"});
+    tmp.fs->openFile(kj::Path{".trash"}, kj::WriteMode::CREATE);
+
+    EXPECT_FALSE(laminar->collectArchives());
+    kj::Path expired{"archive", "foo", "1"};
+    for(int i = 0; i < 100 && tmp.fs->exists(expired); ++i)
+        ioContext->lowLevelProvider->getTimer().afterDelay(50 * kj::MILLISECONDS).wait(ioContext->waitScope);
+    EXPECT_FALSE(tmp.fs->exists(expired));
+    EXPECT_TRUE(tmp.fs->exists(kj::Path{"archive", "foo", "2", "out"}));
+}
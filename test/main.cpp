@@ -21,18 +21,25 @@
 #include <kj/debug.h>
 
 #include "laminar-fixture.h"
+#include "agent.h"
 #include "leader.h"
+#include "spawner.h"
 
-// gtest main supplied in order to call captureChildExit and handle process leader
+// gtest main supplied in order to start the spawner helper and handle process leader
 int main(int argc, char **argv) {
     if(argv[0][0] == '{')
         return leader_main();
 
+    // agents started by the functional tests, see AgentProcess
+    if(argc > 1 && strcmp(argv[1], "--agent") == 0)
+        return agent_main(Spawner::startHelper());
+
+    LaminarFixture::spawnerFd = Spawner::startHelper();
+
     // TODO: consider handling this differently
     auto ioContext = kj::setupAsyncIo();
     LaminarFixture::ioContext = &ioContext;
 
-    kj::UnixEventPort::captureChildExit();
     //kj::_::Debug::setLogLevel(kj::_::Debug::Severity::INFO);
 
     ::testing::InitGoogleTest(&argc, argv);
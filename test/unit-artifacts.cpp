@@ -0,0 +1,105 @@
+///
+/// Copyright 2022 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#include "artifacts.h"
+#include "tempdir.h"
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <stdlib.h>
+#include <unistd.h>
+#include <zlib.h>
+
+TEST(ArtifactsTest, IndexArchive) {
+    TempDir tmp;
+    std::string dir = tmp.path.toString(true).cStr();
+    tmp.fs->openFile(kj::Path{"a.txt"}, kj::WriteMode::CREATE)->writeAll("hello");
+    tmp.fs->openFile(kj::Path{"sub", "deeper", "b.bin"}, kj::WriteMode::CREATE | kj::WriteMode::CREATE_PARENT)->writeAll("0123456789");
+    // symlinks are not artifacts
+    tmp.fs->symlink(kj::Path{"link"}, "a.txt", kj::WriteMode::CREATE);
+
+    std::vector<Artifact> artifacts = indexArtifacts(dir);
+    std::sort(artifacts.begin(), artifacts.end(), [](const Artifact& a, const Artifact& b){
+        return a.filename < b.filename;
+    });
+    ASSERT_EQ(2, artifacts.size());
+    EXPECT_EQ("a.txt", artifacts[0].filename);
+    EXPECT_EQ(5, artifacts[0].size);
+    EXPECT_EQ("sub/deeper/b.bin", artifacts[1].filename);
+    EXPECT_EQ(10, artifacts[1].size);
+
+    EXPECT_TRUE(indexArtifacts(dir + "/missing").empty());
+}
+
+TEST(ArtifactsTest, Compress) {
+    TempDir tmp;
+    std::string dir = tmp.path.toString(true).cStr();
+
+    std::string text;
+    for(int i = 0; i < 1000; ++i)
+        text += "test " + std::to_string(i) + " passed\n";
+    tmp.fs->openFile(kj::Path{"report.txt"}, kj::WriteMode::CREATE)->writeAll(text);
+    // incompressible
+    auto random = kj::heapArray<kj::byte>(4096);
+    for(kj::byte& b : random)
+        b = rand() & 0xff;
+    tmp.fs->openFile(kj::Path{"random.bin"}, kj::WriteMode::CREATE)->writeAll(random);
+
+    uint64_t size = 0;
+    EXPECT_TRUE(compressArtifact(dir + "/report.txt", size));
+    EXPECT_LT(size, text.size());
+    // the original is removed by the caller once the compression is recorded
+    EXPECT_EQ(0, access((dir + "/report.txt").c_str(), F_OK));
+    unlink((dir + "/report.txt").c_str());
+    EXPECT_FALSE(compressArtifact(dir + "/random.bin", size));
+    EXPECT_EQ(0, access((dir + "/random.bin").c_str(), F_OK));
+
+    // the archive lists the compressed file, which holds the original content
+    std::vector<Artifact> artifacts = indexArtifacts(dir);
+    ASSERT_EQ(2, artifacts.size());
+    gzFile gz = gzopen((dir + "/report.txt.gz").c_str(), "rb");
+    ASSERT_NE(nullptr, gz);
+    std::string content(text.size() + 1, '\0');
+    EXPECT_EQ(int(text.size()), gzread(gz, &content[0], content.size()));
+    gzclose(gz);
+    content.resize(text.size());
+    EXPECT_EQ(text, content);
+}
+
+TEST(ArtifactsTest, LinkChangedForm) {
+    TempDir tmp;
+    std::string dir = tmp.path.toString(true).cStr();
+    tmp.fs->openFile(kj::Path{"from", "sub", "a"}, kj::WriteMode::CREATE|kj::WriteMode::CREATE_PARENT)->writeAll("a");
+    // compressed after its record was read
+    tmp.fs->openFile(kj::Path{"from", "b.gz"}, kj::WriteMode::CREATE)->writeAll("bb");
+    tmp.fs->openSubdir(kj::Path{"to"}, kj::WriteMode::CREATE);
+
+    std::vector<StoredArtifact> files{
+        {"sub/a", 1, {}, {}},
+        {"b", 100, {}, std::string("hash")},
+        {"missing", 1, {}, {}},
+    };
+    EXPECT_FALSE(linkArtifacts(dir + "/from", dir + "/to", files));
+    ASSERT_EQ(2, files.size());
+    EXPECT_TRUE(tmp.fs->exists(kj::Path{"to", "sub", "a"}));
+    EXPECT_FALSE(files[0].compressedSize.has_value());
+    // recorded as it was linked
+    EXPECT_TRUE(tmp.fs->exists(kj::Path{"to", "b.gz"}));
+    EXPECT_EQ("b", files[1].filename);
+    EXPECT_EQ(2, files[1].compressedSize.value_or(0));
+    EXPECT_FALSE(files[1].hash.has_value());
+}
@@ -0,0 +1,83 @@
+///
+/// Copyright 2022 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#include "cas.h"
+#include "sha256.h"
+#include "tempdir.h"
+#include <gtest/gtest.h>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static std::string sha256(const std::string& s) {
+    Sha256 sha;
+    sha.update(s.data(), s.size());
+    return sha.hexDigest();
+}
+
+TEST(CasTest, Sha256) {
+    EXPECT_EQ("e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855", sha256(""));
+    EXPECT_EQ("ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad", sha256("abc"));
+    EXPECT_EQ("248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1",
+              sha256("abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq"));
+    // in pieces which don't line up with the blocks
+    Sha256 sha;
+    std::string a(1000000, 'a');
+    for(size_t i = 0; i < a.size(); i += 999)
+        sha.update(a.data() + i, std::min<size_t>(999, a.size() - i));
+    EXPECT_EQ("cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0", sha.hexDigest());
+}
+
+TEST(CasTest, StoreAndPrune) {
+    TempDir tmp;
+    std::string dir = tmp.path.toString(true).cStr();
+    tmp.fs->openFile(kj::Path{"a"}, kj::WriteMode::CREATE)->writeAll("same");
+    tmp.fs->openFile(kj::Path{"b"}, kj::WriteMode::CREATE)->writeAll("same");
+    tmp.fs->openFile(kj::Path{"c"}, kj::WriteMode::CREATE)->writeAll("different");
+
+    ContentStore store(dir + "/cas");
+    ASSERT_TRUE(store.init());
+    std::string hash = store.store(dir + "/a");
+    EXPECT_EQ(sha256("same"), hash);
+    EXPECT_EQ(hash, store.store(dir + "/b"));
+    EXPECT_NE(hash, store.store(dir + "/c"));
+
+    // a and b now share their storage with the blob
+    struct stat sa, sb;
+    ASSERT_EQ(0, stat((dir + "/a").c_str(), &sa));
+    ASSERT_EQ(0, stat((dir + "/b").c_str(), &sb));
+    EXPECT_EQ(sa.st_ino, sb.st_ino);
+    EXPECT_EQ(3, sa.st_nlink);
+
+    // only blobs without archive links are pruned
+    unlink((dir + "/c").c_str());
+    EXPECT_EQ(9, store.prune());
+    EXPECT_EQ(0, store.prune());
+    struct stat sblob;
+    EXPECT_EQ(0, stat((dir + "/cas/" + hash.substr(0, 2) + "/" + hash.substr(2)).c_str(), &sblob));
+}
+
+TEST(CasTest, StoreUnlinked) {
+    TempDir tmp;
+    std::string dir = tmp.path.toString(true).cStr();
+    tmp.fs->openFile(kj::Path{"a"}, kj::WriteMode::CREATE)->writeAll("content");
+
+    // without init the file can't be linked into the store, so it has no hash
+    ContentStore store(dir + "/cas");
+    EXPECT_EQ("", store.store(dir + "/a"));
+}
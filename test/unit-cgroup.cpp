@@ -0,0 +1,45 @@
+///
+/// Copyright 2022 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#include "cgroup.h"
+#include "tempdir.h"
+#include <gtest/gtest.h>
+
+TEST(CgroupTest, ReadResources) {
+    TempDir tmp;
+    std::string dir = tmp.path.toString(true).cStr();
+    auto writeFile = [&](const char* name, const char* content) {
+        tmp.fs->openFile(kj::Path{name}, kj::WriteMode::CREATE)->writeAll(content);
+    };
+
+    // nothing is accounted if the files don't exist
+    RunResources empty = Cgroups::readResources(dir);
+    EXPECT_EQ(0, empty.cpuTime);
+    EXPECT_EQ(0, empty.ioBytes);
+
+    writeFile("cpu.stat", "usage_usec 2500000\nuser_usec 2000000\nsystem_usec 500000\n");
+    writeFile("memory.peak", "104857600\n");
+    writeFile("pids.peak", "12\n");
+    writeFile("io.stat", "8:0 rbytes=1000 wbytes=24 rios=3 wios=1 dbytes=0 dios=0\n"
+                         "8:16 rbytes=0 wbytes=4096 rios=0 wios=1 dbytes=0 dios=0\n");
+    RunResources res = Cgroups::readResources(dir);
+    EXPECT_EQ(2500, res.cpuTime);
+    EXPECT_EQ(104857600, res.peakMemory);
+    EXPECT_EQ(12, res.peakPids);
+    EXPECT_EQ(5120, res.ioBytes);
+}
@@ -17,8 +17,11 @@
 /// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
 ///
 #include "conf.h"
+#include "configuration.h"
 #include "log.h"
+#include "tempdir.h"
 #include <gtest/gtest.h>
+#include <sys/stat.h>
 
 class ConfTest : public ::testing::Test {
 protected:
@@ -62,3 +65,45 @@ TEST_F(ConfTest, Parse) {
 TEST_F(ConfTest, Fallback) {
     EXPECT_EQ("foo", cfg.get("test", std::string("foo")));
 }
+
+TEST_F(ConfTest, Cache) {
+    ConfCache cache;
+    parseConf("foo=bar");
+    EXPECT_EQ("bar", cache.get(tmpFile).get("foo", std::string()));
+    parseConf("foo=bazz");
+    EXPECT_EQ("bazz", cache.get(tmpFile).get("foo", std::string()));
+    EXPECT_TRUE(cache.get("/nonexistent/file.conf").empty());
+}
+
+TEST(ConfigurationTest, IncrementalUpdate) {
+    TempDir tmp;
+    tmp.init();
+    std::string cfg = (tmp.path/"cfg").toString(true).cStr();
+    auto writeFile = [&](const char* job, const char* content) {
+        tmp.fs->openFile(kj::Path{"cfg", "jobs", job}, kj::WriteMode::CREATE | kj::WriteMode::MODIFY)->writeAll(content);
+    };
+    writeFile("foo.conf", "CONTEXTS=a,b\nTIMEOUT=3");
+    writeFile("bar.conf", "DESCRIPTION=bar");
+
+    ConfCache cache;
+    auto c1 = Configuration::load(cfg, cache);
+    EXPECT_EQ(1, c1->version);
+    EXPECT_EQ(3, c1->job("foo").timeout);
+    EXPECT_EQ(2, c1->job("foo").contextPatterns.size());
+    EXPECT_EQ(1, c1->job("unknown").contextPatterns.count("default"));
+
+    writeFile("foo.conf", "TIMEOUT=42");
+    auto c2 = c1->update({cfg + "/jobs/foo.conf", cfg + "/jobs/foo.run"}, cache);
+    EXPECT_EQ(2, c2->version);
+    EXPECT_EQ(42, c2->job("foo").timeout);
+    EXPECT_EQ(1, c2->job("foo").contextPatterns.count("default"));
+    // the previous snapshot is unchanged, and unchanged entries are shared
+    EXPECT_EQ(3, c1->job("foo").timeout);
+    EXPECT_EQ(c1->jobs.at("bar"), c2->jobs.at("bar"));
+
+    tmp.fs->remove(kj::Path{"cfg", "jobs", "foo.conf"});
+    tmp.fs->remove(kj::Path{"cfg", "jobs", "bar.conf"});
+    auto c3 = c2->update({cfg + "/jobs/foo.conf"}, cache);
+    EXPECT_EQ(0, c3->jobs.count("foo"));
+    EXPECT_EQ(1, c3->jobs.count("bar"));
+}
@@ -0,0 +1,60 @@
+///
+/// Copyright 2022 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#include "samples.h"
+#include <gtest/gtest.h>
+
+TEST(SamplesTest, RoundTrip) {
+    SampleSeries series;
+    EXPECT_TRUE(series.empty());
+    series.append({1, 800, 256 << 20});
+    series.append({2, 1700, 300 << 20});
+    // memory may shrink
+    series.append({3, 1750, 64 << 20});
+
+    std::vector<ResourceSample> samples = SampleSeries::decode(series.data());
+    ASSERT_EQ(3, samples.size());
+    EXPECT_EQ(1, samples[0].time);
+    EXPECT_EQ(800, samples[0].cpuTime);
+    EXPECT_EQ(256 << 20, samples[0].memory);
+    EXPECT_EQ(2, samples[1].time);
+    EXPECT_EQ(1700, samples[1].cpuTime);
+    EXPECT_EQ(300 << 20, samples[1].memory);
+    EXPECT_EQ(3, samples[2].time);
+    EXPECT_EQ(1750, samples[2].cpuTime);
+    EXPECT_EQ(64 << 20, samples[2].memory);
+}
+
+TEST(SamplesTest, Compact) {
+    SampleSeries series;
+    for(uint64_t t = 1; t <= 3600; ++t)
+        series.append({t, t * 900, (512 << 20) + (t % 10) * 4096});
+    // an hour of samples at one per second
+    EXPECT_LT(series.data().size(), 3600 * 6);
+    EXPECT_EQ(3600, SampleSeries::decode(series.data()).size());
+}
+
+TEST(SamplesTest, Truncated) {
+    SampleSeries series;
+    series.append({1, 100000, 1 << 30});
+    series.append({2, 200000, 1 << 30});
+    std::string data = series.data();
+    data.pop_back();
+    // an incomplete sample is dropped
+    EXPECT_EQ(1, SampleSeries::decode(data).size());
+}
@@ -0,0 +1,60 @@
+///
+/// Copyright 2022 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#include "setparams.h"
+#include <gtest/gtest.h>
+
+TEST(SetParamsTest, FramesAcrossReads) {
+    std::string large(100000, 'x');
+    std::string stream = encodeParamFrame({{"foo", "bar"}, {"empty", ""}})
+                       + encodeParamFrame({{"large", large}});
+
+    // the stream arrives in pieces which split frames and fields
+    std::string buffer;
+    ParamList params;
+    for(size_t i = 0; i < stream.size(); i += 7) {
+        buffer.append(stream, i, 7);
+        ASSERT_TRUE(decodeParamFrames(buffer, params));
+    }
+    EXPECT_TRUE(buffer.empty());
+    ASSERT_EQ(3, params.size());
+    EXPECT_EQ("foo", params[0].first);
+    EXPECT_EQ("bar", params[0].second);
+    EXPECT_EQ("empty", params[1].first);
+    EXPECT_EQ("", params[1].second);
+    EXPECT_EQ("large", params[2].first);
+    EXPECT_EQ(large, params[2].second);
+}
+
+TEST(SetParamsTest, MalformedFrame) {
+    // a frame whose field is longer than the frame itself
+    std::string field;
+    appendFrameField(field, "name");
+    std::string frame;
+    appendFrameField(frame, field.substr(0, 6));
+    ParamList params;
+    EXPECT_FALSE(decodeParamFrames(frame, params));
+    EXPECT_TRUE(params.empty());
+}
+
+TEST(SetParamsTest, EscapeValue) {
+    std::string value = "multi\nline \\n value\n";
+    std::string escaped = escapeParamValue(value);
+    EXPECT_EQ(std::string::npos, escaped.find('\n'));
+    EXPECT_EQ(value, unescapeParamValue(escaped));
+}
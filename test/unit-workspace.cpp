@@ -0,0 +1,52 @@
+///
+/// Copyright 2022 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#include "workspace.h"
+#include "tempdir.h"
+#include <gtest/gtest.h>
+#include <string>
+
+TEST(WorkspaceTest, SnapshotAndMerge) {
+    TempDir tmp;
+    std::string dir = tmp.path.toString(true).cStr();
+    std::string ws = dir + "/workspace";
+    auto readFile = [&](kj::Path path) {
+        return std::string(tmp.fs->openFile(path)->readAllText().cStr());
+    };
+    tmp.fs->openFile(kj::Path{"workspace", "src", "main.c"}, kj::WriteMode::CREATE | kj::WriteMode::CREATE_PARENT)->writeAll("int main;");
+    tmp.fs->symlink(kj::Path{"workspace", "link"}, "src/main.c", kj::WriteMode::CREATE);
+    tmp.fs->openSubdir(kj::Path{"trash"}, kj::WriteMode::CREATE);
+
+    SnapshotMethod method;
+    std::string snap = dir + "/snapshot";
+    ASSERT_TRUE(snapshotWorkspace(ws, snap, method));
+    EXPECT_EQ("int main;", readFile(kj::Path{"snapshot", "src", "main.c"}));
+    EXPECT_EQ("int main;", readFile(kj::Path{"snapshot", "link"}));
+
+    // replace rather than modify, which is safe for either method
+    tmp.fs->remove(kj::Path{"snapshot", "src", "main.c"});
+    tmp.fs->openFile(kj::Path{"snapshot", "src", "main.c"}, kj::WriteMode::CREATE)->writeAll("int main();");
+    EXPECT_EQ("int main;", readFile(kj::Path{"workspace", "src", "main.c"}));
+
+    EXPECT_TRUE(mergeWorkspace(snap, ws, 5, dir + "/trash"));
+    EXPECT_EQ("int main();", readFile(kj::Path{"workspace", "src", "main.c"}));
+
+    // a run older than the last merged one is not merged
+    ASSERT_TRUE(snapshotWorkspace(ws, snap, method));
+    EXPECT_FALSE(mergeWorkspace(snap, ws, 4, dir + "/trash"));
+}